@@ -3,106 +3,71 @@
 #include "Formatter.h"
 #include "Exceptions.h"
 
-Layer * BMPFormatter::load(const std::string& path)
+static unsigned readLittle(const char* data, int bytes)
+{
+	unsigned value = 0;
+	for (int i = 0; i < bytes; i++) value |= (unsigned)(unsigned char)data[i] << 8 * i;
+	return value;
+}
+
+struct BMPHeader {
+	unsigned width, height, pixelSize, rowSize;
+	int compression;
+	unsigned masks[4];
+	std::streamoff pixels;
+};
+
+static BMPHeader readHeader(std::istream& FILE)
 {
 	char header[14];
 	char dibStart[4];
 
-	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
-	if (!FILE.is_open()) throw BadPathException("File does not exist");
-
 	FILE.read(header, 14);
 	FILE.read(dibStart, 4);
 
-	unsigned dibSize = (int)(unsigned char)dibStart[0] + ((int)(unsigned char)dibStart[1] << 8) +
-		((int)(unsigned char)dibStart[2] << 16) + ((int)(unsigned char)dibStart[3] << 24);
+	unsigned dibSize = readLittle(dibStart, 4);
+	if (!FILE || dibSize < 20) throw BadFormatException("Not a BMP file");
 
-	char *dib = new char[dibSize - 4];
+	std::vector<char> dib(dibSize - 4 > 52 ? dibSize - 4 : 52, 0);
+	FILE.read(dib.data(), dibSize - 4);
 
-	FILE.read(dib, dibSize - 4);
-
-	unsigned int imageWidth = (int)(unsigned char)dib[0] + ((int)(unsigned char)dib[1] << 8) +
-		((int)(unsigned char)dib[2] << 16) + ((int)(unsigned char)dib[3] << 24);
-
-	unsigned int imageHeight = (int)(unsigned char)dib[4] + ((int)(unsigned char)dib[5] << 8) +
-		((int)(unsigned char)dib[6] << 16) + ((int)(unsigned char)dib[7] << 24);
-
-	unsigned int pixelSize = (int)(unsigned char)dib[10] + ((int)(unsigned char)dib[11] << 8);
-	if (pixelSize != 24 && pixelSize != 32)
+	BMPHeader h;
+	h.width = readLittle(&dib[0], 4);
+	h.height = readLittle(&dib[4], 4);
+	h.pixelSize = readLittle(&dib[10], 2);
+	if (h.pixelSize != 24 && h.pixelSize != 32)
 		throw BadFormatException("Only RGB and RGBA BMP files are supported");
+	h.rowSize = (h.pixelSize * h.width + 31) / 32 * 4;
+	h.compression = readLittle(&dib[12], 4);
+	for (int c = 0; c < 4; c++) h.masks[c] = readLittle(&dib[36 + 4 * c], 4);
+	//pixels are read right after the header, like they always were
+	h.pixels = FILE.tellg();
+	return h;
+}
 
-	Layer *l = new Layer(imageWidth, imageHeight, path);
-	
-	unsigned pixelByteSize = pixelSize / 8;
-	unsigned rowSize = (pixelSize * imageWidth + 31) / 32 * 4;
-
-	char *pixelBuffer = new char[pixelByteSize];
-
-	int compression = (int)(unsigned char)dib[12] + ((int)(unsigned char)dib[13] << 8) +
-		((int)(unsigned char)dib[14] << 16) + ((int)(unsigned char)dib[15] << 24);
-
-	if (compression == 3) {
-		unsigned int redMask = (int)(unsigned char)dib[36] + ((int)(unsigned char)dib[37] << 8) +
-			((int)(unsigned char)dib[38] << 16) + ((int)(unsigned char)dib[39] << 24);
-		unsigned int greenMask = (int)(unsigned char)dib[40] + ((int)(unsigned char)dib[41] << 8) +
-			((int)(unsigned char)dib[42] << 16) + ((int)(unsigned char)dib[43] << 24);
-		unsigned int blueMask = (int)(unsigned char)dib[44] + ((int)(unsigned char)dib[45] << 8) +
-			((int)(unsigned char)dib[46] << 16) + ((int)(unsigned char)dib[47] << 24);
-		unsigned int alphaMask = (int)(unsigned char)dib[48] + ((int)(unsigned char)dib[49] << 8) +
-			((int)(unsigned char)dib[50] << 16) + ((int)(unsigned char)dib[51] << 24);
-
-		for (int i = 0; i < imageHeight; i++) {
-			for (int j = 0; j < imageWidth; j++) {
-				unsigned int tempMask;
-				FILE.read(pixelBuffer, pixelByteSize);
-				unsigned int readPixel = (int)(unsigned char)pixelBuffer[0] + ((int)(unsigned char)pixelBuffer[1] << 8) +
-					((int)(unsigned char)pixelBuffer[2] << 16) + ((int)(unsigned char)pixelBuffer[3] << 24);
-				
-				unsigned int readRed = readPixel & redMask;
-				tempMask = redMask;
-				while (!(tempMask & 1)) { readRed >>= 1, tempMask >>= 1; }
-
-				unsigned int readGreen = readPixel & greenMask;
-				tempMask = greenMask;
-				while (!(tempMask & 1)) { readGreen >>= 1, tempMask >>= 1; }
-
-				unsigned int readBlue = readPixel & blueMask;
-				tempMask = blueMask;
-				while (!(tempMask & 1)) { readBlue >>= 1, tempMask >>= 1; }
-
-				unsigned int readAlpha = readPixel & alphaMask;
-				tempMask = alphaMask;
-				while (!(tempMask & 1)) { readAlpha >>= 1, tempMask >>= 1; }
-
-				(*l)[i][j] = Pixel(readRed,readGreen,readBlue,readAlpha);
-			}
-			for (int j = 0; j < rowSize - pixelByteSize * imageWidth; j++)
-				FILE.read(pixelBuffer, 1);
+static void decodeRow(const BMPHeader& h, const char* row, std::vector<Pixel>& pixels)
+{
+	unsigned pixelByteSize = h.pixelSize / 8;
+	for (unsigned j = 0; j < h.width; j++, row += pixelByteSize) {
+		if (h.compression != 3) {
+			pixels[j] = Pixel((unsigned char)row[2], (unsigned char)row[1], (unsigned char)row[0], 255);
+			continue;
 		}
-	
-	}
-	else {
-		for (int i = 0; i < imageHeight; i++) {
-			for (int j = 0; j < imageWidth; j++) {
-				FILE.read(pixelBuffer, pixelByteSize);
-				(*l)[i][j] = Pixel((unsigned char)pixelBuffer[2],
-					(unsigned char)pixelBuffer[1], (unsigned char)pixelBuffer[0], 255);
-			}
-			for (int j = 0; j < rowSize - pixelByteSize * imageWidth; j++)
-				FILE.read(pixelBuffer, 1);
+		unsigned readPixel = readLittle(row, pixelByteSize);
+		unsigned channels[4];
+		for (int c = 0; c < 4; c++) {
+			unsigned tempMask = h.masks[c];
+			unsigned value = readPixel & tempMask;
+			while (tempMask && !(tempMask & 1)) { value >>= 1, tempMask >>= 1; }
+			channels[c] = value;
 		}
+		pixels[j] = Pixel(channels[0], channels[1], channels[2], channels[3]);
 	}
-
-	FILE.close();
-	return l;
 }
 
-void BMPFormatter::save(const std::string& path)
+static void writeHeader(std::ostream& FILE, int width, int height)
 {
-	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
-	Image *i = Image::getImage();
-
-	unsigned int bmpSize = i->getWidth()*i->getHeight() * 4 + 70;
+	unsigned int bmpSize = width*height * 4 + 70;
 	
 	char header[14];
 
@@ -124,12 +89,12 @@ void BMPFormatter::save(const std::string& path)
 	dib[0] = 56, dib[1] = dib[2] = dib[3] = 0;
 	
 	//sirina slike
-	dib[4] = ((unsigned)i->getWidth()) & 0xFF, dib[5] = ((unsigned)i->getWidth()) >> 8 & 0xFF,
-		dib[6] = ((unsigned)i->getWidth()) >> 16 & 0xFF, dib[7] = ((unsigned)i->getWidth()) >> 24 & 0xFF;
+	dib[4] = ((unsigned)width) & 0xFF, dib[5] = ((unsigned)width) >> 8 & 0xFF,
+		dib[6] = ((unsigned)width) >> 16 & 0xFF, dib[7] = ((unsigned)width) >> 24 & 0xFF;
 
 	//visina slike
-	dib[8] = ((unsigned)i->getHeight()) & 0xFF, dib[9] = ((unsigned)i->getHeight()) >> 8 & 0xFF,
-		dib[10] = ((unsigned)i->getHeight()) >> 16 & 0xFF, dib[11] = ((unsigned)i->getHeight()) >> 24 & 0xFF;
+	dib[8] = ((unsigned)height) & 0xFF, dib[9] = ((unsigned)height) >> 8 & 0xFF,
+		dib[10] = ((unsigned)height) >> 16 & 0xFF, dib[11] = ((unsigned)height) >> 24 & 0xFF;
 
 	//plane neki -> fiksno
 	dib[12] = 1, dib[13] = 0;
@@ -169,20 +134,112 @@ void BMPFormatter::save(const std::string& path)
 	dib[52] = dib[53] = dib[54] =  0, dib[55] = 0xFF;
 
 	FILE.write(dib, 56);
+}
 
-	char pixelBuffer[4];
+static void encodeRow(const std::vector<Pixel>& pixels, char* pixelBuffer)
+{
+	for (const Pixel& tempPixel : pixels) {
+		pixelBuffer[0] = tempPixel.getB();
+		pixelBuffer[1] = tempPixel.getG();
+		pixelBuffer[2] = tempPixel.getR();
+		pixelBuffer[3] = tempPixel.getA();
+		pixelBuffer += 4;
+	}
+}
 
-	for (int j = 0; j < i->getHeight(); j++) {
-		for (int k = 0; k < i->getWidth(); k++) {
-			Pixel tempPixel = i->getPixel(k, j);
-			pixelBuffer[0] = tempPixel.getB();
-			pixelBuffer[1] = tempPixel.getG();
-			pixelBuffer[2] = tempPixel.getR();
-			pixelBuffer[3] = tempPixel.getA();
-
-			FILE.write(pixelBuffer, 4);
+//bmp rows are stored bottom up, the same order strips come in
+class BMPStripReader : public StripReader {
+private:
+	std::ifstream FILE;
+	BMPHeader header;
+	std::vector<char> row;
+public:
+	BMPStripReader(const std::string& path) : FILE(path, std::ifstream::binary | std::ifstream::in) {
+		if (!FILE.is_open()) throw BadPathException("File does not exist");
+		header = readHeader(FILE);
+		row.resize(header.rowSize);
+	}
+
+	int getWidth() const override { return header.width; }
+	int getHeight() const override { return header.height; }
+	void read(int first, std::vector<std::vector<Pixel>>& rows) override {
+		FILE.seekg(header.pixels + (std::streamoff)first * header.rowSize);
+		for (std::vector<Pixel>& pixels : rows) {
+			FILE.read(row.data(), row.size());
+			if (!FILE) throw BadFormatException("BMP file is truncated");
+			pixels.resize(header.width);
+			decodeRow(header, row.data(), pixels);
 		}
 	}
+};
+
+class BMPStripWriter : public StripWriter {
+private:
+	std::ofstream FILE;
+	int width, next;
+	std::vector<char> rowBuffer;
+public:
+	BMPStripWriter(const std::string& path, int width, int height) :
+		FILE(path, std::ofstream::binary | std::ofstream::out), width(width), next(0), rowBuffer((size_t)width * 4) {
+		if (!FILE.is_open()) throw BadPathException("File can't be opened for writing");
+		writeHeader(FILE, width, height);
+	}
+
+	void write(int first, const std::vector<std::vector<Pixel>>& rows) override {
+		if (first != next) throw BadInputException("BMP strips have to be written bottom up");
+		for (const std::vector<Pixel>& pixels : rows) {
+			encodeRow(pixels, rowBuffer.data());
+			FILE.write(rowBuffer.data(), rowBuffer.size());
+		}
+		next += rows.size();
+	}
+	void close() override {
+		FILE.close();
+		if (FILE.fail()) throw BadPathException("File can't be written");
+	}
+};
+
+Layer * BMPFormatter::load(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+	if (!FILE.is_open()) throw BadPathException("File does not exist");
+
+	BMPHeader header = readHeader(FILE);
+	Layer *l = new Layer(header.width, header.height, path);
+
+	std::vector<char> row(header.rowSize);
+	for (unsigned i = 0; i < header.height; i++) {
+		FILE.read(row.data(), row.size());
+		decodeRow(header, row.data(), (*l)[i]);
+	}
+
+	FILE.close();
+	return l;
+}
+
+StripReader * BMPFormatter::openStrips(const std::string & path)
+{
+	return new BMPStripReader(path);
+}
+
+StripWriter * BMPFormatter::createStrips(const std::string & path, int width, int height)
+{
+	return new BMPStripWriter(path, width, height);
+}
+
+void BMPFormatter::write(const Layer& image, const std::string& path)
+{
+	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
+	const Layer *i = &image;
+
+	writeHeader(FILE, i->getWidth(), i->getHeight());
+
+	std::vector<char> rowBuffer(i->getWidth() * 4);
+
+	for (int j = 0; j < i->getHeight(); j++) {
+		encodeRow((*i)[j], rowBuffer.data());
+		FILE.write(rowBuffer.data(), rowBuffer.size());
+	}
 
 	FILE.close();
 }
@@ -0,0 +1,253 @@
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+#include <climits>
+#include <cstdlib>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <windows.h>
+#else
+#include <glob.h>
+#endif
+#include "Batch.h"
+#include "BoundedQueue.h"
+#include "StripPipeline.h"
+#include "ReplayCache.h"
+#include "Image.h"
+#include "Formatter.h"
+#include "Operation.h"
+#include "Program.h"
+#include "Exceptions.h"
+
+static const char *USAGE = "usage: --batch [--workers n] [--strip-rows n] [--accuracy exact|fast] [--replay-cache directory] [--format extension] recipe output-directory [input...]\n"
+	"inputs may be glob patterns, without any they are read from standard input one per line\n";
+
+std::vector<std::string> Batch::expand(const std::string & pattern)
+{
+	std::vector<std::string> paths;
+	if (pattern.find_first_of("*?") == std::string::npos) {
+		paths.push_back(pattern);
+		return paths;
+	}
+#ifdef _WIN32
+	size_t slash = pattern.find_last_of("/\\");
+	std::string directory = slash == std::string::npos ? "" : pattern.substr(0, slash + 1);
+	WIN32_FIND_DATAA found;
+	HANDLE search = FindFirstFileA(pattern.c_str(), &found);
+	if (search == INVALID_HANDLE_VALUE) return paths;
+	do {
+		if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) paths.push_back(directory + found.cFileName);
+	} while (FindNextFileA(search, &found));
+	FindClose(search);
+#else
+	glob_t found;
+	if (glob(pattern.c_str(), 0, nullptr, &found) == 0) {
+		for (size_t i = 0; i < found.gl_pathc; i++) paths.push_back(found.gl_pathv[i]);
+	}
+	globfree(&found);
+#endif
+	return paths;
+}
+
+std::string Batch::outputPath(const std::string & input, const std::string & directory, const std::string & extension)
+{
+	size_t slash = input.find_last_of("/\\");
+	std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+	if (!extension.empty()) {
+		size_t dot = name.find_last_of('.');
+		name = (dot == std::string::npos ? name : name.substr(0, dot)) + "." + extension;
+	}
+	char last = directory.back();
+	return directory + (last == '/' || last == '\\' ? "" : "/") + name;
+}
+
+static unsigned long long hashPath(const std::string& path)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned char c : path) hash = (hash ^ c) * 1099511628211ULL;
+	return hash;
+}
+
+std::string Batch::canonicalPath(const std::string & path)
+{
+	//the file itself may not exist yet, its directory has to
+	size_t slash = path.find_last_of("/\\");
+	std::string directory = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+	std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+#ifdef _WIN32
+	char resolved[_MAX_PATH];
+	if (!_fullpath(resolved, directory.c_str(), _MAX_PATH)) return path;
+#else
+	char resolved[PATH_MAX];
+	if (!realpath(directory.c_str(), resolved)) return path;
+#endif
+	std::string canonical = resolved;
+	char last = canonical.back();
+	return canonical + (last == '/' || last == '\\' ? "" : "/") + name;
+}
+
+void Batch::process(const std::string & input, const std::string & output, const CompositeOperation & o)
+{
+	//with a replay cache the result may already be on disk, streaming would only compute it again
+	bool cached = !ReplayCache::getCache().getDirectory().empty();
+	if (!cached && StripPipeline::run(input, output, o)) return;
+
+	ImageFormatter *reader = ImageFormatter::getReader(input);
+	if (!reader) {
+		if (FormatTable<ImageFormatter>::getExtension(input).empty()) throw BadPathException("Invalid path");
+		throw BadFormatException("Not an image format");
+	}
+	ImageFormatter *writer = ImageFormatter::getWriter(output);
+	if (!writer) {
+		if (FormatTable<ImageFormatter>::getExtension(output).empty()) throw BadPathException("Invalid path to file");
+		throw BadFormatException("Format doesn't exist");
+	}
+
+	//the same steps as a one layer image, without the image every worker would have to share
+	std::unique_ptr<Layer> l;
+	if (cached) {
+		//the recipe is one operation in the history, replay only clones it
+		std::vector<Operation*> operations(1, const_cast<CompositeOperation*>(&o));
+		l.reset(ReplayCache::getCache().replay(input, 0, 0, operations, std::vector<std::vector<Selection*>>(1)));
+		if (!l) throw BadFormatException("Not an image format");
+		l->evaluate();
+	}
+	else {
+		l.reset(reader->load(input));
+		o.operateLayer(l.get(), std::vector<Selection*>(), true);
+	}
+	std::vector<Layer*> layers(1, l.get());
+	std::unique_ptr<Layer> flattened(Image::flattenLayers(layers, Rectangle(0, l->getHeight() - 1, l->getWidth(), l->getHeight())));
+	l.reset();
+	writer->write(*flattened, output);
+}
+
+int Batch::run(const std::vector<std::string>& args)
+{
+	unsigned workers = std::thread::hardware_concurrency();
+	std::string extension;
+	std::vector<std::string> positional;
+	try {
+		for (size_t i = 0; i < args.size(); i++) {
+			const std::string& arg = args[i];
+			bool option = arg.size() > 2 && arg.compare(0, 2, "--") == 0;
+			if (option && i + 1 == args.size()) throw BadInputException("Missing value for " + arg);
+			if (arg == "--workers") workers = std::stoi(args[++i]);
+			else if (arg == "--strip-rows") StripPipeline::setStripRows(std::stoi(args[++i]));
+			else if (arg == "--format") extension = args[++i];
+			else if (arg == "--replay-cache") ReplayCache::getCache().setDirectory(args[++i]);
+			else if (arg == "--accuracy") {
+				const std::string& accuracy = args[++i];
+				if (accuracy == "exact") Program::setAccuracy(Program::EXACT);
+				else if (accuracy == "fast") Program::setAccuracy(Program::FAST);
+				else throw BadInputException("Unknown accuracy " + accuracy);
+			}
+			else if (option) throw BadInputException("Unknown option " + arg);
+			else positional.push_back(arg);
+		}
+		if (positional.size() < 2) throw BadInputException("Missing recipe or output directory");
+	}
+	catch (BadInputException e) {
+		std::cerr << e.getMessage() << '\n' << USAGE;
+		return 2;
+	}
+	catch (BadPathException e) {
+		std::cerr << e.getMessage() << '\n';
+		return 2;
+	}
+	catch (std::logic_error&) {
+		std::cerr << "Invalid number\n" << USAGE;
+		return 2;
+	}
+	if (workers == 0) workers = 1;
+
+	std::unique_ptr<CompositeOperation> o;
+	const std::string& directory = positional[1];
+	try {
+		OperationFormatter *formatter = OperationFormatter::getReader(positional[0]);
+		if (!formatter) throw BadFormatException("Recipe format doesn't exist");
+		o.reset(formatter->loadRunnable(positional[0]));
+
+#ifdef _WIN32
+		_mkdir(directory.c_str());
+#else
+		mkdir(directory.c_str(), 0777);
+#endif
+		struct stat info;
+		if (stat(directory.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR))
+			throw BadPathException("Output directory can't be created");
+	}
+	catch (Exception& e) {
+		std::cerr << e.getMessage() << '\n';
+		return 2;
+	}
+	catch (...) {
+		//rapidxml throws its own errors for a recipe that can't be opened
+		std::cerr << "Recipe can't be loaded\n";
+		return 2;
+	}
+
+	//inputs wait in a short queue, so a long list from standard input is never held whole
+	//only the 8 byte hash of each claimed output stays for the whole run
+	BoundedQueue<std::string> inputs(2 * workers);
+	std::mutex reportLock;
+	bool failed = false;
+	auto report = [&](const std::string& status, const std::string& input, const std::string& detail) {
+		std::lock_guard<std::mutex> guard(reportLock);
+		std::cout << status << '\t' << input << '\t' << detail << std::endl;
+		if (status != "ok") failed = true;
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < workers; i++) {
+		threads.emplace_back([&]() {
+			std::string input;
+			while (inputs.pop(input)) {
+				std::string output = outputPath(input, directory, extension);
+				try {
+					process(input, output, *o);
+					report("ok", input, output);
+				}
+				catch (Exception& e) {
+					report("error", input, e.getMessage());
+				}
+				catch (...) {
+					report("error", input, "Unknown error");
+				}
+			}
+		});
+	}
+
+	//outputs are claimed as inputs arrive, the first input with a name keeps it whichever worker is faster
+	//the set grows by one hash per input, a 64 bit hash makes a false collision practically impossible
+	std::unordered_set<unsigned long long> claimed;
+	auto submit = [&](const std::string& input) {
+		std::string output = canonicalPath(outputPath(input, directory, extension));
+		if (output == canonicalPath(input)) report("error", input, "Output would replace the input");
+		else if (!claimed.insert(hashPath(output)).second) report("error", input, "Same output as an earlier input");
+		else inputs.push(input);
+	};
+
+	if (positional.size() > 2) {
+		for (size_t i = 2; i < positional.size(); i++) {
+			std::vector<std::string> paths = expand(positional[i]);
+			if (paths.empty()) report("error", positional[i], "No files match");
+			for (const std::string& path : paths) submit(path);
+		}
+	}
+	else {
+		std::string line;
+		while (std::getline(std::cin, line)) {
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (!line.empty()) submit(line);
+		}
+	}
+	inputs.close();
+	for (std::thread& t : threads) t.join();
+
+	return failed ? 1 : 0;
+}
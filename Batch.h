@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <vector>
+
+class CompositeOperation;
+
+//one recipe over many images, each written to an output directory under its own name
+//inputs whose output would replace an earlier input's output, or the input itself, are reported as errors
+//every file gets a line on standard output: "ok<tab>input<tab>output" or "error<tab>input<tab>message"
+class Batch {
+private:
+	static std::vector<std::string> expand(const std::string& pattern);
+public:
+	//input's file name in directory, with its extension replaced when one is given
+	static std::string outputPath(const std::string& input, const std::string& directory, const std::string& extension);
+	//absolute path with the directory resolved, so two spellings of one file compare equal
+	static std::string canonicalPath(const std::string& path);
+	//exit status is 0 if every file went through, 1 if some didn't and 2 if nothing could start
+	static int run(const std::vector<std::string>& args);
+	//the operation over the whole image, from the replay cache when one is set, otherwise streamed when the formats allow it
+	static void process(const std::string& input, const std::string& output, const CompositeOperation& o);
+};
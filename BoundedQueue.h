@@ -0,0 +1,51 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+//producers block while it is full, so a fast stage can't run ahead of a slow one
+template<typename T>
+class BoundedQueue {
+private:
+	std::deque<T> items;
+	size_t capacity;
+	bool closed;
+	std::mutex mutex;
+	std::condition_variable notFull, notEmpty;
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false) {}
+
+	//false once the queue is closed, the item is dropped then
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notFull.wait(lock, [this]() { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+	//false without blocking when there is no room
+	bool tryPush(T item) {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (closed || items.size() >= capacity) return false;
+		items.push_back(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+	//false once the queue is closed and drained
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mutex);
+		notEmpty.wait(lock, [this]() { return closed || !items.empty(); });
+		if (items.empty()) return false;
+		item = std::move(items.front());
+		items.pop_front();
+		notFull.notify_one();
+		return true;
+	}
+	void close() {
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
@@ -0,0 +1,586 @@
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include "Formatter.h"
+#include "Image.h"
+#include "MappedFile.h"
+#include "ReplayCache.h"
+#include "ThreadPool.h"
+#include "Exceptions.h"
+
+//layout: header, chunk directory, then the chunks themselves
+//every number is little endian, chunks refer to each other by directory index
+static const char magic[8] = { '\x89', 'D', 'R', 'B', '\r', '\n', '\x1a', '\n' };
+static const unsigned VERSION = 1;
+static const size_t HEADER_SIZE = 24;
+static const size_t DIRECTORY_ENTRY_SIZE = 20;
+static const size_t LAYER_ENTRY_SIZE = 12;
+//groups nested deeper than this are taken as a corrupted file
+static const size_t MAX_GROUP_DEPTH = 64;
+
+enum Opcode { BASIC_OPERATION, COMPOSITE_OPERATION };
+//last byte of a layer table entry
+enum LayerFlags { ADJUSTMENT_LAYER = 1, GROUP_LAYER = 2 };
+
+struct Chunk {
+	char type[4];
+	unsigned long long offset, size;
+};
+
+class ChunkWriter {
+private:
+	std::vector<unsigned char> bytes;
+public:
+	const std::vector<unsigned char>& getBytes() const { return bytes; }
+
+	void u8(unsigned char value) { bytes.push_back(value); }
+	void u32(unsigned value) { for (int i = 0; i < 32; i += 8) bytes.push_back(value >> i & 0xFF); }
+	void i32(int value) { u32((unsigned)value); }
+	void u64(unsigned long long value) { for (int i = 0; i < 64; i += 8) bytes.push_back(value >> i & 0xFF); }
+	void f64(double value) {
+		unsigned long long bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		u64(bits);
+	}
+	void str(const std::string& value) {
+		u32(value.size());
+		bytes.insert(bytes.end(), value.begin(), value.end());
+	}
+	void raw(const unsigned char* data, size_t size) { bytes.insert(bytes.end(), data, data + size); }
+	void rect(const Rectangle& r) { i32(r.getX()); i32(r.getY()); i32(r.getWidth()); i32(r.getHeight()); }
+
+	void operation(const Operation *o) {
+		const CompositeOperation *composite = dynamic_cast<const CompositeOperation*>(o);
+		if (composite) {
+			u8(COMPOSITE_OPERATION);
+			str(o->getName());
+			u32(composite->getOperations().size());
+			for (Operation *child : composite->getOperations()) operation(child);
+		}
+		else {
+			u8(BASIC_OPERATION);
+			str(o->getName());
+			std::vector<double> params = o->getParams();
+			u8(params.size());
+			for (double p : params) f64(p);
+		}
+	}
+	void rects(Selection *s) {
+		std::vector<Rectangle> rects(s->begin(), s->end());
+		u32(rects.size());
+		for (const Rectangle& r : rects) rect(r);
+	}
+};
+
+class ChunkReader {
+private:
+	const unsigned char *data;
+	size_t pos, size;
+public:
+	ChunkReader(const unsigned char* data, size_t size) : data(data), pos(0), size(size) {}
+
+	void seek(size_t pos) {
+		if (pos > size) throw BadFormatException("DRB file is truncated");
+		this->pos = pos;
+	}
+	const unsigned char* raw(size_t count) {
+		if (size - pos < count) throw BadFormatException("DRB file is truncated");
+		const unsigned char *current = data + pos;
+		pos += count;
+		return current;
+	}
+
+	unsigned char u8() { return *raw(1); }
+	unsigned u32() {
+		const unsigned char *b = raw(4);
+		return (unsigned)b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+	}
+	int i32() { return (int)u32(); }
+	unsigned long long u64() {
+		unsigned long long low = u32();
+		return low | (unsigned long long)u32() << 32;
+	}
+	double f64() {
+		unsigned long long bits = u64();
+		double value;
+		std::memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+	std::string str() {
+		unsigned length = u32();
+		const unsigned char *b = raw(length);
+		return std::string((const char*)b, length);
+	}
+	Rectangle rect() {
+		int x = i32(), y = i32(), width = i32(), height = i32();
+		return Rectangle(x, y, width, height);
+	}
+
+	Operation* operation() {
+		unsigned char opcode = u8();
+		std::string name = str();
+		if (opcode == COMPOSITE_OPERATION) {
+			CompositeOperation *composite = new CompositeOperation(name);
+			unsigned count = u32();
+			try {
+				for (unsigned i = 0; i < count; i++) {
+					Operation *child = operation();
+					composite->addOperation(child);
+					delete child;
+				}
+			}
+			catch (...) {
+				delete composite;
+				throw;
+			}
+			return composite;
+		}
+		if (opcode != BASIC_OPERATION) throw BadFormatException("Unknown DRB operation");
+
+		Operation *basic = Operation::getOperation(name);
+		if (!basic) throw BadFormatException("Unknown operation " + name);
+		std::vector<double> params(u8());
+		for (double& p : params) p = f64();
+		if ((int)params.size() != basic->numOfParams()) throw BadFormatException("Wrong number of parameters for " + name);
+
+		basic = basic->clone();
+		if (!params.empty()) basic->setParams(params);
+		return basic;
+	}
+	std::vector<Rectangle> rects() {
+		std::vector<Rectangle> rects;
+		unsigned count = u32();
+		for (unsigned i = 0; i < count; i++) rects.push_back(rect());
+		return rects;
+	}
+};
+
+class ChunkDirectory {
+private:
+	const MappedFile& file;
+	std::vector<Chunk> chunks;
+	int width, height;
+public:
+	ChunkDirectory(const MappedFile& file) : file(file) {
+		if (file.getSize() < HEADER_SIZE || std::memcmp(file.getData(), magic, 8) != 0)
+			throw BadFormatException("Not a DRB file");
+
+		ChunkReader header(file.getData(), file.getSize());
+		header.seek(8);
+		if (header.u32() > VERSION) throw BadFormatException("Unsupported DRB version");
+		width = header.i32();
+		height = header.i32();
+		if (width < 0 || height < 0) throw BadFormatException("DRB image size is corrupted");
+
+		//the count is checked against the file before anything that big is allocated
+		unsigned count = header.u32();
+		if (count > (file.getSize() - HEADER_SIZE) / DIRECTORY_ENTRY_SIZE) throw BadFormatException("DRB file is truncated");
+		chunks.resize(count);
+		for (Chunk& c : chunks) {
+			std::memcpy(c.type, header.raw(4), 4);
+			c.offset = header.u64();
+			c.size = header.u64();
+			if (c.offset > file.getSize() || c.size > file.getSize() - c.offset)
+				throw BadFormatException("DRB file is truncated");
+		}
+	}
+
+	int getWidth() const { return width; }
+	int getHeight() const { return height; }
+
+	int find(const char* type) const {
+		for (size_t i = 0; i < chunks.size(); i++)
+			if (std::memcmp(chunks[i].type, type, 4) == 0) return i;
+		throw BadFormatException(std::string("DRB file has no ") + type + " chunk");
+	}
+	ChunkReader open(int index, const char* type) const {
+		if (index < 0 || index >= (int)chunks.size() || std::memcmp(chunks[index].type, type, 4) != 0)
+			throw BadFormatException("DRB chunk reference is corrupted");
+		return ChunkReader(file.getData() + chunks[index].offset, chunks[index].size);
+	}
+	size_t getSize(int index) const { return chunks[index].size; }
+};
+
+static Layer* decodeChunk(const ChunkDirectory& directory, int index, const char* type, const std::string& path)
+{
+	ChunkReader reader = directory.open(index, type);
+	size_t size = directory.getSize(index);
+	return PNGFormatter::decode(reader.raw(size), size, path);
+}
+
+static Layer::Checkpoint readCheckpoint(const ChunkDirectory& directory, int index)
+{
+	if (index < 0) return nullptr;
+	ChunkReader reader = directory.open(index, "CKPT");
+	size_t size = directory.getSize(index);
+	const unsigned char *data = reader.raw(size);
+	return Layer::storeCheckpoint(std::vector<unsigned char>(data, data + size));
+}
+
+static Layer* readAdjustment(ChunkReader adjustment, bool active, bool visible, int opacity)
+{
+	Operation *o = nullptr;
+	std::vector<Selection*> selections;
+	auto cleanup = [&]() {
+		delete o;
+		for (Selection *s : selections) delete s;
+	};
+
+	Layer *l;
+	try {
+		o = adjustment.operation();
+		CompositeOperation *composite = dynamic_cast<CompositeOperation*>(o);
+		if (!composite) throw BadFormatException("Adjustment layers must hold a composite operation");
+
+		unsigned selectionCount = adjustment.u32();
+		for (unsigned i = 0; i < selectionCount; i++) {
+			std::vector<Rectangle> rects = adjustment.rects();
+			selections.push_back(new Selection(rects));
+		}
+		l = new Layer(*composite, selections);
+	}
+	catch (...) {
+		cleanup();
+		throw;
+	}
+	cleanup();
+
+	l->setActive(active);
+	l->setVisible(visible);
+	l->setOpacity(opacity);
+	return l;
+}
+
+//open holds the group chunks from the layer table down to the entry being read
+static Layer* readEntry(const ChunkDirectory& directory, ChunkReader& table, std::vector<int>& open);
+
+static Layer* readGroup(const ChunkDirectory& directory, int index, bool active, bool visible, int opacity, std::vector<int>& open)
+{
+	//a group reached again from inside itself would never finish loading
+	if (std::find(open.begin(), open.end(), index) != open.end()) throw BadFormatException("DRB group contains itself");
+	if (open.size() >= MAX_GROUP_DEPTH) throw BadFormatException("DRB groups are nested too deep");
+	ChunkReader group = directory.open(index, "GRUP");
+
+	//members use the same entries as the layer table
+	std::vector<Layer*> members;
+	open.push_back(index);
+	try {
+		unsigned count = group.u32();
+		for (unsigned i = 0; i < count; i++) {
+			Layer *m = readEntry(directory, group, open);
+			if (m) members.push_back(m);
+		}
+	}
+	catch (...) {
+		for (Layer *m : members) delete m;
+		throw;
+	}
+	open.pop_back();
+
+	Layer *l = new Layer(members);
+	l->setActive(active);
+	l->setVisible(visible);
+	l->setOpacity(opacity);
+	return l;
+}
+
+static Layer* readLayer(const ChunkDirectory& directory, int index)
+{
+	//the table has fixed size entries so any layer can be reached directly
+	ChunkReader table = directory.open(directory.find("LTAB"), "LTAB");
+	int count = table.i32();
+	if (index < 0 || index >= count) throw BadInputException("Layer index out of bounds");
+	table.seek(4 + LAYER_ENTRY_SIZE * index);
+	std::vector<int> open;
+	return readEntry(directory, table, open);
+}
+
+static Layer* readEntry(const ChunkDirectory& directory, ChunkReader& table, std::vector<int>& open)
+{
+	int historyChunk = table.i32();
+	int pixelChunk = table.i32();
+	bool active = table.u8();
+	bool visible = table.u8();
+	int opacity = table.u8();
+	int flags = table.u8();
+
+	if (flags & ADJUSTMENT_LAYER) return readAdjustment(directory.open(historyChunk, "ADJT"), active, visible, opacity);
+	if (flags & GROUP_LAYER) return readGroup(directory, historyChunk, active, visible, opacity, open);
+
+	ChunkReader history = directory.open(historyChunk, "HIST");
+	std::string path = history.str();
+
+	std::vector<Operation*> operations;
+	std::vector<std::vector<Selection*>> selections;
+	std::vector<int> checkpoints;
+	auto cleanup = [&]() {
+		for (Operation *o : operations) delete o;
+		for (std::vector<Selection*>& s : selections)
+			for (Selection *selection : s) delete selection;
+	};
+
+	Layer *l = nullptr;
+	try {
+		unsigned operationCount = history.u32();
+		for (unsigned i = 0; i < operationCount; i++) {
+			operations.push_back(history.operation());
+			selections.push_back(std::vector<Selection*>());
+			unsigned selectionCount = history.u32();
+			for (unsigned j = 0; j < selectionCount; j++) {
+				std::vector<Rectangle> rects = history.rects();
+				selections.back().push_back(new Selection(rects));
+			}
+			checkpoints.push_back(history.i32());
+		}
+
+		//pixels make the history metadata only, otherwise replay from the latest checkpoint
+		int resume = -1;
+		bool replayed = false;
+		if (pixelChunk >= 0) {
+			l = decodeChunk(directory, pixelChunk, "PIXL", path);
+			resume = operations.size();
+		}
+		else {
+			for (size_t i = 0; i < checkpoints.size(); i++)
+				if (checkpoints[i] >= 0) resume = i;
+
+			if (resume >= 0)
+				l = decodeChunk(directory, checkpoints[resume], "CKPT", path);
+			else {
+				l = ReplayCache::getCache().replay(path, directory.getWidth(), directory.getHeight(), operations, selections);
+				replayed = true;
+			}
+		}
+
+		if (l) {
+			l->setActive(active);
+			l->setVisible(visible);
+			l->setOpacity(opacity);
+
+			for (size_t i = 0; i < operations.size() && !replayed; i++) {
+				if ((int)i > resume)
+					l->apply(operations[i], selections[i]);
+				else l->addOperation(operations[i], selections[i], readCheckpoint(directory, checkpoints[i]));
+			}
+		}
+	}
+	catch (...) {
+		delete l;
+		cleanup();
+		throw;
+	}
+
+	cleanup();
+	return l;
+}
+
+int DRBFormatter::getLayerCount(const std::string & path)
+{
+	MappedFile file(path);
+	ChunkDirectory directory(file);
+	return directory.open(directory.find("LTAB"), "LTAB").i32();
+}
+
+Layer * DRBFormatter::loadLayer(const std::string & path, int index)
+{
+	MappedFile file(path);
+	ChunkDirectory directory(file);
+	return readLayer(directory, index);
+}
+
+void DRBFormatter::load(const std::string & path)
+{
+	Image *image = Image::getImage();
+
+	MappedFile file(path);
+	ChunkDirectory directory(file);
+
+	//layeri
+
+	int index = directory.find("LTAB");
+	int count = directory.open(index, "LTAB").i32();
+	if (count > 0 && (size_t)count > (directory.getSize(index) - 4) / LAYER_ENTRY_SIZE) throw BadFormatException("DRB file is truncated");
+
+	image->addLayer(directory.getWidth(), directory.getHeight());
+
+	std::vector<Layer*> layers(count > 0 ? count : 0, nullptr);
+	try {
+		ThreadPool::getPool().parallelFor(layers.size(), [&](int i) {
+			layers[i] = readLayer(directory, i);
+		});
+	}
+	catch (...) {
+		for (Layer *l : layers) delete l;
+		throw;
+	}
+	image->addLayersBottom(layers);
+
+	image->deleteLayer(0);
+
+	//selekcije
+
+	ChunkReader selections = directory.open(directory.find("SELS"), "SELS");
+	unsigned selectionCount = selections.u32();
+	for (unsigned i = 0; i < selectionCount; i++) {
+		std::string name = selections.str();
+		bool active = selections.u8();
+		std::vector<Rectangle> rects = selections.rects();
+
+		image->addSelection(rects, name);
+		image->setSelectionActive(name, active);
+	}
+
+	//kompozitne
+
+	ChunkReader operations = directory.open(directory.find("COPS"), "COPS");
+	unsigned operationCount = operations.u32();
+	for (unsigned i = 0; i < operationCount; i++) {
+		Operation *o = operations.operation();
+		CompositeOperation *composite = dynamic_cast<CompositeOperation*>(o);
+		if (!composite) {
+			delete o;
+			throw BadFormatException("Saved operations must be composite");
+		}
+		image->saveCompositeOperation(composite);
+	}
+}
+
+static void writeEntry(Layer *l, bool snapshots, std::vector<std::string>& types, std::vector<ChunkWriter>& chunks, std::map<Layer::Checkpoint, int>& checkpointChunks, ChunkWriter& entry)
+{
+	if (l->isGroup()) {
+		//member chunks go first, the group chunk holds their table entries
+		ChunkWriter group;
+		group.u32(l->getMembers().size());
+		for (Layer *m : l->getMembers()) writeEntry(m, snapshots, types, chunks, checkpointChunks, group);
+
+		entry.i32(chunks.size());
+		entry.i32(-1);
+		entry.u8(l->getActive());
+		entry.u8(l->getVisible());
+		entry.u8(l->getOpacity());
+		entry.u8(GROUP_LAYER);
+
+		types.push_back("GRUP");
+		chunks.push_back(group);
+		return;
+	}
+
+	if (l->isAdjustment()) {
+		ChunkWriter adjustment;
+		adjustment.operation(l->getAdjustment());
+		adjustment.u32(l->getAdjustmentSelections().size());
+		for (Selection *s : l->getAdjustmentSelections()) adjustment.rects(s);
+
+		entry.i32(chunks.size());
+		entry.i32(-1);
+		entry.u8(l->getActive());
+		entry.u8(l->getVisible());
+		entry.u8(l->getOpacity());
+		entry.u8(ADJUSTMENT_LAYER);
+
+		types.push_back("ADJT");
+		chunks.push_back(adjustment);
+		return;
+	}
+
+	ChunkWriter history;
+	history.str(l->getPath());
+
+	const std::vector<Layer::DoneOperation*>& doneOperations = l->getDoneOperations();
+	history.u32(doneOperations.size());
+	for (Layer::DoneOperation *o : doneOperations) {
+		history.operation(o->getOperation());
+		history.u32(o->getSelections().size());
+		for (Selection *s : o->getSelections()) history.rects(s);
+
+		int checkpointChunk = -1;
+		if (o->getCheckpoint()) {
+			auto it = checkpointChunks.find(o->getCheckpoint());
+			if (it == checkpointChunks.end()) {
+				checkpointChunk = chunks.size();
+				checkpointChunks[o->getCheckpoint()] = checkpointChunk;
+				types.push_back("CKPT");
+				chunks.push_back(ChunkWriter());
+				chunks.back().raw(o->getCheckpoint()->data(), o->getCheckpoint()->size());
+			}
+			else checkpointChunk = it->second;
+		}
+		history.i32(checkpointChunk);
+	}
+
+	int historyChunk = chunks.size();
+	types.push_back("HIST");
+	chunks.push_back(history);
+
+	int pixelChunk = -1;
+	if (snapshots && l->getWidth() > 0 && l->getHeight() > 0) {
+		pixelChunk = chunks.size();
+		l->evaluate();
+		std::vector<unsigned char> png = PNGFormatter::encode(*l, Deflate::FAST);
+		types.push_back("PIXL");
+		chunks.push_back(ChunkWriter());
+		chunks.back().raw(png.data(), png.size());
+	}
+
+	entry.i32(historyChunk);
+	entry.i32(pixelChunk);
+	entry.u8(l->getActive());
+	entry.u8(l->getVisible());
+	entry.u8(l->getOpacity());
+	entry.u8(0);
+}
+
+void DRBFormatter::save(const std::string & path)
+{
+	Image *image = Image::getImage();
+
+	//the first three chunks are filled in once every index is known
+	std::vector<std::string> types = { "LTAB", "SELS", "COPS" };
+	std::vector<ChunkWriter> chunks(3);
+	std::map<Layer::Checkpoint, int> checkpointChunks;
+
+	std::vector<ChunkWriter> entries;
+	for (Layer *l : *image) {
+		entries.push_back(ChunkWriter());
+		writeEntry(l, snapshots, types, chunks, checkpointChunks, entries.back());
+	}
+
+	chunks[0].u32(entries.size());
+	for (const ChunkWriter& e : entries) chunks[0].raw(e.getBytes().data(), e.getBytes().size());
+
+	const std::map<std::string, Selection*>& selections = image->getSelections();
+	chunks[1].u32(selections.size());
+	for (const std::pair<const std::string, Selection*>& s : selections) {
+		chunks[1].str(s.first);
+		chunks[1].u8(s.second->getActive());
+		chunks[1].rects(s.second);
+	}
+
+	const std::map<std::string, CompositeOperation*>& compositeOperations = image->getCompositeOperations();
+	chunks[2].u32(compositeOperations.size());
+	for (const std::pair<const std::string, CompositeOperation*>& o : compositeOperations) {
+		chunks[2].operation(o.second);
+	}
+
+	ChunkWriter header;
+	header.raw((const unsigned char*)magic, 8);
+	header.u32(VERSION);
+	header.i32(image->getWidth());
+	header.i32(image->getHeight());
+	header.u32(chunks.size());
+
+	unsigned long long offset = HEADER_SIZE + DIRECTORY_ENTRY_SIZE * chunks.size();
+	for (size_t i = 0; i < chunks.size(); i++) {
+		header.raw((const unsigned char*)types[i].data(), 4);
+		header.u64(offset);
+		header.u64(chunks[i].getBytes().size());
+		offset += chunks[i].getBytes().size();
+	}
+
+	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
+	if (!FILE.is_open()) throw BadPathException("File can't be opened for writing");
+	FILE.write((const char*)header.getBytes().data(), header.getBytes().size());
+	for (const ChunkWriter& c : chunks)
+		FILE.write((const char*)c.getBytes().data(), c.getBytes().size());
+	FILE.close();
+}
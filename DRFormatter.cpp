@@ -1,255 +1,512 @@
 #include <fstream>
+#include <iterator>
+#include <cctype>
 #include "Formatter.h"
 #include "Image.h"
+#include "ThreadPool.h"
+#include "ReplayCache.h"
 #include "Exceptions.h"
+#include "XMLWriter.h"
 #include "rapidxml.hpp"
-#include "rapidxml_print.hpp"
 #include "rapidxml_utils.hpp"
 
 using namespace rapidxml;
 
-void DRFormatter::appendXMLRectangle(rapidxml::xml_node<>& node, const Rectangle & rect)
+static const char base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string encodeBase64(const std::vector<unsigned char>& data)
 {
-	xml_node<> *rectangleNode = doc.allocate_node(node_element, "rectangle");
+	std::string out;
+	out.reserve((data.size() + 2) / 3 * 4);
+	for (size_t i = 0; i < data.size(); i += 3) {
+		unsigned block = data[i] << 16;
+		if (i + 1 < data.size()) block |= data[i + 1] << 8;
+		if (i + 2 < data.size()) block |= data[i + 2];
+		out.push_back(base64Alphabet[block >> 18 & 63]);
+		out.push_back(base64Alphabet[block >> 12 & 63]);
+		out.push_back(i + 1 < data.size() ? base64Alphabet[block >> 6 & 63] : '=');
+		out.push_back(i + 2 < data.size() ? base64Alphabet[block & 63] : '=');
+	}
+	return out;
+}
 
-	std::string numStr = std::to_string(rect.getX());
-	char *numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *xNode = doc.allocate_node(node_element, "x", numChar);
-	rectangleNode->append_node(xNode);
+static std::vector<unsigned char> decodeBase64(const char* data, size_t size)
+{
+	std::vector<unsigned char> out;
+	out.reserve(size / 4 * 3);
+	unsigned block = 0;
+	int bits = 0;
+	for (size_t i = 0; i < size && data[i] != '='; i++) {
+		const char *c = std::char_traits<char>::find(base64Alphabet, 64, data[i]);
+		if (!c) {
+			if (std::isspace((unsigned char)data[i])) continue;
+			throw BadFormatException("Invalid layer snapshot");
+		}
+		block = block << 6 | (c - base64Alphabet);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out.push_back(block >> bits & 0xFF);
+		}
+	}
+	return out;
+}
 
-	numStr = std::to_string(rect.getY());
-	numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *yNode = doc.allocate_node(node_element, "y", numChar);
-	rectangleNode->append_node(yNode);
+static std::string getDirectory(const std::string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+}
 
-	numStr = std::to_string(rect.getWidth());
-	numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *widthNode = doc.allocate_node(node_element, "width", numChar);
-	rectangleNode->append_node(widthNode);
+void DRFormatter::writeXMLRectangle(XMLWriter& writer, const Rectangle & rect)
+{
+	writer.openElement("rectangle");
 
-	numStr = std::to_string(rect.getHeight());
-	numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *heightNode = doc.allocate_node(node_element, "height", numChar);
-	rectangleNode->append_node(heightNode);
+	writer.element("x", rect.getX());
+	writer.element("y", rect.getY());
+	writer.element("width", rect.getWidth());
+	writer.element("height", rect.getHeight());
 
-	node.append_node(rectangleNode);
+	writer.closeElement();
 }
 
-void DRFormatter::appendXMLSelection(rapidxml::xml_node<>& node, Selection * s)
+void DRFormatter::writeXMLSelection(XMLWriter& writer, Selection * s)
 {
-	xml_node<> *selectionNode = doc.allocate_node(node_element, "selection");
+	writer.openElement("selection");
 
 	for (Rectangle r : *s) {
-		appendXMLRectangle(*selectionNode, r);
+		writeXMLRectangle(writer, r);
 	}
 
-	node.append_node(selectionNode);
+	writer.closeElement();
 }
 
-void DRFormatter::appendXMLSelection(rapidxml::xml_node<>& node, std::pair<std::string, Selection*> s)
+void DRFormatter::writeXMLSelection(XMLWriter& writer, std::pair<std::string, Selection*> s)
 {
-	xml_node<> *selectionNode = doc.allocate_node(node_element, "selection");
-
-	char* name = doc.allocate_string(s.first.c_str());
-	xml_node<> *nameNode = doc.allocate_node(node_element, "name", name);
-	selectionNode->append_node(nameNode);
+	writer.openElement("selection");
 
-	std::string activeStr = std::to_string(s.second->getActive());
-	char *activeChar = doc.allocate_string(activeStr.c_str());
-	xml_node<> *activeNode = doc.allocate_node(node_element, "active", activeChar);
-	selectionNode->append_node(activeNode);
+	writer.element("name", s.first);
+	writer.element("active", s.second->getActive());
 
 	for (Rectangle r : *(s.second)) {
-		appendXMLRectangle(*selectionNode, r);
+		writeXMLRectangle(writer, r);
 	}
 
-	node.append_node(selectionNode);
+	writer.closeElement();
 }
 
-void DRFormatter::appendXMLDoneOperation(rapidxml::xml_node<>& node, Layer::DoneOperation * o)
+void DRFormatter::writeXMLDoneOperation(XMLWriter& writer, Layer::DoneOperation * o)
 {
-	xml_node<> *doneOperationNode = doc.allocate_node(node_element, "doneOperation");
+	writer.openElement("doneOperation");
 
-	o->getOperation()->appendOperationXML(doc, *doneOperationNode);
+	o->getOperation()->writeOperationXML(writer);
 
 	const std::vector<Selection*>& selections = o->getSelections();
 
-	xml_node<> *selectionsNode = doc.allocate_node(node_element, "selections");
+	writer.openElement("selections");
 
 	for (Selection* s : selections) {
-		appendXMLSelection(*selectionsNode, s);
+		writeXMLSelection(writer, s);
 	}
 
-	doneOperationNode->append_node(selectionsNode);
+	writer.closeElement();
+
+	if (o->getCheckpoint()) {
+		//identical checkpoints are written once and referenced by id
+		auto it = checkpointIds.find(o->getCheckpoint());
+		int id = it != checkpointIds.end() ? it->second : checkpoints.size();
+		if (it == checkpointIds.end()) {
+			checkpointIds[o->getCheckpoint()] = id;
+			checkpoints.push_back(o->getCheckpoint());
+		}
+
+		writer.element("checkpoint", id);
+	}
 
-	node.append_node(doneOperationNode);
+	writer.closeElement();
 }
 
-void DRFormatter::appendXMLLayer(rapidxml::xml_node<>& node, Layer * l)
+void DRFormatter::writeXMLSnapshot(XMLWriter& writer, Layer * l, const std::string& directory, const std::string& snapshotPath)
 {
-	xml_node<> *layerNode = doc.allocate_node(node_element, "layer");
+	writer.openElement("snapshot");
+
+	l->evaluate();
+	std::vector<unsigned char> png = PNGFormatter::encode(*l, Deflate::FAST);
 
-	char* pathChar = doc.allocate_string(l->getPath().c_str());
-	xml_node<> *pathNode = doc.allocate_node(node_element, "path", pathChar);
-	layerNode->append_node(pathNode);
+	if (snapshot == EMBED) {
+		writer.element("data", encodeBase64(png));
+	}
+	else {
+		std::ofstream FILE(directory + snapshotPath, std::ofstream::binary | std::ofstream::out);
+		if (!FILE.is_open()) throw BadPathException("Layer snapshot can't be opened for writing");
+		FILE.write((const char*)png.data(), png.size());
+		FILE.close();
 
-	std::string numStr = std::to_string(l->getActive());
-	char* numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *activeNode = doc.allocate_node(node_element, "active", numChar);
-	layerNode->append_node(activeNode);
+		writer.element("path", snapshotPath);
+	}
 
-	numStr = std::to_string(l->getVisible());
-	numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *visibleNode = doc.allocate_node(node_element, "visible", numChar);
-	layerNode->append_node(visibleNode);
+	writer.closeElement();
+}
 
-	numStr = std::to_string(l->getOpacity());
-	numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *opacityNode = doc.allocate_node(node_element, "opacity", numChar);
-	layerNode->append_node(opacityNode);
+void DRFormatter::writeXMLLayer(XMLWriter& writer, Layer * l, const std::string& directory, const std::string& snapshotPath)
+{
+	writer.openElement("layer");
+
+	writer.element("path", l->getPath());
+	writer.element("active", l->getActive());
+	writer.element("visible", l->getVisible());
+	writer.element("opacity", l->getOpacity());
+
+	if (l->isGroup()) {
+		//members get their own sidecar names next to the group's
+		std::string base = snapshotPath.substr(0, snapshotPath.size() - 4);
+		writer.openElement("group");
+		int index = 0;
+		for (Layer* m : l->getMembers()) {
+			writeXMLLayer(writer, m, directory, base + "." + std::to_string(index++) + ".png");
+		}
+		writer.closeElement();
+		writer.closeElement();
+		return;
+	}
+
+	if (l->isAdjustment()) {
+		writer.openElement("adjustment");
+		l->getAdjustment()->writeOperationXML(writer);
+		writer.openElement("selections");
+		for (Selection* s : l->getAdjustmentSelections()) {
+			writeXMLSelection(writer, s);
+		}
+		writer.closeElement();
+		writer.closeElement();
+		writer.closeElement();
+		return;
+	}
 
 	const std::vector<Layer::DoneOperation*>& doneOperations = l->getDoneOperations();
 
-	xml_node<> *doneOperationsNode = doc.allocate_node(node_element, "doneOperations");
+	writer.openElement("doneOperations");
 
 	for (Layer::DoneOperation* o : doneOperations)
-		appendXMLDoneOperation(*doneOperationsNode, o);
+		writeXMLDoneOperation(writer, o);
+
+	writer.closeElement();
 
-	layerNode->append_node(doneOperationsNode);
+	if (snapshot != NONE && l->getWidth() > 0 && l->getHeight() > 0)
+		writeXMLSnapshot(writer, l, directory, snapshotPath);
 
-	node.append_node(layerNode);
+	writer.closeElement();
 }
 
-Layer * DRFormatter::convertXMLtoLayer(rapidxml::xml_node<>& node)
+Layer * DRFormatter::convertXMLtoSnapshot(rapidxml::xml_node<>& node, const std::string& directory, const std::string& path)
 {
-	Image *image = Image::getImage();
+	xml_node<> *dataNode = node.first_node("data");
+	if (dataNode) {
+		std::vector<unsigned char> png = decodeBase64(dataNode->value(), dataNode->value_size());
+		return PNGFormatter::decode(png.data(), png.size(), path);
+	}
 
 	xml_node<> *pathNode = node.first_node("path");
-	std::string path = pathNode->value();
-	
+	if (pathNode) {
+		//a missing sidecar file falls back to replaying the history
+		std::ifstream FILE(directory + pathNode->value(), std::ifstream::binary | std::ifstream::in);
+		if (!FILE.is_open()) return nullptr;
+
+		std::vector<unsigned char> png((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+		FILE.close();
+		return PNGFormatter::decode(png.data(), png.size(), path);
+	}
+	return nullptr;
+}
+
+Layer::Checkpoint DRFormatter::convertXMLtoCheckpoint(rapidxml::xml_node<>& node)
+{
+	xml_node<> *checkpointNode = node.first_node("checkpoint");
+	if (!checkpointNode) return nullptr;
+
+	int id = std::stoi(checkpointNode->value());
+	if (id < 0 || id >= (int)checkpoints.size() || !checkpoints[id])
+		throw BadFormatException("Unknown checkpoint");
+	return checkpoints[id];
+}
+
+Selection * DRFormatter::convertXMLtoSelection(rapidxml::xml_node<>& node)
+{
+	std::vector<Rectangle> rects;
+
+	for (xml_node<> *childNode = node.first_node("rectangle"); childNode; childNode = childNode->next_sibling("rectangle")) {
+		xml_node<> *xNode = childNode->first_node("x");
+		std::string xStr = xNode->value();
+		int x = std::stoi(xStr);
+
+		xml_node<> *yNode = xNode->next_sibling("y");
+		std::string yStr = yNode->value();
+		int y = std::stoi(yStr);
+
+		xml_node<> *widthNode = yNode->next_sibling("width");
+		std::string widthStr = widthNode->value();
+		int width = std::stoi(widthStr);
+
+		xml_node<> *heightNode = widthNode->next_sibling("height");
+		std::string heightStr = heightNode->value();
+		int height = std::stoi(heightStr);
+
+		rects.push_back(Rectangle(x, y, width, height));
+	}
+
+	return new Selection(rects);
+}
+
+Layer * DRFormatter::convertXMLtoAdjustment(rapidxml::xml_node<>& node)
+{
+	xml_node<> *activeNode = node.first_node("active");
+	std::string activeStr = activeNode->value();
+	bool active = std::stoi(activeStr);
+
+	xml_node<> *visibleNode = activeNode->next_sibling("visible");
+	std::string visibleStr = visibleNode->value();
+	bool visible = std::stoi(visibleStr);
+
+	xml_node<> *opacityNode = visibleNode->next_sibling("opacity");
+	std::string opacityStr = opacityNode->value();
+	int opacity = std::stoi(opacityStr);
+
+	xml_node<> *adjustmentNode = opacityNode->next_sibling("adjustment");
+	xml_node<> *operationNode = adjustmentNode->first_node("operation");
+
+	Operation *o = nullptr;
+	std::vector<Selection*> selections;
+	auto cleanup = [&]() {
+		delete o;
+		for (Selection *s : selections) delete s;
+	};
+
 	Layer *l;
-	if(path != "")
-		l = image->importLayer(path);
-	else l = new Layer(image->getWidth(), image->getHeight());
+	try {
+		o = Operation::convertXMLtoOperation(operationNode);
+		CompositeOperation *composite = dynamic_cast<CompositeOperation*>(o);
+		if (!composite) throw BadFormatException("Adjustment layers must hold a composite operation");
 
-	if (l) {
-		xml_node<> *activeNode = pathNode->next_sibling("active");
-		std::string activeStr = activeNode->value();
-		bool active = std::stoi(activeStr);
-		l->setActive(active);
+		xml_node<> *selectionsNode = operationNode->next_sibling("selections");
+		for (xml_node<> *childNode = selectionsNode->first_node("selection"); childNode; childNode = childNode->next_sibling("selection"))
+			selections.push_back(convertXMLtoSelection(*childNode));
 
-		xml_node<> *visibleNode = activeNode->next_sibling("visible");
-		std::string visibleStr = visibleNode->value();
-		bool visible = std::stoi(visibleStr);
-		l->setVisible(visible);
+		l = new Layer(*composite, selections);
+	}
+	catch (...) {
+		cleanup();
+		throw;
+	}
+	cleanup();
 
-		xml_node<> *opacityNode = visibleNode->next_sibling("opacity");
-		std::string opacityStr = opacityNode->value();
-		int opacity = std::stoi(opacityStr);
-		l->setOpacity(opacity);
+	l->setActive(active);
+	l->setVisible(visible);
+	l->setOpacity(opacity);
+	return l;
+}
 
-		xml_node<> *doneOperationsNode = opacityNode->next_sibling("doneOperations");
+Layer * DRFormatter::convertXMLtoGroup(rapidxml::xml_node<>& node, const std::string& directory)
+{
+	xml_node<> *activeNode = node.first_node("active");
+	std::string activeStr = activeNode->value();
+	bool active = std::stoi(activeStr);
+
+	xml_node<> *visibleNode = activeNode->next_sibling("visible");
+	std::string visibleStr = visibleNode->value();
+	bool visible = std::stoi(visibleStr);
+
+	xml_node<> *opacityNode = visibleNode->next_sibling("opacity");
+	std::string opacityStr = opacityNode->value();
+	int opacity = std::stoi(opacityStr);
+
+	std::vector<Layer*> members;
+	try {
+		xml_node<> *groupNode = opacityNode->next_sibling("group");
+		for (xml_node<> *childNode = groupNode->first_node("layer"); childNode; childNode = childNode->next_sibling("layer")) {
+			Layer *m = convertXMLtoLayer(*childNode, directory);
+			if (m) members.push_back(m);
+		}
+	}
+	catch (...) {
+		for (Layer *m : members) delete m;
+		throw;
+	}
 
-		for (xml_node<> *childNode = doneOperationsNode->first_node("doneOperation"); childNode; childNode = childNode->next_sibling("doneOperation")) {
-			xml_node<> *operationNode = childNode->first_node("operation");
-			Operation *o = Operation::convertXMLtoOperation(operationNode);
+	Layer *l = new Layer(members);
+	l->setActive(active);
+	l->setVisible(visible);
+	l->setOpacity(opacity);
+	return l;
+}
 
-			std::vector<Selection*> selections;
+Layer * DRFormatter::convertXMLtoLayer(rapidxml::xml_node<>& node, const std::string& directory)
+{
+	Image *image = Image::getImage();
 
-			xml_node<> *selectionsNode = operationNode->next_sibling("selections");
-			for (xml_node<> *childerNode = selectionsNode->first_node("selection"); childerNode; childerNode = childerNode->next_sibling("selection")) {
-				std::vector<Rectangle> rects;
+	if (node.first_node("adjustment")) return convertXMLtoAdjustment(node);
+	if (node.first_node("group")) return convertXMLtoGroup(node, directory);
 
-				for (xml_node<> *childestNode = childerNode->first_node("rectangle"); childestNode; childestNode = childestNode->next_sibling("rectangle")) {
-					xml_node<> *xNode = childestNode->first_node("x");
-					std::string xStr = xNode->value();
-					int x = std::stoi(xStr);
+	xml_node<> *pathNode = node.first_node("path");
+	std::string path = pathNode->value();
+
+	//with a snapshot the history is only kept as metadata
+	Layer *l = nullptr;
+	xml_node<> *snapshotNode = node.first_node("snapshot");
+	if (snapshotNode)
+		l = convertXMLtoSnapshot(*snapshotNode, directory, path);
+	bool replay = !l;
+
+	//otherwise replay starts from the latest checkpoint
+	int resume = -1;
+	if (replay) {
+		xml_node<> *doneOperationsNode = node.first_node("doneOperations");
+		int index = 0;
+		for (xml_node<> *childNode = doneOperationsNode->first_node("doneOperation"); childNode; childNode = childNode->next_sibling("doneOperation"), index++) {
+			if (childNode->first_node("checkpoint")) resume = index;
+		}
+	}
+
+	if (resume >= 0) {
+		xml_node<> *childNode = node.first_node("doneOperations")->first_node("doneOperation");
+		for (int index = 0; index < resume; index++) childNode = childNode->next_sibling("doneOperation");
+		Layer::Checkpoint checkpoint = convertXMLtoCheckpoint(*childNode);
+		l = PNGFormatter::decode(checkpoint->data(), checkpoint->size(), path);
+	}
 
-					xml_node<> *yNode = xNode->next_sibling("y");
-					std::string yStr = yNode->value();
-					int y = std::stoi(yStr);
+	xml_node<> *activeNode = pathNode->next_sibling("active");
+	std::string activeStr = activeNode->value();
+	bool active = std::stoi(activeStr);
 
-					xml_node<> *widthNode = yNode->next_sibling("width");
-					std::string widthStr = widthNode->value();
-					int width = std::stoi(widthStr);
+	xml_node<> *visibleNode = activeNode->next_sibling("visible");
+	std::string visibleStr = visibleNode->value();
+	bool visible = std::stoi(visibleStr);
 
-					xml_node<> *heightNode = widthNode->next_sibling("height");
-					std::string heightStr =	heightNode->value();
-					int height = std::stoi(heightStr);
+	xml_node<> *opacityNode = visibleNode->next_sibling("opacity");
+	std::string opacityStr = opacityNode->value();
+	int opacity = std::stoi(opacityStr);
 
-					rects.push_back(Rectangle(x, y, width, height));
-				}
+	xml_node<> *doneOperationsNode = opacityNode->next_sibling("doneOperations");
 
-				selections.push_back(new Selection(rects));
-			}
+	std::vector<Operation*> operations;
+	std::vector<std::vector<Selection*>> operationSelections;
+	std::vector<Layer::Checkpoint> checkpoints;
+	auto cleanup = [&]() {
+		for (Operation *o : operations) delete o;
+		for (std::vector<Selection*>& selections : operationSelections)
+			for (Selection *s : selections) delete s;
+	};
 
-			o->operateLayer(l, selections);
-			l->clamp();
-			l->addOperation(o, selections);
+	try {
+		for (xml_node<> *childNode = doneOperationsNode->first_node("doneOperation"); childNode; childNode = childNode->next_sibling("doneOperation")) {
+			xml_node<> *operationNode = childNode->first_node("operation");
+			operations.push_back(Operation::convertXMLtoOperation(operationNode));
+
+			std::vector<Selection*>& selections = *operationSelections.insert(operationSelections.end(), std::vector<Selection*>());
+
+			xml_node<> *selectionsNode = operationNode->next_sibling("selections");
+			for (xml_node<> *childerNode = selectionsNode->first_node("selection"); childerNode; childerNode = childerNode->next_sibling("selection"))
+				selections.push_back(convertXMLtoSelection(*childerNode));
+
+			checkpoints.push_back(convertXMLtoCheckpoint(*childNode));
 		}
 
-		return l;
+		//nothing saved along the way, replay from the source
+		if (replay && resume < 0) {
+			l = ReplayCache::getCache().replay(path, image->getWidth(), image->getHeight(), operations, operationSelections);
+		}
+		else {
+			for (size_t i = 0; i < operations.size(); i++) {
+				if (replay && (int)i > resume)
+					l->apply(operations[i], operationSelections[i]);
+				else l->addOperation(operations[i], operationSelections[i], checkpoints[i]);
+			}
+		}
 	}
-	return nullptr;
+	catch (...) {
+		delete l;
+		cleanup();
+		throw;
+	}
+	cleanup();
+
+	if (l) {
+		l->setActive(active);
+		l->setVisible(visible);
+		l->setOpacity(opacity);
+	}
+	return l;
 }
 
 void DRFormatter::save(const std::string& path) {
 	Image *image = Image::getImage();
 	std::ofstream FILE(path);
-	
-	doc.remove_all_attributes();
-	doc.remove_all_nodes();
-	doc.clear();
+	XMLWriter writer(FILE);
 
-	xml_node<> *node = doc.allocate_node(node_element, "image");
+	checkpoints.clear();
+	checkpointIds.clear();
 
-	std::string numStr = std::to_string(image->getWidth());
-	char *numChar = doc.allocate_string(numStr.c_str());
-	xml_node<> *numNode = doc.allocate_node(node_element, "width", numChar);
-	node->append_node(numNode);
+	writer.openElement("image");
 
-	numStr = std::to_string(image->getHeight());
-	numChar = doc.allocate_string(numStr.c_str());
-	numNode = doc.allocate_node(node_element, "height", numChar);
-	node->append_node(numNode);
+	writer.element("width", image->getWidth());
+	writer.element("height", image->getHeight());
 
-	xml_node<> *layersNode = doc.allocate_node(node_element, "layers");
+	writer.openElement("layers");
 
+	std::string directory = getDirectory(path);
+	std::string name = path.substr(directory.size());
+	int index = 0;
 	for (Layer* l : *image) {
-		appendXMLLayer(*layersNode, l);
+		writeXMLLayer(writer, l, directory, name + ".layer" + std::to_string(index++) + ".png");
 	}
 
-	node->append_node(layersNode);
+	writer.closeElement();
 
 	//selekcije
 
-	xml_node<> *selectionsNode = doc.allocate_node(node_element, "selections");
+	writer.openElement("selections");
 	
 	const std::map<std::string, Selection*>& selections = image->getSelections();
 
 	for (std::pair<std::string, Selection*> s : selections) {
-		appendXMLSelection(*selectionsNode, s);
+		writeXMLSelection(writer, s);
 	}
 
-	node->append_node(selectionsNode);
+	writer.closeElement();
 
 	//kompozitne
 
-	xml_node<> *compositeNode = doc.allocate_node(node_element, "compositeOperations");
+	writer.openElement("compositeOperations");
 
 	const std::map<std::string, CompositeOperation*>& compositeOperations = image->getCompositeOperations();
 
 	for (std::pair<std::string, CompositeOperation*> o : compositeOperations) {
-		o.second->appendOperationXML(doc, *compositeNode);
+		o.second->writeOperationXML(writer);
 	}
 
-	node->append_node(compositeNode);
+	writer.closeElement();
 
-	doc.append_node(node);
+	//checkpoints
 
-	FILE << doc;
+	if (!checkpoints.empty()) {
+		writer.openElement("checkpoints");
+
+		for (size_t id = 0; id < checkpoints.size(); id++) {
+			writer.openElement("checkpoint");
+			writer.element("id", (int)id);
+			writer.element("data", encodeBase64(*checkpoints[id]));
+			writer.closeElement();
+		}
+
+		writer.closeElement();
+	}
+
+	writer.closeElement();
+	writer.endDocument();
 
 	FILE.close();
+
+	checkpoints.clear();
+	checkpointIds.clear();
 }
 
 
@@ -274,17 +531,47 @@ void DRFormatter::load(const std::string& path) {
 	int height = std::stoi(heightStr);
 
 
+	//checkpoints
+
+	checkpoints.clear();
+	xml_node<> *checkpointsNode = imageNode->first_node("checkpoints");
+	if (checkpointsNode) {
+		for (xml_node<> *childNode = checkpointsNode->first_node("checkpoint"); childNode; childNode = childNode->next_sibling("checkpoint")) {
+			xml_node<> *idNode = childNode->first_node("id");
+			int id = std::stoi(idNode->value());
+			if (id < 0) throw BadFormatException("Unknown checkpoint");
+
+			xml_node<> *dataNode = idNode->next_sibling("data");
+			if (id >= (int)checkpoints.size()) checkpoints.resize(id + 1);
+			checkpoints[id] = Layer::storeCheckpoint(decodeBase64(dataNode->value(), dataNode->value_size()));
+		}
+	}
+
 	//layeri
 
 	image->addLayer(width, height);
 
 	xml_node<> *layersNode = heightNode->next_sibling("layers");
 
+	std::string directory = getDirectory(path);
+	std::vector<xml_node<>*> layerNodes;
 	for (xml_node<> *childNode = layersNode->first_node("layer"); childNode; childNode = childNode->next_sibling("layer")) {
-		Layer *l = convertXMLtoLayer(*childNode);
-		image->addLayerBottom(l);
+		layerNodes.push_back(childNode);
 	}
 
+	//layers don't depend on each other until they are inserted
+	std::vector<Layer*> layers(layerNodes.size(), nullptr);
+	try {
+		ThreadPool::getPool().parallelFor(layerNodes.size(), [&](int i) {
+			layers[i] = convertXMLtoLayer(*layerNodes[i], directory);
+		});
+	}
+	catch (...) {
+		for (Layer *l : layers) delete l;
+		throw;
+	}
+	image->addLayersBottom(layers);
+
 	image->deleteLayer(0);
 
 	//selekcije
@@ -331,4 +618,6 @@ void DRFormatter::load(const std::string& path) {
 		Operation *o = Operation::convertXMLtoOperation(childNode);
 		image->saveCompositeOperation((CompositeOperation *)o);
 	}
+
+	checkpoints.clear();
 }
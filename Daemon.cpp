@@ -0,0 +1,413 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#include "Daemon.h"
+#include "Batch.h"
+#include "BoundedQueue.h"
+#include "Formatter.h"
+#include "Operation.h"
+#include "Program.h"
+#include "Exceptions.h"
+
+static const char *USAGE = "usage: --daemon [--workers n] [--queue n] [--accuracy exact|fast] [--work directory] [--inputs directory] [--socket path] recipe-directory\n";
+//inline images bigger than this end the connection, the stream can't be trusted after such a header
+static const size_t MAX_INLINE_SIZE = (size_t)1 << 30;
+
+namespace {
+
+	//where jobs come from and their results go back to, replies from several workers can't interleave
+	class Connection {
+	private:
+		std::mutex writeLock;
+	protected:
+		virtual void send(const std::string& data) = 0;
+	public:
+		virtual bool readLine(std::string& line) = 0;
+		virtual bool readBytes(size_t count, std::string& bytes) = 0;
+		void reply(const std::string& data) {
+			std::lock_guard<std::mutex> guard(writeLock);
+			send(data);
+		}
+		virtual ~Connection() {}
+	};
+
+	class StreamConnection : public Connection {
+	private:
+		std::istream& in;
+		std::ostream& out;
+	protected:
+		void send(const std::string& data) override {
+			out.write(data.data(), data.size());
+			out.flush();
+		}
+	public:
+		StreamConnection(std::istream& in, std::ostream& out) : in(in), out(out) {}
+
+		bool readLine(std::string& line) override {
+			if (!std::getline(in, line)) return false;
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			return true;
+		}
+		bool readBytes(size_t count, std::string& bytes) override {
+			bytes.resize(count);
+			in.read(&bytes[0], count);
+			return (size_t)in.gcount() == count;
+		}
+	};
+
+#ifndef _WIN32
+	class SocketConnection : public Connection {
+	private:
+		int socket;
+		std::vector<char> buffer;
+		size_t start, end;
+
+		bool fill() {
+			if (start == end) start = end = 0;
+			if (end == buffer.size()) return true;
+			ssize_t received = recv(socket, buffer.data() + end, buffer.size() - end, 0);
+			if (received <= 0) return false;
+			end += received;
+			return true;
+		}
+	protected:
+		void send(const std::string& data) override {
+			size_t sent = 0;
+			while (sent < data.size()) {
+				ssize_t count = ::send(socket, data.data() + sent, data.size() - sent, 0);
+				if (count <= 0) return;
+				sent += count;
+			}
+		}
+	public:
+		SocketConnection(int socket) : socket(socket), buffer(1 << 16), start(0), end(0) {}
+		~SocketConnection() { close(socket); }
+
+		bool readLine(std::string& line) override {
+			line.clear();
+			while (true) {
+				char *newline = (char*)memchr(buffer.data() + start, '\n', end - start);
+				if (newline) {
+					line.append(buffer.data() + start, newline);
+					start = newline - buffer.data() + 1;
+					if (!line.empty() && line.back() == '\r') line.pop_back();
+					return true;
+				}
+				line.append(buffer.data() + start, buffer.data() + end);
+				start = end;
+				if (!fill()) return false;
+			}
+		}
+		bool readBytes(size_t count, std::string& bytes) override {
+			bytes.clear();
+			bytes.reserve(count);
+			while (bytes.size() < count) {
+				if (start == end && !fill()) return false;
+				size_t take = end - start < count - bytes.size() ? end - start : count - bytes.size();
+				bytes.append(buffer.data() + start, take);
+				start += take;
+			}
+			return true;
+		}
+	};
+#endif
+
+	struct Job {
+		std::shared_ptr<Connection> connection;
+		std::string id, recipe, format;
+		bool inlined;
+		std::string input;
+	};
+
+	typedef BoundedQueue<Job> JobQueue;
+
+	//reads jobs until the connection ends, a full queue keeps it from reading ahead
+	void readJobs(const std::shared_ptr<Connection>& connection, const std::shared_ptr<JobQueue>& jobs)
+	{
+		std::string line;
+		while (connection->readLine(line)) {
+			if (line.empty()) continue;
+			std::istringstream header(line);
+			Job job;
+			std::string kind;
+			header >> job.id >> job.recipe >> job.format >> kind;
+			job.connection = connection;
+
+			if (kind == "path") {
+				std::getline(header >> std::ws, job.input);
+				job.inlined = false;
+			}
+			else if (kind == "bytes") {
+				size_t length;
+				if (!(header >> length) || length > MAX_INLINE_SIZE || !connection->readBytes(length, job.input)) {
+					connection->reply(job.id + " error Invalid inline image\n");
+					return;
+				}
+				job.inlined = true;
+			}
+			else {
+				connection->reply((job.id.empty() ? "-" : job.id) + " error Invalid job\n");
+				continue;
+			}
+			if (job.input.empty()) {
+				connection->reply(job.id + " error Missing input\n");
+				continue;
+			}
+			if (!jobs->push(std::move(job))) return;
+		}
+	}
+
+	//absolute path with links resolved, false if it doesn't exist
+	bool resolve(const std::string& path, std::string& resolved)
+	{
+#ifdef _WIN32
+		char buffer[_MAX_PATH];
+		if (!_fullpath(buffer, path.c_str(), _MAX_PATH)) return false;
+		struct stat info;
+		if (stat(buffer, &info) != 0) return false;
+#else
+		char buffer[PATH_MAX];
+		if (!realpath(path.c_str(), buffer)) return false;
+#endif
+		resolved = buffer;
+		return true;
+	}
+
+}
+
+std::shared_ptr<const CompositeOperation> Daemon::getRecipe(const std::string & name)
+{
+	if (name.empty() || name.find_first_of("/\\") != std::string::npos || name.find("..") != std::string::npos)
+		throw BadInputException("Invalid recipe name");
+
+	std::string path = recipes + "/" + name + ".fun";
+	FileStamp stamp;
+	if (!FileStamp::get(path, stamp) || !std::ifstream(path).is_open()) throw BadPathException("Recipe doesn't exist");
+
+	std::lock_guard<std::mutex> guard(recipeLock);
+	auto it = loaded.find(name);
+	if (it != loaded.end() && it->second.stamp == stamp) return it->second.operation;
+
+	OperationFormatter *reader = OperationFormatter::getReader(path);
+	if (!reader) throw BadFormatException("Recipe format doesn't exist");
+	std::shared_ptr<CompositeOperation> o(reader->loadRunnable(path));
+	//the plan is built once here instead of by the first job to run it
+	o->getPlan();
+	loaded[name] = Recipe{ o, stamp };
+	return o;
+}
+
+std::string Daemon::temporaryPath(const std::string & extension)
+{
+	static std::atomic<unsigned long long> counter(0);
+#ifdef _WIN32
+	int process = _getpid();
+#else
+	int process = getpid();
+#endif
+	return work + "/homer-" + std::to_string(process) + "-" + std::to_string(++counter) + "." + extension;
+}
+
+std::string Daemon::process(const std::string & recipe, const std::string & format, const std::string * path, const std::string * bytes)
+{
+	std::shared_ptr<const CompositeOperation> o = getRecipe(recipe);
+	if (!ImageFormatter::getFormatter(format)) throw BadFormatException("Format doesn't exist");
+	//the checked path is the one read, not whatever the links in the original point to later
+	std::string resolved = path ? *path : std::string();
+	if (path && !inputs.empty()) {
+		if (!resolve(*path, resolved)) throw BadPathException("Input doesn't exist");
+		char last = inputs.back(), next = resolved.size() > inputs.size() ? resolved[inputs.size()] : '\0';
+		bool inside = resolved.compare(0, inputs.size(), inputs) == 0 && (last == '/' || last == '\\' || next == '/' || next == '\\');
+		if (!inside) throw BadPathException("Input is outside the input directory");
+	}
+
+	//inline images go through a file too, readers are found by their signature
+	std::string input = path ? resolved : temporaryPath("in");
+	std::string output = temporaryPath(format);
+	try {
+		if (bytes) {
+			std::ofstream FILE(input, std::ofstream::binary | std::ofstream::out);
+			if (!FILE.is_open()) throw BadPathException("Work directory can't be written");
+			FILE.write(bytes->data(), bytes->size());
+			FILE.close();
+			if (FILE.fail()) throw BadPathException("Work directory can't be written");
+		}
+		Batch::process(input, output, *o);
+	}
+	catch (...) {
+		if (bytes) std::remove(input.c_str());
+		std::remove(output.c_str());
+		throw;
+	}
+	if (bytes) std::remove(input.c_str());
+
+	std::ifstream FILE(output, std::ifstream::binary | std::ifstream::in);
+	std::string result((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+	FILE.close();
+	std::remove(output.c_str());
+	return result;
+}
+
+int Daemon::run(const std::vector<std::string>& args)
+{
+	unsigned workers = std::thread::hardware_concurrency();
+	unsigned capacity = 0;
+	std::string work, socketPath, inputs;
+	std::vector<std::string> positional;
+	try {
+		for (size_t i = 0; i < args.size(); i++) {
+			const std::string& arg = args[i];
+			bool option = arg.size() > 2 && arg.compare(0, 2, "--") == 0;
+			if (option && i + 1 == args.size()) throw BadInputException("Missing value for " + arg);
+			if (arg == "--workers") workers = std::stoi(args[++i]);
+			else if (arg == "--queue") capacity = std::stoi(args[++i]);
+			else if (arg == "--work") work = args[++i];
+			else if (arg == "--socket") socketPath = args[++i];
+			else if (arg == "--inputs") inputs = args[++i];
+			else if (arg == "--accuracy") {
+				const std::string& accuracy = args[++i];
+				if (accuracy == "exact") Program::setAccuracy(Program::EXACT);
+				else if (accuracy == "fast") Program::setAccuracy(Program::FAST);
+				else throw BadInputException("Unknown accuracy " + accuracy);
+			}
+			else if (option) throw BadInputException("Unknown option " + arg);
+			else positional.push_back(arg);
+		}
+		if (positional.size() != 1) throw BadInputException("Missing recipe directory");
+	}
+	catch (BadInputException e) {
+		std::cerr << e.getMessage() << '\n' << USAGE;
+		return 2;
+	}
+	catch (std::logic_error&) {
+		std::cerr << "Invalid number\n" << USAGE;
+		return 2;
+	}
+	if (workers == 0) workers = 1;
+	if (capacity == 0) capacity = 2 * workers;
+
+	if (work.empty()) {
+#ifdef _WIN32
+		const char *temp = std::getenv("TEMP");
+		work = temp ? temp : ".";
+#else
+		const char *temp = std::getenv("TMPDIR");
+		work = temp ? temp : "/tmp";
+#endif
+	}
+#ifdef _WIN32
+	_mkdir(work.c_str());
+#else
+	mkdir(work.c_str(), 0777);
+#endif
+	struct stat info;
+	if (stat(work.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR)) {
+		std::cerr << "Work directory can't be created\n";
+		return 2;
+	}
+
+	if (!inputs.empty() && !resolve(inputs, inputs)) {
+		std::cerr << "Input directory doesn't exist\n";
+		return 2;
+	}
+
+#ifdef _WIN32
+	if (socketPath.empty()) {
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+	Daemon daemon(positional[0], work, inputs);
+	return daemon.serve(std::cin, std::cout, socketPath, workers, capacity);
+}
+
+int Daemon::serve(std::istream & in, std::ostream & out, const std::string & socketPath, unsigned workers, unsigned capacity)
+{
+	//readers may outlive the workers on a socket, so the queue is shared with them
+	std::shared_ptr<JobQueue> jobs = std::make_shared<JobQueue>(capacity);
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 0; i < workers; i++) {
+		threads.emplace_back([this, jobs]() {
+			Job job;
+			while (jobs->pop(job)) {
+				try {
+					std::string result = process(job.recipe, job.format, job.inlined ? nullptr : &job.input, job.inlined ? &job.input : nullptr);
+					job.connection->reply(job.id + " ok " + std::to_string(result.size()) + "\n" + result);
+				}
+				catch (Exception& e) {
+					job.connection->reply(job.id + " error " + e.getMessage() + "\n");
+				}
+				catch (...) {
+					job.connection->reply(job.id + " error Unknown error\n");
+				}
+				job = Job();
+			}
+		});
+	}
+
+	int status = 0;
+	if (socketPath.empty()) readJobs(std::make_shared<StreamConnection>(in, out), jobs);
+	else {
+#ifdef _WIN32
+		std::cerr << "Sockets aren't supported here, jobs can come through standard input\n";
+		status = 2;
+#else
+		//a client going away mid reply shouldn't take the daemon with it
+		signal(SIGPIPE, SIG_IGN);
+		sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		int server = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (socketPath.size() >= sizeof(address.sun_path) || server < 0) {
+			std::cerr << "Socket can't be created\n";
+			status = 2;
+		}
+		else {
+			strcpy(address.sun_path, socketPath.c_str());
+			unlink(socketPath.c_str());
+			//nobody can connect before listen, so the socket is never open to other users
+			if (bind(server, (sockaddr*)&address, sizeof(address)) != 0 || chmod(socketPath.c_str(), 0600) != 0 || listen(server, 16) != 0) {
+				std::cerr << "Socket can't be created\n";
+				status = 2;
+			}
+			else {
+				int client;
+				while ((client = accept(server, nullptr, nullptr)) >= 0 || errno == EINTR) {
+					if (client < 0) continue;
+					std::shared_ptr<Connection> connection = std::make_shared<SocketConnection>(client);
+					std::thread(readJobs, connection, jobs).detach();
+				}
+				std::cerr << "Socket stopped accepting connections\n";
+				status = 2;
+			}
+			close(server);
+		}
+#endif
+	}
+
+	jobs->close();
+	for (std::thread& t : threads) t.join();
+	return status;
+}
@@ -0,0 +1,41 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <iosfwd>
+#include "FileStamp.h"
+
+class CompositeOperation;
+
+//keeps formatters and recipes loaded between jobs, reading them from standard input or a unix socket
+//a job is one line, "id recipe format path input-path" or "id recipe format bytes length" followed by the image itself
+//every job gets "id ok length" followed by the result encoded in format, or "id error message"
+//path jobs may be limited to files under an input directory, the socket is only open to its owner
+class Daemon {
+private:
+	struct Recipe {
+		//jobs still running keep a replaced recipe alive
+		std::shared_ptr<const CompositeOperation> operation;
+		FileStamp stamp;
+	};
+
+	std::string recipes, work, inputs;
+	std::map<std::string, Recipe> loaded;
+	std::mutex recipeLock;
+
+	//recipes are loaded from the recipe directory on first use and again whenever the file's size or time changes
+	std::shared_ptr<const CompositeOperation> getRecipe(const std::string& name);
+	std::string temporaryPath(const std::string& extension);
+	std::string process(const std::string& recipe, const std::string& format, const std::string* path, const std::string* bytes);
+public:
+	//inputs, when not empty, has to be absolute with its links resolved
+	Daemon(const std::string& recipes, const std::string& work, const std::string& inputs) : recipes(recipes), work(work), inputs(inputs) {}
+
+	//answers jobs from in on out, or from clients of the socket when its path is given
+	//returns 0 once in ends and every reply is written, 2 if the socket couldn't be opened or stopped accepting
+	int serve(std::istream& in, std::ostream& out, const std::string& socketPath, unsigned workers, unsigned capacity);
+	//exit status is 0 once standard input ends, 2 if the daemon couldn't start
+	static int run(const std::vector<std::string>& args);
+};
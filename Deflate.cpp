@@ -0,0 +1,455 @@
+#include "Deflate.h"
+#include "ThreadPool.h"
+#include "Exceptions.h"
+
+static const size_t WINDOW_SIZE = 32768;
+static const size_t MIN_MATCH = 3, MAX_MATCH = 258;
+static const int HASH_BITS = 15;
+static const int MAX_CHAIN = 16;
+static const size_t PIECE_SIZE = 128 * 1024;
+
+static const short lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const short lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const short distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const short distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+class BitWriter {
+private:
+	std::vector<unsigned char>& out;
+	unsigned bitBuffer;
+	int bitCount;
+public:
+	BitWriter(std::vector<unsigned char>& out) : out(out), bitBuffer(0), bitCount(0) {}
+
+	void write(unsigned bits, int count) {
+		bitBuffer |= bits << bitCount;
+		bitCount += count;
+		while (bitCount >= 8) {
+			out.push_back(bitBuffer & 0xFF);
+			bitBuffer >>= 8;
+			bitCount -= 8;
+		}
+	}
+	//huffman codes are packed starting from the most significant bit
+	void writeCode(unsigned code, int length) {
+		unsigned reversed = 0;
+		for (int i = 0; i < length; i++) {
+			reversed = (reversed << 1) | (code & 1);
+			code >>= 1;
+		}
+		write(reversed, length);
+	}
+	void align() {
+		if (bitCount > 0) out.push_back(bitBuffer & 0xFF);
+		bitBuffer = 0;
+		bitCount = 0;
+	}
+};
+
+static void writeFixedSymbol(BitWriter& writer, int symbol)
+{
+	if (symbol < 144) writer.writeCode(0x30 + symbol, 8);
+	else if (symbol < 256) writer.writeCode(0x190 + symbol - 144, 9);
+	else if (symbol < 280) writer.writeCode(symbol - 256, 7);
+	else writer.writeCode(0xC0 + symbol - 280, 8);
+}
+
+static void writeMatch(BitWriter& writer, int length, int distance)
+{
+	int i = 28;
+	while (lengthBase[i] > length) i--;
+	writeFixedSymbol(writer, 257 + i);
+	writer.write(length - lengthBase[i], lengthExtra[i]);
+
+	int j = 29;
+	while (distanceBase[j] > distance) j--;
+	writer.writeCode(j, 5);
+	writer.write(distance - distanceBase[j], distanceExtra[j]);
+}
+
+static void writeStoredBlock(BitWriter& writer, std::vector<unsigned char>& out, const unsigned char* data, size_t size, bool final)
+{
+	writer.write(final ? 1 : 0, 1);
+	writer.write(0, 2);
+	writer.align();
+	out.push_back(size & 0xFF);
+	out.push_back(size >> 8 & 0xFF);
+	out.push_back(~size & 0xFF);
+	out.push_back(~size >> 8 & 0xFF);
+	out.insert(out.end(), data, data + size);
+}
+
+void Deflate::compress(const unsigned char * data, size_t start, size_t end, Level level, bool last, std::vector<unsigned char>& out)
+{
+	BitWriter writer(out);
+
+	if (level == STORE) {
+		size_t pos = start;
+		do {
+			size_t blockSize = end - pos > 65535 ? 65535 : end - pos;
+			writeStoredBlock(writer, out, data + pos, blockSize, last && pos + blockSize == end);
+			pos += blockSize;
+		} while (pos < end);
+		return;
+	}
+
+	writer.write(last ? 1 : 0, 1);
+	writer.write(1, 2);
+
+	size_t dictStart = start > WINDOW_SIZE ? start - WINDOW_SIZE : 0;
+	std::vector<int> head(1 << HASH_BITS, -1);
+	std::vector<int> prev(end - dictStart);
+
+	auto hash = [data](size_t p) {
+		return ((data[p] << 10) ^ (data[p + 1] << 5) ^ data[p + 2]) & ((1 << HASH_BITS) - 1);
+	};
+	auto insert = [&](size_t p) {
+		int h = hash(p);
+		prev[p - dictStart] = head[h];
+		head[h] = p - dictStart;
+	};
+
+	for (size_t p = dictStart; p < start && p + MIN_MATCH <= end; p++) {
+		insert(p);
+	}
+
+	size_t pos = start;
+	while (pos < end) {
+		size_t bestLength = 0, bestDistance = 0;
+		if (pos + MIN_MATCH <= end) {
+			size_t maxLength = end - pos > MAX_MATCH ? MAX_MATCH : end - pos;
+			int candidate = head[hash(pos)];
+			for (int chain = 0; candidate >= 0 && chain < MAX_CHAIN; chain++) {
+				size_t candidatePos = dictStart + candidate;
+				if (pos - candidatePos > WINDOW_SIZE) break;
+				if (data[candidatePos + bestLength] == data[pos + bestLength]) {
+					size_t length = 0;
+					while (length < maxLength && data[candidatePos + length] == data[pos + length]) length++;
+					if (length > bestLength) {
+						bestLength = length;
+						bestDistance = pos - candidatePos;
+						if (length == maxLength) break;
+					}
+				}
+				candidate = prev[candidate];
+			}
+			insert(pos);
+		}
+
+		if (bestLength >= MIN_MATCH) {
+			writeMatch(writer, bestLength, bestDistance);
+			for (size_t p = pos + 1; p < pos + bestLength && p + MIN_MATCH <= end; p++) {
+				insert(p);
+			}
+			pos += bestLength;
+		}
+		else {
+			writeFixedSymbol(writer, data[pos]);
+			pos++;
+		}
+	}
+	writeFixedSymbol(writer, 256);
+
+	//empty stored block realigns the stream so the next piece can be appended
+	if (!last) writeStoredBlock(writer, out, data, 0, false);
+	else writer.align();
+}
+
+class BitReader {
+private:
+	const unsigned char* data;
+	size_t size, pos;
+	unsigned bitBuffer;
+	int bitCount;
+public:
+	BitReader(const unsigned char* data, size_t size) : data(data), size(size), pos(0), bitBuffer(0), bitCount(0) {}
+
+	unsigned bits(int count) {
+		unsigned value = bitBuffer;
+		while (bitCount < count) {
+			if (pos == size) throw BadFormatException("Compressed data is corrupted");
+			value |= (unsigned)data[pos++] << bitCount;
+			bitCount += 8;
+		}
+		bitBuffer = value >> count;
+		bitCount -= count;
+		return value & ((1u << count) - 1);
+	}
+	void align() { bitBuffer = 0; bitCount = 0; }
+	size_t getPos() const { return pos; }
+	void skip(size_t count) {
+		if (size - pos < count) throw BadFormatException("Compressed data is corrupted");
+		pos += count;
+	}
+	const unsigned char* current() const { return data + pos; }
+};
+
+struct Huffman {
+	short count[16];
+	short symbol[288];
+};
+
+static void buildHuffman(Huffman& h, const short* lengths, int n)
+{
+	for (int len = 0; len < 16; len++) h.count[len] = 0;
+	for (int symbol = 0; symbol < n; symbol++) h.count[lengths[symbol]]++;
+	if (h.count[0] == n) return;
+
+	int left = 1;
+	for (int len = 1; len < 16; len++) {
+		left <<= 1;
+		left -= h.count[len];
+		if (left < 0) throw BadFormatException("Compressed data is corrupted");
+	}
+
+	short offsets[16];
+	offsets[1] = 0;
+	for (int len = 1; len < 15; len++) offsets[len + 1] = offsets[len] + h.count[len];
+	for (int symbol = 0; symbol < n; symbol++)
+		if (lengths[symbol] != 0) h.symbol[offsets[lengths[symbol]]++] = symbol;
+}
+
+struct FixedHuffman {
+	Huffman lengthCode, distanceCode;
+
+	FixedHuffman() {
+		short lengths[288];
+		for (int i = 0; i < 288; i++) lengths[i] = i < 144 ? 8 : (i < 256 ? 9 : (i < 280 ? 7 : 8));
+		buildHuffman(lengthCode, lengths, 288);
+		for (int i = 0; i < 30; i++) lengths[i] = 5;
+		buildHuffman(distanceCode, lengths, 30);
+	}
+};
+
+static int decodeSymbol(BitReader& reader, const Huffman& h)
+{
+	int code = 0, first = 0, index = 0;
+	for (int len = 1; len < 16; len++) {
+		code |= reader.bits(1);
+		int count = h.count[len];
+		if (code - count < first) return h.symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	throw BadFormatException("Compressed data is corrupted");
+}
+
+static void inflateCodes(BitReader& reader, std::vector<unsigned char>& out, size_t limit, const Huffman& lengthCode, const Huffman& distanceCode)
+{
+	while (true) {
+		int symbol = decodeSymbol(reader, lengthCode);
+		if (symbol < 256) {
+			if (out.size() == limit) throw BadFormatException("Compressed data is larger than expected");
+			out.push_back(symbol);
+		}
+		else if (symbol == 256) {
+			return;
+		}
+		else {
+			symbol -= 257;
+			if (symbol >= 29) throw BadFormatException("Compressed data is corrupted");
+			size_t length = lengthBase[symbol] + reader.bits(lengthExtra[symbol]);
+
+			symbol = decodeSymbol(reader, distanceCode);
+			if (symbol >= 30) throw BadFormatException("Compressed data is corrupted");
+			size_t distance = distanceBase[symbol] + reader.bits(distanceExtra[symbol]);
+			if (distance > out.size()) throw BadFormatException("Compressed data is corrupted");
+			if (limit - out.size() < length) throw BadFormatException("Compressed data is larger than expected");
+
+			size_t from = out.size() - distance;
+			for (size_t i = 0; i < length; i++) {
+				out.push_back(out[from + i]);
+			}
+		}
+	}
+}
+
+static size_t inflateRaw(const unsigned char* data, size_t size, size_t limit, std::vector<unsigned char>& out)
+{
+	static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	BitReader reader(data, size);
+	bool last;
+	do {
+		last = reader.bits(1);
+		int type = reader.bits(2);
+
+		if (type == 0) {
+			reader.align();
+			reader.skip(4);
+			const unsigned char* header = reader.current() - 4;
+			unsigned length = header[0] | header[1] << 8;
+			if ((unsigned)(header[2] | header[3] << 8) != (~length & 0xFFFF)) throw BadFormatException("Compressed data is corrupted");
+			const unsigned char* block = reader.current();
+			reader.skip(length);
+			if (limit - out.size() < length) throw BadFormatException("Compressed data is larger than expected");
+			out.insert(out.end(), block, block + length);
+		}
+		else if (type == 1) {
+			static const FixedHuffman fixed;
+			inflateCodes(reader, out, limit, fixed.lengthCode, fixed.distanceCode);
+		}
+		else if (type == 2) {
+			int lengthCount = reader.bits(5) + 257;
+			int distanceCount = reader.bits(5) + 1;
+			int codeCount = reader.bits(4) + 4;
+			if (lengthCount > 286 || distanceCount > 30) throw BadFormatException("Compressed data is corrupted");
+
+			short lengths[320] = { 0 };
+			for (int i = 0; i < codeCount; i++) lengths[order[i]] = reader.bits(3);
+
+			Huffman codeCode, lengthCode, distanceCode;
+			buildHuffman(codeCode, lengths, 19);
+
+			int index = 0;
+			while (index < lengthCount + distanceCount) {
+				int symbol = decodeSymbol(reader, codeCode);
+				if (symbol < 16) {
+					lengths[index++] = symbol;
+					continue;
+				}
+				short repeated = 0;
+				int times;
+				if (symbol == 16) {
+					if (index == 0) throw BadFormatException("Compressed data is corrupted");
+					repeated = lengths[index - 1];
+					times = 3 + reader.bits(2);
+				}
+				else if (symbol == 17) times = 3 + reader.bits(3);
+				else times = 11 + reader.bits(7);
+				if (index + times > lengthCount + distanceCount) throw BadFormatException("Compressed data is corrupted");
+				while (times--) lengths[index++] = repeated;
+			}
+
+			buildHuffman(lengthCode, lengths, lengthCount);
+			buildHuffman(distanceCode, lengths + lengthCount, distanceCount);
+			inflateCodes(reader, out, limit, lengthCode, distanceCode);
+		}
+		else throw BadFormatException("Compressed data is corrupted");
+	} while (!last);
+
+	return reader.getPos();
+}
+
+std::vector<unsigned char> Deflate::inflate(const unsigned char * data, size_t size, size_t sizeHint, size_t limit)
+{
+	std::vector<unsigned char> out;
+	out.reserve(sizeHint < limit ? sizeHint : limit);
+	inflateRaw(data, size, limit, out);
+	return out;
+}
+
+std::vector<unsigned char> Deflate::zlibCompress(const unsigned char * data, size_t size, Level level)
+{
+	int pieces = size == 0 ? 1 : (size + PIECE_SIZE - 1) / PIECE_SIZE;
+	std::vector<std::vector<unsigned char>> compressed(pieces);
+	std::vector<unsigned> adlers(pieces);
+
+	ThreadPool::getPool().parallelFor(pieces, [&](int i) {
+		size_t start = i * PIECE_SIZE;
+		size_t end = start + PIECE_SIZE < size ? start + PIECE_SIZE : size;
+		compress(data, start, end, level, i == pieces - 1, compressed[i]);
+		adlers[i] = adler32(data + start, end - start);
+	});
+
+	std::vector<unsigned char> out;
+	size_t total = 6;
+	for (std::vector<unsigned char>& c : compressed) total += c.size();
+	out.reserve(total);
+
+	//32K window, no preset dictionary
+	out.push_back(0x78);
+	out.push_back(0x01);
+
+	unsigned adler = adlers[0];
+	for (int i = 0; i < pieces; i++) {
+		out.insert(out.end(), compressed[i].begin(), compressed[i].end());
+		if (i > 0) {
+			size_t start = i * PIECE_SIZE;
+			size_t end = start + PIECE_SIZE < size ? start + PIECE_SIZE : size;
+			adler = adler32Combine(adler, adlers[i], end - start);
+		}
+	}
+
+	out.push_back(adler >> 24 & 0xFF);
+	out.push_back(adler >> 16 & 0xFF);
+	out.push_back(adler >> 8 & 0xFF);
+	out.push_back(adler & 0xFF);
+	return out;
+}
+
+std::vector<unsigned char> Deflate::zlibDecompress(const unsigned char * data, size_t size, size_t sizeHint, size_t limit)
+{
+	if (size < 6 || (data[0] & 0x0F) != 8 || ((data[0] << 8) | data[1]) % 31 != 0 || (data[1] & 0x20))
+		throw BadFormatException("Compressed data is corrupted");
+
+	std::vector<unsigned char> out;
+	out.reserve(sizeHint < limit ? sizeHint : limit);
+	size_t consumed = inflateRaw(data + 2, size - 2, limit, out) + 2;
+	if (size - consumed < 4) throw BadFormatException("Compressed data is corrupted");
+
+	unsigned adler = (unsigned)data[consumed] << 24 | data[consumed + 1] << 16 | data[consumed + 2] << 8 | data[consumed + 3];
+	if (adler != adler32(out.data(), out.size())) throw BadFormatException("Compressed data is corrupted");
+	return out;
+}
+
+unsigned Deflate::adler32(const unsigned char * data, size_t size, unsigned adler)
+{
+	unsigned a = adler & 0xFFFF, b = adler >> 16;
+	while (size > 0) {
+		//5552 is the largest block that can't overflow before the modulo
+		size_t block = size < 5552 ? size : 5552;
+		size -= block;
+		while (block--) {
+			a += *data++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
+
+unsigned Deflate::adler32Combine(unsigned adler1, unsigned adler2, size_t size2)
+{
+	const unsigned BASE = 65521;
+	unsigned remainder = size2 % BASE;
+	unsigned sum1 = adler1 & 0xFFFF;
+	unsigned sum2 = (unsigned)(((unsigned long long)remainder * sum1) % BASE);
+	sum1 += (adler2 & 0xFFFF) + BASE - 1;
+	sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - remainder;
+	if (sum1 >= BASE) sum1 -= BASE;
+	if (sum1 >= BASE) sum1 -= BASE;
+	if (sum2 >= 2 * BASE) sum2 -= 2 * BASE;
+	if (sum2 >= BASE) sum2 -= BASE;
+	return sum2 << 16 | sum1;
+}
+
+struct CrcTable {
+	unsigned entries[256];
+
+	CrcTable() {
+		for (unsigned n = 0; n < 256; n++) {
+			unsigned c = n;
+			for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			entries[n] = c;
+		}
+	}
+};
+
+unsigned Deflate::crc32(const unsigned char * data, size_t size, unsigned crc)
+{
+	static const CrcTable table;
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++) {
+		crc = table.entries[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
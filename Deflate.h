@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include <cstddef>
+
+class Deflate {
+public:
+	enum Level { STORE, FAST };
+
+	//raw deflate of data[start, end), earlier bytes (up to 32K) are used as the dictionary
+	//blocks are byte aligned at the end so independently compressed pieces can be concatenated
+	static void compress(const unsigned char* data, size_t start, size_t end, Level level, bool last, std::vector<unsigned char>& out);
+	//output past limit is treated as corrupted data
+	static std::vector<unsigned char> inflate(const unsigned char* data, size_t size, size_t sizeHint = 0, size_t limit = (size_t)-1);
+
+	//zlib streams, compressed in parallel pieces on the thread pool
+	static std::vector<unsigned char> zlibCompress(const unsigned char* data, size_t size, Level level);
+	static std::vector<unsigned char> zlibDecompress(const unsigned char* data, size_t size, size_t sizeHint = 0, size_t limit = (size_t)-1);
+
+	static unsigned adler32(const unsigned char* data, size_t size, unsigned adler = 1);
+	static unsigned adler32Combine(unsigned adler1, unsigned adler2, size_t size2);
+	static unsigned crc32(const unsigned char* data, size_t size, unsigned crc = 0);
+};
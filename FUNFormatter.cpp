@@ -1,15 +1,225 @@
 #include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <climits>
+#include <thread>
 #include "Image.h"
+#include "MappedFile.h"
 #include "Formatter.h"
 #include "Operation.h"
 #include "Exceptions.h"
+#include "XMLWriter.h"
 #include "rapidxml.hpp"
-#include "rapidxml_print.hpp"
 #include "rapidxml_utils.hpp"
 
 using namespace rapidxml;
 
-CompositeOperation * FUNFormatter::load(const std::string & path)
+//compiled layout: header with the source's stamp and hash, name, table of operation names, then one record per basic operation
+//a record is the name index, the number of params and a mask of which params are doubles
+static const char magic[8] = { '\x89', 'F', 'U', 'N', '\r', '\n', '\x1a', '\n' };
+static const unsigned VERSION = 3;
+
+static void appendU32(std::vector<unsigned char>& out, unsigned value)
+{
+	for (int i = 0; i < 32; i += 8) out.push_back(value >> i & 0xFF);
+}
+
+static void appendU64(std::vector<unsigned char>& out, unsigned long long value)
+{
+	for (int i = 0; i < 64; i += 8) out.push_back(value >> i & 0xFF);
+}
+
+static void appendString(std::vector<unsigned char>& out, const std::string& value)
+{
+	appendU32(out, value.size());
+	out.insert(out.end(), value.begin(), value.end());
+}
+
+static const unsigned char* take(const unsigned char*& pos, const unsigned char* end, size_t count)
+{
+	if ((size_t)(end - pos) < count) throw BadFormatException("Compiled operation is truncated");
+	const unsigned char *current = pos;
+	pos += count;
+	return current;
+}
+
+static unsigned readU32(const unsigned char*& pos, const unsigned char* end)
+{
+	const unsigned char *b = take(pos, end, 4);
+	return (unsigned)b[0] | b[1] << 8 | b[2] << 16 | (unsigned)b[3] << 24;
+}
+
+static unsigned long long readU64(const unsigned char*& pos, const unsigned char* end)
+{
+	unsigned long long low = readU32(pos, end);
+	return low | (unsigned long long)readU32(pos, end) << 32;
+}
+
+static std::string readString(const unsigned char*& pos, const unsigned char* end)
+{
+	unsigned length = readU32(pos, end);
+	return std::string((const char*)take(pos, end, length), length);
+}
+
+//nested composites run their children in order, so they can be spliced into the parent
+static void flatten(const Operation* o, std::vector<const Operation*>& out)
+{
+	const CompositeOperation *composite = dynamic_cast<const CompositeOperation*>(o);
+	if (!composite) {
+		out.push_back(o);
+		return;
+	}
+	for (const Operation *child : composite->getOperations()) flatten(child, out);
+}
+
+static unsigned long long hashFile(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+	unsigned long long hash = 14695981039346656037ULL;
+	char buffer[1 << 16];
+	while (FILE) {
+		FILE.read(buffer, sizeof(buffer));
+		for (std::streamsize i = 0; i < FILE.gcount(); i++) hash = (hash ^ (unsigned char)buffer[i]) * 1099511628211ULL;
+	}
+	return hash;
+}
+
+//written under a temporary name so other workers never map half a file
+static void writeCompiled(const std::string& compiledPath, const std::vector<unsigned char>& data)
+{
+	std::string temporary = compiledPath + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	std::ofstream FILE(temporary, std::ofstream::binary | std::ofstream::out);
+	if (!FILE.is_open()) return;
+	FILE.write((const char*)data.data(), data.size());
+	FILE.close();
+#ifdef _WIN32
+	//rename doesn't replace an existing file here
+	std::remove(compiledPath.c_str());
+#endif
+	if (std::rename(temporary.c_str(), compiledPath.c_str()) != 0) std::remove(temporary.c_str());
+}
+
+std::vector<unsigned char> FUNFormatter::compile(const CompositeOperation & operation, const Source & source)
+{
+	std::vector<const Operation*> operations;
+	flatten(&operation, operations);
+
+	std::vector<std::string> names;
+	std::map<std::string, int> nameIds;
+	for (const Operation *o : operations) {
+		if (nameIds.insert(std::make_pair(o->getName(), (int)names.size())).second)
+			names.push_back(o->getName());
+	}
+
+	std::vector<unsigned char> out(magic, magic + 8);
+	appendU32(out, VERSION);
+	appendU32(out, operations.size());
+	appendU64(out, source.stamp.size);
+	appendU64(out, source.stamp.modified);
+	appendU64(out, source.hash);
+	appendString(out, operation.getName());
+	appendU32(out, names.size());
+	for (const std::string& name : names) appendString(out, name);
+
+	for (const Operation *o : operations) {
+		std::vector<double> params = o->getParams();
+		if (params.size() > 8) throw BadInputException("Too many parameters for " + o->getName());
+
+		//whole numbers take four bytes, everything else keeps the full double
+		unsigned char mask = 0;
+		for (size_t i = 0; i < params.size(); i++) {
+			bool whole = params[i] >= INT_MIN && params[i] <= INT_MAX && params[i] == (int)params[i];
+			if (!whole) mask |= 1 << i;
+		}
+
+		unsigned id = nameIds[o->getName()];
+		out.push_back(id & 0xFF);
+		out.push_back(id >> 8 & 0xFF);
+		out.push_back(params.size());
+		out.push_back(mask);
+		for (size_t i = 0; i < params.size(); i++) {
+			if (mask & 1 << i) {
+				unsigned long long bits;
+				std::memcpy(&bits, &params[i], sizeof(bits));
+				appendU64(out, bits);
+			}
+			else appendU32(out, (unsigned)(int)params[i]);
+		}
+	}
+	return out;
+}
+
+FUNFormatter::Source FUNFormatter::readSource(const unsigned char * data, size_t size)
+{
+	const unsigned char *pos = data, *end = data + size;
+	if (std::memcmp(take(pos, end, 8), magic, 8) != 0) throw BadFormatException("Not a compiled operation");
+	if (readU32(pos, end) != VERSION) throw BadFormatException("Unsupported compiled operation version");
+	readU32(pos, end);
+	Source source;
+	source.stamp.size = (long long)readU64(pos, end);
+	source.stamp.modified = (long long)readU64(pos, end);
+	source.hash = readU64(pos, end);
+	return source;
+}
+
+CompositeOperation * FUNFormatter::decompile(const unsigned char * data, size_t size)
+{
+	const unsigned char *pos = data, *end = data + size;
+	if (std::memcmp(take(pos, end, 8), magic, 8) != 0) throw BadFormatException("Not a compiled operation");
+	if (readU32(pos, end) != VERSION) throw BadFormatException("Unsupported compiled operation version");
+	unsigned count = readU32(pos, end);
+	take(pos, end, 24);
+	std::string name = readString(pos, end);
+
+	//names are resolved once, records only carry an index
+	std::vector<Operation*> prototypes(readU32(pos, end));
+	for (Operation*& prototype : prototypes) {
+		std::string operationName = readString(pos, end);
+		prototype = Operation::getOperation(operationName);
+		if (!prototype || dynamic_cast<CompositeOperation*>(prototype))
+			throw BadFormatException("Unknown operation " + operationName);
+	}
+
+	CompositeOperation *composite = new CompositeOperation(name);
+	std::vector<double> params;
+	try {
+		for (unsigned i = 0; i < count; i++) {
+			const unsigned char *record = take(pos, end, 4);
+			unsigned id = record[0] | record[1] << 8;
+			if (id >= prototypes.size()) throw BadFormatException("Compiled operation is corrupted");
+			Operation *prototype = prototypes[id];
+
+			if (record[2] != prototype->numOfParams())
+				throw BadFormatException("Wrong number of parameters for " + prototype->getName());
+			if (record[2] == 0) {
+				composite->addOperation(prototype);
+				continue;
+			}
+
+			params.resize(record[2]);
+			for (int j = 0; j < record[2]; j++) {
+				if (record[3] & 1 << j) {
+					unsigned long long bits = readU64(pos, end);
+					std::memcpy(&params[j], &bits, sizeof(bits));
+				}
+				else params[j] = (int)readU32(pos, end);
+			}
+
+			//the values were accepted when the source was read, so they go back in as they are
+			Operation *o = prototype->clone();
+			o->restoreParams(params);
+			composite->addOperation(o);
+			delete o;
+		}
+	}
+	catch (...) {
+		delete composite;
+		throw;
+	}
+	return composite;
+}
+
+CompositeOperation * FUNFormatter::parse(const std::string & path)
 {
 	doc.remove_all_attributes();
 	doc.remove_all_nodes();
@@ -31,24 +241,73 @@ CompositeOperation * FUNFormatter::load(const std::string & path)
 	return importedOperation;
 }
 
+CompositeOperation * FUNFormatter::load(const std::string & path)
+{
+	//importing keeps nested composites and their names, only running goes through the compiled copy
+	return parse(path);
+}
+
+CompositeOperation * FUNFormatter::loadRunnable(const std::string & path)
+{
+	Source source;
+	if (!compiled || !FileStamp::get(path, source.stamp)) return parse(path);
+
+	std::string compiledPath = getCompiledPath(path);
+	bool hashed = false;
+
+	//the source is only read and hashed when its stamp changed, a stale or damaged compiled file is simply rebuilt
+	try {
+		MappedFile compiledFile(compiledPath);
+		Source stored = readSource(compiledFile.getData(), compiledFile.getSize());
+		if (stored.stamp == source.stamp) return decompile(compiledFile.getData(), compiledFile.getSize());
+
+		source.hash = hashFile(path);
+		hashed = true;
+		if (stored.hash == source.hash) {
+			//touched but not changed, the copy is kept under the new stamp
+			CompositeOperation *importedOperation = decompile(compiledFile.getData(), compiledFile.getSize());
+			try {
+				writeCompiled(compiledPath, compile(*importedOperation, source));
+			}
+			catch (...) {
+				delete importedOperation;
+				throw;
+			}
+			return importedOperation;
+		}
+	}
+	catch (Exception&) {}
+	if (!hashed) source.hash = hashFile(path);
+
+	//running always goes through the compiled form so both paths give the same operation
+	CompositeOperation *parsed = parse(path);
+	CompositeOperation *importedOperation;
+	std::vector<unsigned char> data;
+	try {
+		data = compile(*parsed, source);
+		importedOperation = decompile(data.data(), data.size());
+	}
+	catch (...) {
+		delete parsed;
+		throw;
+	}
+	delete parsed;
+	writeCompiled(compiledPath, data);
+	return importedOperation;
+}
+
 void FUNFormatter::save(CompositeOperation *operation, const std::string& path) {
 	std::ofstream FILE(path);
-	doc.remove_all_attributes();
-	doc.remove_all_nodes();
-	doc.clear();
+	XMLWriter writer(FILE);
 
-	xml_node<> *node = doc.allocate_node(node_element, "compositeOperation");
-	
-	char *name = doc.allocate_string(operation->getName().c_str());
-	xml_node<> *nameNode = doc.allocate_node(node_element, "name", name);
-	
-	node->append_node(nameNode);
+	writer.openElement("compositeOperation");
 
-	operation->appendParamsXML(doc, *node);
+	writer.element("name", operation->getName());
 
-	doc.append_node(node);
+	operation->writeParamsXML(writer);
 
-	FILE << doc;
+	writer.closeElement();
+	writer.endDocument();
 
 	FILE.close();
 }
\ No newline at end of file
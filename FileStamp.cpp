@@ -0,0 +1,28 @@
+#include "FileStamp.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+bool FileStamp::get(const std::string & path, FileStamp & stamp)
+{
+#ifdef _WIN32
+	//stat only keeps whole seconds here, the file times are in 100 ns steps
+	WIN32_FILE_ATTRIBUTE_DATA info;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &info)) return false;
+	stamp.size = (long long)info.nFileSizeHigh << 32 | info.nFileSizeLow;
+	stamp.modified = (long long)info.ftLastWriteTime.dwHighDateTime << 32 | info.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0) return false;
+	stamp.size = info.st_size;
+#ifdef __APPLE__
+	stamp.modified = (long long)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+	stamp.modified = (long long)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#endif
+	return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <string>
+
+//size and modification time of a file, the time as fine as the platform keeps it
+//caches keyed on a stamp notice a file rewritten with the same size in the same second
+struct FileStamp {
+	long long size, modified;
+
+	bool operator==(const FileStamp& stamp) const { return size == stamp.size && modified == stamp.modified; }
+	bool operator!=(const FileStamp& stamp) const { return !(*this == stamp); }
+
+	//false if the file doesn't exist or can't be stat-ed
+	static bool get(const std::string& path, FileStamp& stamp);
+};
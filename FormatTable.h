@@ -0,0 +1,57 @@
+#pragma once
+#include <map>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cctype>
+
+template<typename T>
+class FormatTable {
+private:
+	std::map<std::string, T*> extensions;
+	std::vector<std::pair<std::string, T*>> signatures[256];
+	size_t longestSignature;
+public:
+	FormatTable() : longestSignature(0) {}
+
+	static std::string getExtension(const std::string& path) {
+		size_t dot = path.find_last_of("./\\");
+		if (dot == std::string::npos || path[dot] != '.') return "";
+		std::string extension = path.substr(dot + 1);
+		for (char& c : extension) c = std::tolower((unsigned char)c);
+		return extension;
+	}
+
+	void addExtension(const std::string& extension, T* formatter) {
+		if (extensions.find(extension) == extensions.end()) {
+			extensions[extension] = formatter;
+		}
+	}
+	void addSignature(const std::string& signature, T* formatter) {
+		signatures[(unsigned char)signature[0]].push_back(std::make_pair(signature, formatter));
+		if (signature.size() > longestSignature) longestSignature = signature.size();
+	}
+
+	T* byExtension(const std::string& extension) const {
+		auto it = extensions.find(extension);
+		return it != extensions.end() ? it->second : nullptr;
+	}
+	T* byPath(const std::string& path) const {
+		return byExtension(getExtension(path));
+	}
+	//magic bytes first, extension if the file can't be read or isn't recognized
+	T* byContent(const std::string& path) const {
+		std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+		if (FILE.is_open() && longestSignature > 0) {
+			std::string header(longestSignature, '\0');
+			FILE.read(&header[0], longestSignature);
+			header.resize(FILE.gcount());
+			if (!header.empty()) {
+				for (const std::pair<std::string, T*>& s : signatures[(unsigned char)header[0]]) {
+					if (header.compare(0, s.first.size(), s.first) == 0) return s.second;
+				}
+			}
+		}
+		return byPath(path);
+	}
+};
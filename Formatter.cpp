@@ -1,48 +1,89 @@
 #include "Formatter.h"
+#include "Image.h"
 
-std::map<std::string, ImageFormatter*> ImageFormatter::formatMap;
-std::map<std::string, OperationFormatter*> OperationFormatter::formatMap;
-std::map<std::string, ProjectFormatter*> ProjectFormatter::formatMap;
+FormatTable<ImageFormatter> ImageFormatter::formats;
+FormatTable<OperationFormatter> OperationFormatter::formats;
+FormatTable<ProjectFormatter> ProjectFormatter::formats;
 
 void ImageFormatter::addFormat(std::string fileType, ImageFormatter * formatter)
 {
-	if (formatMap.find(fileType) == formatMap.end()) {
-		formatMap[fileType] = formatter;
-	}
+	formats.addExtension(fileType, formatter);
 	// u suprotnom exception
 }
 
+void ImageFormatter::addSignature(std::string signature, ImageFormatter * formatter)
+{
+	formats.addSignature(signature, formatter);
+}
+
+void ImageFormatter::save(const std::string & path)
+{
+	Layer *flattened = Image::getImage()->flatten();
+	write(*flattened, path);
+	delete flattened;
+}
+
 ImageFormatter * ImageFormatter::getFormatter(std::string fileType)
 {
-	if (formatMap.find(fileType) != formatMap.end())
-		return formatMap[fileType];
-	return nullptr;
+	return formats.byExtension(fileType);
+}
+
+ImageFormatter * ImageFormatter::getReader(const std::string & path)
+{
+	return formats.byContent(path);
+}
+
+ImageFormatter * ImageFormatter::getWriter(const std::string & path)
+{
+	return formats.byPath(path);
 }
 
 void OperationFormatter::addFormat(std::string fileType, OperationFormatter * formatter)
 {
-	if (formatMap.find(fileType) == formatMap.end()) {
-		formatMap[fileType] = formatter;
-	}
+	formats.addExtension(fileType, formatter);
+}
+
+void OperationFormatter::addSignature(std::string signature, OperationFormatter * formatter)
+{
+	formats.addSignature(signature, formatter);
 }
 
 OperationFormatter * OperationFormatter::getFormatter(std::string fileType)
 {
-	if (formatMap.find(fileType) != formatMap.end())
-		return formatMap[fileType];
-	return nullptr;
+	return formats.byExtension(fileType);
+}
+
+OperationFormatter * OperationFormatter::getReader(const std::string & path)
+{
+	return formats.byContent(path);
+}
+
+OperationFormatter * OperationFormatter::getWriter(const std::string & path)
+{
+	return formats.byPath(path);
 }
 
 void ProjectFormatter::addFormat(std::string fileType, ProjectFormatter * formatter)
 {
-	if (formatMap.find(fileType) == formatMap.end()) {
-		formatMap[fileType] = formatter;
-	}
+	formats.addExtension(fileType, formatter);
+}
+
+void ProjectFormatter::addSignature(std::string signature, ProjectFormatter * formatter)
+{
+	formats.addSignature(signature, formatter);
 }
 
 ProjectFormatter * ProjectFormatter::getFormatter(std::string fileType)
 {
-	if (formatMap.find(fileType) != formatMap.end())
-		return formatMap[fileType];
-	return nullptr;
+	return formats.byExtension(fileType);
+}
+
+ProjectFormatter * ProjectFormatter::getReader(const std::string & path)
+{
+	return formats.byContent(path);
+}
+
+ProjectFormatter * ProjectFormatter::getWriter(const std::string & path)
+{
+	return formats.byPath(path);
 }
@@ -1,42 +1,108 @@
 #pragma once
 #include <map>
 #include "Layer.h"
+#include "Deflate.h"
+#include "FormatTable.h"
+#include "FileStamp.h"
 #include "rapidxml.hpp"
+#include "XMLWriter.h"
+
+//a few rows at a time, for images that don't have to be held whole
+class StripReader {
+public:
+	virtual int getWidth() const = 0;
+	virtual int getHeight() const = 0;
+	//fills rows starting at first, counted from the bottom like a layer's
+	virtual void read(int first, std::vector<std::vector<Pixel>>& rows) = 0;
+	virtual ~StripReader() {}
+};
+
+class StripWriter {
+public:
+	//strips come bottom first
+	virtual void write(int first, const std::vector<std::vector<Pixel>>& rows) = 0;
+	virtual void close() = 0;
+	virtual ~StripWriter() {}
+};
 
 class ImageFormatter {
 private:
-	static std::map<std::string, ImageFormatter*> formatMap;
+	static FormatTable<ImageFormatter> formats;
 
 public:
 	static void addFormat(std::string fileType, ImageFormatter *formatter);
+	static void addSignature(std::string signature, ImageFormatter *formatter);
 	static ImageFormatter* getFormatter(std::string fileType);
+	static ImageFormatter* getReader(const std::string& path);
+	static ImageFormatter* getWriter(const std::string& path);
 
 	virtual Layer* load(const std::string& path) = 0;
-	virtual void save(const std::string& path) = 0;
+	virtual void write(const Layer& image, const std::string& path) = 0;
+	void save(const std::string& path);
+	//null for formats that can only be read or written whole
+	virtual StripReader* openStrips(const std::string& path) { return nullptr; }
+	virtual StripWriter* createStrips(const std::string& path, int width, int height) { return nullptr; }
 
 };
 
 class BMPFormatter : public ImageFormatter {
 public:
 	Layer* load(const std::string& path) override;
-	void save(const std::string& path) override;
+	void write(const Layer& image, const std::string& path) override;
+	StripReader* openStrips(const std::string& path) override;
+	StripWriter* createStrips(const std::string& path, int width, int height) override;
 
 };
 
 class PAMFormatter : public ImageFormatter {
 public:
 	Layer* load(const std::string& path) override;
-	void save(const std::string& path) override;
+	void write(const Layer& image, const std::string& path) override;
+
+};
+
+class PNMFormatter : public ImageFormatter {
+public:
+	enum Type { PGM, PPM };
+private:
+	Type type;
+public:
+	PNMFormatter(Type type) : type(type) {}
+
+	Layer* load(const std::string& path) override;
+	void write(const Layer& image, const std::string& path) override;
+	StripReader* openStrips(const std::string& path) override;
+	StripWriter* createStrips(const std::string& path, int width, int height) override;
+
+};
+
+class PNGFormatter : public ImageFormatter {
+private:
+	Deflate::Level level;
+public:
+	PNGFormatter(Deflate::Level level = Deflate::FAST) : level(level) {}
+
+	Deflate::Level getLevel() const { return level; }
+	void setLevel(Deflate::Level level) { this->level = level; }
+
+	static std::vector<unsigned char> encode(const Layer& l, Deflate::Level level);
+	static Layer* decode(const unsigned char* data, size_t size, const std::string& path = "");
+
+	Layer* load(const std::string& path) override;
+	void write(const Layer& image, const std::string& path) override;
 
 };
 
 class ProjectFormatter {
 private:
-	static std::map<std::string, ProjectFormatter*> formatMap;
+	static FormatTable<ProjectFormatter> formats;
 
 public:
 	static void addFormat(std::string fileType, ProjectFormatter *formatter);
+	static void addSignature(std::string signature, ProjectFormatter *formatter);
 	static ProjectFormatter* getFormatter(std::string fileType);
+	static ProjectFormatter* getReader(const std::string& path);
+	static ProjectFormatter* getWriter(const std::string& path);
 
 	virtual void load(const std::string& path) = 0;
 	virtual void save(const std::string& path) = 0;
@@ -44,17 +110,35 @@ public:
 };
 
 class DRFormatter : public ProjectFormatter {
+public:
+	//NONE replays the history on load, EMBED stores each layer as base64 png
+	//inside the project and REFERENCE writes it next to the project file
+	enum Snapshot { NONE, EMBED, REFERENCE };
 private:
 	rapidxml::xml_document<> doc;
+	Snapshot snapshot;
+	std::vector<Layer::Checkpoint> checkpoints;
+	std::map<Layer::Checkpoint, int> checkpointIds;
+
+	void writeXMLRectangle(XMLWriter& writer, const Rectangle& rect);
+	void writeXMLSelection(XMLWriter& writer, Selection *s);
+	void writeXMLSelection(XMLWriter& writer, std::pair<std::string, Selection*> s);
+	void writeXMLDoneOperation(XMLWriter& writer, Layer::DoneOperation *o);
+	void writeXMLLayer(XMLWriter& writer, Layer *l, const std::string& directory, const std::string& snapshotPath);
+	void writeXMLSnapshot(XMLWriter& writer, Layer *l, const std::string& directory, const std::string& snapshotPath);
+
+	Selection* convertXMLtoSelection(rapidxml::xml_node<>& node);
+	Layer* convertXMLtoLayer(rapidxml::xml_node<>& node, const std::string& directory);
+	Layer* convertXMLtoAdjustment(rapidxml::xml_node<>& node);
+	Layer* convertXMLtoGroup(rapidxml::xml_node<>& node, const std::string& directory);
+	Layer* convertXMLtoSnapshot(rapidxml::xml_node<>& node, const std::string& directory, const std::string& path);
+	Layer::Checkpoint convertXMLtoCheckpoint(rapidxml::xml_node<>& node);
+public:
+	DRFormatter(Snapshot snapshot = NONE) : snapshot(snapshot) {}
 
-	void appendXMLRectangle(rapidxml::xml_node<>& node, const Rectangle& rect);
-	void appendXMLSelection(rapidxml::xml_node<>& node, Selection *s);
-	void appendXMLSelection(rapidxml::xml_node<>& node, std::pair<std::string, Selection*> s);
-	void appendXMLDoneOperation(rapidxml::xml_node<>& node, Layer::DoneOperation *o);
-	void appendXMLLayer(rapidxml::xml_node<>& node, Layer *l);
+	Snapshot getSnapshot() const { return snapshot; }
+	void setSnapshot(Snapshot snapshot) { this->snapshot = snapshot; }
 
-	Layer* convertXMLtoLayer(rapidxml::xml_node<>& node);
-public:
 	void load(const std::string& path) override;
 	void save(const std::string& path) override;
 
@@ -62,21 +146,60 @@ public:
 
 class CompositeOperation;
 
+class DRBFormatter : public ProjectFormatter {
+private:
+	bool snapshots;
+public:
+	DRBFormatter(bool snapshots = true) : snapshots(snapshots) {}
+
+	bool getSnapshots() const { return snapshots; }
+	void setSnapshots(bool snapshots) { this->snapshots = snapshots; }
+
+	//reads a single layer straight from the file, the image is left alone
+	static int getLayerCount(const std::string& path);
+	static Layer* loadLayer(const std::string& path, int index);
+
+	void load(const std::string& path) override;
+	void save(const std::string& path) override;
+
+};
+
 class OperationFormatter {
-	static std::map<std::string, OperationFormatter*> formatMap;
+	static FormatTable<OperationFormatter> formats;
 public:
 	static void addFormat(std::string fileType, OperationFormatter *formatter);
+	static void addSignature(std::string signature, OperationFormatter *formatter);
 	static OperationFormatter* getFormatter(std::string fileType);
+	static OperationFormatter* getReader(const std::string& path);
+	static OperationFormatter* getWriter(const std::string& path);
 
 	virtual CompositeOperation* load(const std::string& path) = 0;
+	//for callers that only run the operation, nested composites may come back flattened into one
+	virtual CompositeOperation* loadRunnable(const std::string& path) { return load(path); }
 	virtual void save(CompositeOperation *operation, const std::string& path) = 0;
 };
 
 class FUNFormatter : public OperationFormatter{
 private:
 	rapidxml::xml_document<> doc;
+	bool compiled;
 
+	CompositeOperation* parse(const std::string& path);
 public:
+	//a flattened binary copy is kept next to the .fun file and reused while the source's contents are unchanged
+	FUNFormatter(bool compiled = true) : compiled(compiled) {}
+
+	static std::string getCompiledPath(const std::string& path) { return path + "c"; }
+	//what a compiled copy records about its .fun file, the hash is only computed when the stamp changed
+	struct Source {
+		FileStamp stamp;
+		unsigned long long hash;
+	};
+	static std::vector<unsigned char> compile(const CompositeOperation& operation, const Source& source);
+	static Source readSource(const unsigned char* data, size_t size);
+	static CompositeOperation* decompile(const unsigned char* data, size_t size);
+
 	CompositeOperation* load(const std::string& path) override;
+	CompositeOperation* loadRunnable(const std::string& path) override;
 	void save(CompositeOperation *operation, const std::string& path) override;
 };
\ No newline at end of file
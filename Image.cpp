@@ -1,36 +1,183 @@
-#include <regex>
+#include <set>
 #include "Image.h"
+#include "Batch.h"
 #include "Formatter.h"
 #include "Selection.h"
+#include "Program.h"
+#include "ThreadPool.h"
+#include "ImageCache.h"
 #include "Exceptions.h"
 
 Image* Image::image = nullptr;
 
-Pixel Image::getPixel(int width, int height)
+Pixel Image::composite(const std::vector<Layer*>& layers, size_t first, size_t last, int width, int height, const Pixel * below)
 {
+	//whatever is already composited below goes under the layers like one more layer
+	auto forEach = [&](auto f) {
+		for (size_t i = first; i < last; i++) {
+			const Layer *l = layers[i];
+			if (l->getVisible() && !l->isAdjustment()) f(l->getOpacity() / 100.0, (*l)[height][width]);
+		}
+		if (below) f(1.0, *below);
+	};
+
 	int  tempRed = 0, tempGreen = 0, tempBlue = 0;
 	double tempAlpha = 0;
-	for (Layer *l : layers) {
-		if (l->getVisible()) {
-			double opacity = l->getOpacity() / 100.0;
-			Pixel tempPixel = (*l)[height][width];
-			double doubleA = tempPixel.getA() * opacity / 255.0;
-			tempAlpha += (1 - tempAlpha) * doubleA;
+	forEach([&](double opacity, const Pixel& tempPixel) {
+		double doubleA = tempPixel.getA() * opacity / 255.0;
+		tempAlpha += (1 - tempAlpha) * doubleA;
+	});
+	double temperAlpha = 0;
+	forEach([&](double opacity, const Pixel& tempPixel) {
+		double doubleA = tempPixel.getA() * opacity / 255.0;
+		tempRed += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getR();
+		tempGreen += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getG();
+		tempBlue += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getB();
+		temperAlpha += (1 - temperAlpha) * doubleA;
+	});
+	return Pixel(tempRed, tempGreen, tempBlue, tempAlpha*255);
+}
+
+bool Image::hasPixels(const std::vector<Layer*>& layers, size_t first, size_t last)
+{
+	for (size_t i = first; i < last; i++)
+		if (layers[i]->getVisible() && !layers[i]->isAdjustment()) return true;
+	return false;
+}
+
+Pixel Image::getPixel(int width, int height)
+{
+	return composite(layers, 0, layers.size(), width, height, nullptr);
+}
+
+Layer * Image::flatten()
+{
+	return flatten(Rectangle(0, height - 1, width, height));
+}
+
+Layer * Image::flatten(const Rectangle & area)
+{
+	int left = area.getX() > 0 ? area.getX() : 0;
+	int right = area.getX() + area.getWidth() < width ? area.getX() + area.getWidth() : width;
+	int top = area.getY() < height - 1 ? area.getY() : height - 1;
+	int bottom = area.getY() - area.getHeight() + 1 > 0 ? area.getY() - area.getHeight() + 1 : 0;
+	if (left >= right || bottom > top) return new Layer(0, 0);
+
+	//adjustments reading neighbouring pixels are evaluated over a halo around the area and cut back to it
+	bool inPlace = false;
+	int reach = adjustmentReach(layers, inPlace);
+	int outerLeft = 0, outerRight = width, outerTop = height - 1, outerBottom = 0;
+	if (reach >= 0) {
+		outerTop = top + reach < height - 1 ? top + reach : height - 1;
+		if (!inPlace) {
+			outerLeft = left - reach > 0 ? left - reach : 0;
+			outerRight = right + reach < width ? right + reach : width;
+			outerBottom = bottom - reach > 0 ? bottom - reach : 0;
 		}
 	}
-	double temperAlpha = 0;
-	for (Layer *l : layers) {
-		if (l->getVisible()) {
-			double opacity = l->getOpacity() / 100.0;
-			Pixel tempPixel = (*l)[height][width];
-			double doubleA = tempPixel.getA() * opacity / 255.0;
-			tempRed += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getR();
-			tempGreen += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getG();
-			tempBlue += (1 - temperAlpha) * doubleA / tempAlpha * tempPixel.getB();
-			temperAlpha += (1 - temperAlpha) * doubleA;
+	if (reach == 0 || (outerLeft == left && outerRight == right && outerTop == top && outerBottom == bottom))
+		return flattenLayers(layers, Rectangle(left, top, right - left, top - bottom + 1));
+
+	Layer *outer = flattenLayers(layers, Rectangle(outerLeft, outerTop, outerRight - outerLeft, outerTop - outerBottom + 1));
+	Layer *flattened = new Layer(right - left, top - bottom + 1);
+	for (int j = 0; j <= top - bottom; j++) {
+		const std::vector<Pixel>& row = static_cast<const Layer&>(*outer)[bottom - outerBottom + j];
+		std::copy(row.begin() + (left - outerLeft), row.begin() + (right - outerLeft), (*flattened)[j].begin());
+	}
+	delete outer;
+	return flattened;
+}
+
+int Image::adjustmentReach(const std::vector<Layer*>& layers, bool& inPlace)
+{
+	//stacked adjustments read each other's results, so their reaches add up
+	int reach = 0;
+	for (const Layer *l : layers) {
+		if (!l->isAdjustment() || !l->getVisible()) continue;
+		for (const Operation *o : l->getAdjustment()->getPlan()) {
+			Program probe;
+			if (o->lower(probe)) continue;
+			if (o->reach() < 0) return -1;
+			reach += o->reach();
+			//the rows below and the pixels to the left are already rewritten when they are read
+			if (!o->aware()) inPlace = true;
 		}
 	}
-	return Pixel(tempRed, tempGreen, tempBlue, tempAlpha*255);
+	return reach;
+}
+
+Layer * Image::flattenLayers(const std::vector<Layer*>& layers, const Rectangle & area)
+{
+	int left = area.getX();
+	int right = area.getX() + area.getWidth();
+	int top = area.getY();
+	int bottom = area.getY() - area.getHeight() + 1;
+	if (left >= right || bottom > top) return new Layer(0, 0);
+
+	//hidden layers keep whatever they have queued, hidden groups keep their stale composite
+	for (Layer *l : layers)
+		if (l->getVisible()) l->evaluate();
+
+	//every visible adjustment splits the stack, the part below it is composited and adjusted first
+	Layer *flattened = new Layer(right - left, top - bottom + 1);
+	ThreadPool& pool = ThreadPool::getPool();
+	size_t last = layers.size();
+	bool below = false;
+	for (size_t i = layers.size(); i-- > 0;) {
+		const Layer *adjustment = layers[i];
+		if (!adjustment->isAdjustment() || !adjustment->getVisible()) continue;
+
+		if (!below || hasPixels(layers, i + 1, last)) {
+			pool.parallelFor(top - bottom + 1, [&layers, flattened, left, right, bottom, i, last, below](int j) {
+				std::vector<Pixel>& row = (*flattened)[j];
+				for (int k = left; k < right; k++)
+					row[k - left] = composite(layers, i + 1, last, k, bottom + j, below ? &row[k - left] : nullptr);
+			});
+		}
+		adjust(flattened, *adjustment, left, bottom);
+		last = i;
+		below = true;
+	}
+
+	//with nothing visible the result stays transparent
+	if (!hasPixels(layers, 0, last)) return flattened;
+	pool.parallelFor(top - bottom + 1, [&layers, flattened, left, right, bottom, last, below](int j) {
+		std::vector<Pixel>& row = (*flattened)[j];
+		for (int k = left; k < right; k++)
+			row[k - left] = composite(layers, 0, last, k, bottom + j, below ? &row[k - left] : nullptr);
+	});
+	return flattened;
+}
+
+void Image::adjust(Layer * flattened, const Layer & adjustment, int left, int bottom)
+{
+	//selections are in canvas coordinates, the flattened area may start anywhere
+	std::vector<Selection*> selections;
+	for (Selection *s : adjustment.getAdjustmentSelections()) {
+		std::vector<Rectangle> rects;
+		for (const Rectangle& r : s->getRectangles())
+			rects.push_back(Rectangle(r.getX() - left, r.getY() - bottom, r.getWidth(), r.getHeight()));
+		selections.push_back(new Selection(rects));
+		selections.back()->clamp(flattened->getWidth(), flattened->getHeight());
+	}
+
+	Layer original(*flattened);
+	adjustment.getAdjustment()->operateLayer(flattened, selections, true);
+	for (Selection *s : selections) delete s;
+
+	//opacity mixes the adjusted result back with what was there
+	int opacity = adjustment.getOpacity();
+	if (opacity == 100) return;
+	ThreadPool::getPool().parallelFor(flattened->getHeight(), [flattened, &original, opacity](int j) {
+		std::vector<Pixel>& row = (*flattened)[j];
+		const std::vector<Pixel>& before = original[j];
+		for (size_t k = 0; k < row.size(); k++) {
+			const Pixel& p = before[k];
+			const Pixel& q = row[k];
+			row[k] = Pixel(p.getR() + (q.getR() - p.getR()) * opacity / 100, p.getG() + (q.getG() - p.getG()) * opacity / 100,
+				p.getB() + (q.getB() - p.getB()) * opacity / 100, p.getA() + (q.getA() - p.getA()) * opacity / 100);
+		}
+	});
 }
 
 void Image::resize(Layer *l)
@@ -71,16 +218,11 @@ void Image::loadImage(const std::string & path) try
 {
 	ProjectFormatter* reader;
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if ((reader = ProjectFormatter::getFormatter(extension))) {
-			reader->load(path);
-		}
-		else throw BadFormatException("Not a project format");
+	if ((reader = ProjectFormatter::getReader(path))) {
+		reader->load(path);
 	}
-	else throw BadPathException("Invalid path");
+	else if (FormatTable<ProjectFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path");
+	else throw BadFormatException("Not a project format");
 }
 catch (BadFormatException e) {
 	deleteImage();
@@ -127,6 +269,29 @@ void Image::setSelectionActive(const std::string& name, bool active)
 	else throw BadInputException("Selection with that name doesn't exist");
 }
 
+void Image::addLayersBottom(const std::vector<Layer*>& newLayers)
+{
+	//grow the canvas once for the whole batch instead of once per layer
+	int newWidth = width, newHeight = height;
+	for (Layer *l : newLayers) {
+		if (!l) continue;
+		newWidth = newWidth < l->getWidth() ? l->getWidth() : newWidth;
+		newHeight = newHeight < l->getHeight() ? l->getHeight() : newHeight;
+	}
+	width = newWidth;
+	height = newHeight;
+
+	std::vector<Layer*> all(layers);
+	for (Layer *l : newLayers)
+		if (l) all.push_back(l);
+
+	ThreadPool::getPool().parallelFor(all.size(), [this, &all](int i) {
+		Layer *l = all[i];
+		l->resize(width > l->getWidth() ? width : -1, height > l->getHeight() ? height : -1);
+	});
+	layers.swap(all);
+}
+
 void Image::addLayer(int width, int height)
 {
 	if (width <= 0 || height <= 0) throw BadInputException("Layer dimensions must be positive");
@@ -138,32 +303,22 @@ void Image::addLayer(int width, int height)
 void Image::addLayer(std::string path) {
 	ImageFormatter* reader;
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if ((reader = ImageFormatter::getFormatter(extension))) {
-			Layer *tempLayer = reader->load(path);
-			resize(tempLayer);
-			layers.insert(layers.begin(), tempLayer);
-		}
-		else throw BadFormatException("Not an image format");
+	if ((reader = ImageFormatter::getReader(path))) {
+		Layer *tempLayer = ImageCache::getCache().load(path, reader);
+		resize(tempLayer);
+		layers.insert(layers.begin(), tempLayer);
 	}
-	else throw BadPathException("Invalid path");
+	else if (FormatTable<ImageFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path");
+	else throw BadFormatException("Not an image format");
 }
 
 Layer * Image::importLayer(const std::string & path)
 {
 	ImageFormatter* reader;
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if ((reader = ImageFormatter::getFormatter(extension))) {
-			Layer *tempLayer = reader->load(path);
-			return tempLayer;
-		}
+	if ((reader = ImageFormatter::getReader(path))) {
+		Layer *tempLayer = ImageCache::getCache().load(path, reader);
+		return tempLayer;
 	}
 	return nullptr;
 }
@@ -185,13 +340,61 @@ void Image::operate()
 	}
 
 	for (Layer *l : layers)
-		if (l->getActive()) {
-			for (Operation *o : operations) {
-				o->operateLayer(l, activeSelections);
-				l->addOperation(o, activeSelections);
-				l->clamp();
-			}
-		}
+		operate(l, activeSelections);
+}
+
+void Image::operate(Layer * l, const std::vector<Selection*>& activeSelections)
+{
+	if (!l->getActive() || l->isAdjustment()) return;
+	//an active group passes the operations on to its active members
+	if (l->isGroup()) {
+		for (Layer *m : l->getMembers())
+			operate(m, activeSelections);
+		return;
+	}
+	for (Operation *o : operations) {
+		l->apply(o, activeSelections);
+	}
+}
+
+void Image::addAdjustmentLayer(const CompositeOperation & o)
+{
+	std::vector<Selection *> activeSelections;
+	for (std::pair<std::string, Selection*> p : selections) {
+		if (p.second->getActive())
+			activeSelections.push_back(p.second);
+	}
+	layers.insert(layers.begin(), new Layer(o, activeSelections));
+}
+
+void Image::addAdjustmentLayer()
+{
+	if (operations.empty()) throw BadInputException("No operations to adjust with");
+	CompositeOperation adjustment("adjustment");
+	for (Operation *o : operations)
+		adjustment.addOperation(o);
+	addAdjustmentLayer(adjustment);
+}
+
+void Image::groupLayers(int first, int last)
+{
+	if (first > last || first < 0 || last >= (int)layers.size())
+		throw BadInputException("Layer index out of bounds");
+	std::vector<Layer*> members(layers.begin() + first, layers.begin() + last + 1);
+	layers.erase(layers.begin() + first, layers.begin() + last + 1);
+	layers.insert(layers.begin() + first, new Layer(members));
+}
+
+void Image::ungroupLayer(int pos)
+{
+	if (layers.size() == 0 || pos < 0 || pos > layers.size() - 1)
+		throw BadInputException("Layer index out of bounds");
+	Layer *group = layers[pos];
+	if (!group->isGroup()) throw BadInputException("Layer is not a group");
+	std::vector<Layer*> members = group->releaseMembers();
+	layers.erase(layers.begin() + pos);
+	layers.insert(layers.begin() + pos, members.begin(), members.end());
+	delete group;
 }
 
 void Image::deleteLayer(int pos)
@@ -259,16 +462,11 @@ void Image::importCompositeOperation(const std::string & path, bool deleteOld)
 	OperationFormatter* reader;
 	CompositeOperation *operation;
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if (reader = OperationFormatter::getFormatter(extension)) {
-			operation = reader->load(path);
-		}
-		else throw BadFormatException("Format doesn't exist");
+	if ((reader = OperationFormatter::getReader(path))) {
+		operation = reader->load(path);
 	}
-	else throw BadPathException("Invalid path to file");
+	else if (FormatTable<OperationFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path to file");
+	else throw BadFormatException("Format doesn't exist");
 
 	if (compositeOperations.find(operation->getName()) != compositeOperations.end()) {
 		if (deleteOld) {
@@ -288,50 +486,75 @@ void Image::exportCompositeOperation(const std::string & name, const std::string
 	if (compositeOperations.find(name) != compositeOperations.end()) {
 		CompositeOperation *savedOperation = compositeOperations[name];
 
-		std::regex rx("[^\.]*\.(.*)");
-		std::smatch extensionMatch;
-		if (std::regex_match(path, extensionMatch, rx)) {
-			std::string extension = extensionMatch.str(1);
-			if (writer = OperationFormatter::getFormatter(extension)) {
-				writer->save(savedOperation,path);
-			}
-			else throw BadFormatException("Format doesn't exist");
+		if ((writer = OperationFormatter::getWriter(path))) {
+			writer->save(savedOperation,path);
 		}
-		else throw BadPathException("Invalid path to file");
+		else if (FormatTable<OperationFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path to file");
+		else throw BadFormatException("Format doesn't exist");
 	}
 	else throw BadInputException("Operation with that name doesn't exist");
 }
 
 void Image::Export(std::string path)
 {
-	ImageFormatter* writer;
+	Export(std::vector<std::string>(1, path));
+}
+
+void Image::Export(const std::vector<std::string>& paths)
+{
+	Export(paths, Rectangle(0, height - 1, width, height));
+}
+
+void Image::Export(std::string path, const Rectangle & crop)
+{
+	Export(std::vector<std::string>(1, path), crop);
+}
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if (writer = ImageFormatter::getFormatter(extension)) {
-			writer->save(path);
+void Image::Export(const std::vector<std::string>& paths, const Rectangle & crop)
+{
+	std::vector<ImageFormatter*> writers;
+	std::vector<std::string> targets;
+	std::set<std::string> canonical;
+
+	for (const std::string& path : paths) {
+		ImageFormatter* writer;
+		if ((writer = ImageFormatter::getWriter(path))) {
+			//two spellings of one file would have two threads writing it at once, it's written once instead
+			if (!canonical.insert(Batch::canonicalPath(path)).second) continue;
+			writers.push_back(writer);
+			targets.push_back(path);
 		}
+		else if (FormatTable<ImageFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path to file");
 		else throw BadFormatException("Format doesn't exist");
 	}
-	else throw BadPathException("Invalid path to file");
+
+	//composite once, every encoder reads the same buffer
+	Layer *flattened = flatten(crop);
+	if (flattened->getHeight() == 0 && width > 0 && height > 0) {
+		delete flattened;
+		throw BadInputException("Crop rectangle is outside the image");
+	}
+	try {
+		ThreadPool::getPool().parallelFor(targets.size(), [&](int i) {
+			writers[i]->write(*flattened, targets[i]);
+		});
+	}
+	catch (...) {
+		delete flattened;
+		throw;
+	}
+	delete flattened;
 }
 
 void Image::saveProject(const std::string & path)
 {
 	ProjectFormatter* writer;
 
-	std::regex rx("[^\.]*\.(.*)");
-	std::smatch extensionMatch;
-	if (std::regex_match(path, extensionMatch, rx)) {
-		std::string extension = extensionMatch.str(1);
-		if (writer = ProjectFormatter::getFormatter(extension)) {
-			writer->save(path);
-		}
-		else throw BadFormatException("Format doesn't exist");
+	if ((writer = ProjectFormatter::getWriter(path))) {
+		writer->save(path);
 	}
-	else throw BadPathException("Invalid path to file");
+	else if (FormatTable<ProjectFormatter>::getExtension(path).empty()) throw BadPathException("Invalid path to file");
+	else throw BadFormatException("Format doesn't exist");
 }
 
 std::ostream & operator<<(std::ostream & o, const Image & i)
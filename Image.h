@@ -18,6 +18,15 @@ private:
 	Image() : width(0), height(0) {}
 
 	void resize(Layer *l);
+	void operate(Layer *l, const std::vector<Selection*>& activeSelections);
+	//layers in [first, last) over the pixel below, if there is one
+	//whether anything visible in [first, last) has pixels, compositing over nothing would only lose precision
+	static bool hasPixels(const std::vector<Layer*>& layers, size_t first, size_t last);
+	static Pixel composite(const std::vector<Layer*>& layers, size_t first, size_t last, int width, int height, const Pixel *below);
+	static void adjust(Layer *flattened, const Layer& adjustment, int left, int bottom);
+	//rows and columns around an area the visible adjustments look at, -1 if there is no bound
+	//in place operations see their own results below and to the left, for those that part runs to the canvas edge
+	static int adjustmentReach(const std::vector<Layer*>& layers, bool& inPlace);
 public:
 	~Image();
 
@@ -34,15 +43,24 @@ public:
 	
 	void addLayer(Layer *l) { if (l) { resize(l); layers.insert(layers.begin(), l); } }
 	void addLayerBottom(Layer *l) { if (l) { resize(l); layers.push_back(l); } }
+	void addLayersBottom(const std::vector<Layer*>& newLayers);
 	void addLayer(int width, int height);
 	void addLayer(std::string path);
+	//adjusts everything below it on the active selections when flattening, the layers stay untouched
+	void addAdjustmentLayer(const CompositeOperation& o);
+	//same, with the added operations
+	void addAdjustmentLayer();
 
 	void setLayerOpacity(int pos, int opacity);
 	void setLayerActive(int pos, bool active);
 	void setLayerVisible(int pos, bool visible);
 	void deleteLayer(int pos);
+	//layers first to last, counted from the top, become one group in their place
+	void groupLayers(int first, int last);
+	void ungroupLayer(int pos);
 
-	Layer* importLayer(const std::string& path);
+	//doesn't touch the image, so workers without one can call it too
+	static Layer* importLayer(const std::string& path);
 
 	void addOperation(Operation* operation) { operations.push_back(operation); }
 	
@@ -61,9 +79,17 @@ public:
 	void exportCompositeOperation(const std::string& name, const std::string& path);
 	
 	void Export(std::string path);
+	void Export(const std::vector<std::string>& paths);
+	void Export(std::string path, const Rectangle& crop);
+	void Export(const std::vector<std::string>& paths, const Rectangle& crop);
 	void saveProject(const std::string& path);
 
+	//expects visible layers to be evaluated, flatten takes care of that
 	Pixel getPixel(int width, int height);
+	Layer* flatten();
+	Layer* flatten(const Rectangle& area);
+	//composites any stack of layers, top first, over an area already inside them
+	static Layer* flattenLayers(const std::vector<Layer*>& layers, const Rectangle& area);
 
 	auto begin() { return layers.begin(); }
 	auto end() { return layers.end(); }
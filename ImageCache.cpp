@@ -0,0 +1,66 @@
+#include "ImageCache.h"
+#include "Formatter.h"
+
+ImageCache & ImageCache::getCache()
+{
+	static ImageCache cache(256 << 20);
+	return cache;
+}
+
+void ImageCache::evict()
+{
+	//least recently used entries are at the back
+	while (used > budget && !entries.empty()) {
+		used -= entries.back().bytes;
+		index.erase(entries.back().path);
+		entries.pop_back();
+	}
+}
+
+void ImageCache::setBudget(size_t budget)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	this->budget = budget;
+	evict();
+}
+
+void ImageCache::clear()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	entries.clear();
+	index.clear();
+	used = 0;
+}
+
+Layer * ImageCache::load(const std::string & path, ImageFormatter * reader)
+{
+	//a file that can't be stat-ed is left to the reader to report
+	FileStamp stamp;
+	if (!FileStamp::get(path, stamp)) return reader->load(path);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = index.find(path);
+		if (it != index.end()) {
+			if (it->second->stamp == stamp) {
+				entries.splice(entries.begin(), entries, it->second);
+				return new Layer(it->second->pixels, path);
+			}
+			used -= it->second->bytes;
+			entries.erase(it->second);
+			index.erase(it);
+		}
+	}
+
+	Layer *l = reader->load(path);
+	size_t bytes = (size_t)l->getHeight() * (l->getWidth() * sizeof(Pixel) + sizeof(std::vector<Pixel>));
+
+	std::lock_guard<std::mutex> guard(lock);
+	if (bytes <= budget && index.find(path) == index.end()) {
+		entries.push_front(Entry{ path, stamp, l->share(), bytes });
+		index[path] = entries.begin();
+		used += bytes;
+		evict();
+	}
+	return l;
+}
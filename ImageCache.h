@@ -0,0 +1,37 @@
+#pragma once
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include "Layer.h"
+#include "FileStamp.h"
+
+class ImageFormatter;
+
+//decoded source images shared by every layer loaded from the same unchanged file
+class ImageCache {
+private:
+	struct Entry {
+		std::string path;
+		FileStamp stamp;
+		std::shared_ptr<Layer::Pixels> pixels;
+		size_t bytes;
+	};
+
+	std::list<Entry> entries;
+	std::map<std::string, std::list<Entry>::iterator> index;
+	size_t budget, used;
+	std::mutex lock;
+
+	ImageCache(size_t budget) : budget(budget), used(0) {}
+
+	void evict();
+public:
+	static ImageCache& getCache();
+
+	size_t getBudget() const { return budget; }
+	void setBudget(size_t budget);
+	void clear();
+
+	Layer* load(const std::string& path, ImageFormatter* reader);
+};
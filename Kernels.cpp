@@ -0,0 +1,201 @@
+#include "Kernels.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(isa)
+#else
+#define TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+static void addScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) v[i] += k; }
+static void inverseSubScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) v[i] = k - v[i]; }
+static void mulScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) v[i] *= k; }
+static void divScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) v[i] /= k; }
+static void minScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) if (v[i] > k) v[i] = k; }
+static void maxScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) if (v[i] < k) v[i] = k; }
+static void fillScalar(int* v, int count, int k) { for (int i = 0; i < count; i++) v[i] = k; }
+static void absScalar(int* v, int count) { for (int i = 0; i < count; i++) if (v[i] < 0) v[i] = -v[i]; }
+static void clampScalar(int* v, int count) { for (int i = 0; i < count; i++) v[i] = v[i] >= 255 ? 255 : (v[i] <= 0 ? 0 : v[i]); }
+
+static void lookupScalar(int* v, int count, const int* table, int offset, int size, int (*fallback)(int, double), double param)
+{
+	for (int i = 0; i < count; i++) {
+		unsigned index = (unsigned)v[i] - (unsigned)offset;
+		v[i] = index < (unsigned)size ? table[index] : fallback(v[i], param);
+	}
+}
+
+static const Kernels scalarKernels = { "scalar", addScalar, inverseSubScalar, mulScalar, divScalar, minScalar, maxScalar, fillScalar, absScalar, clampScalar, lookupScalar };
+
+#ifdef KERNELS_X86
+
+//one function per operation and instruction set, the tail that doesn't fill a vector goes through the scalar loop
+#define BINARY_KERNEL(name, tail, isa, type, width, set1, loadu, storeu, expression) \
+	TARGET(isa) static void name(int* v, int count, int k) \
+	{ \
+		type c = set1(k); \
+		int i = 0; \
+		for (; i + width <= count; i += width) { \
+			type x = loadu((const type*)(v + i)); \
+			storeu((type*)(v + i), expression); \
+		} \
+		tail(v + i, count - i, k); \
+	}
+
+#define KERNEL_SET(suffix, isa, type, width, set1, loadu, storeu, ADD, SUB, MULLO, MIN, MAX, ABS) \
+	BINARY_KERNEL(add##suffix, addScalar, isa, type, width, set1, loadu, storeu, ADD(x, c)) \
+	BINARY_KERNEL(inverseSub##suffix, inverseSubScalar, isa, type, width, set1, loadu, storeu, SUB(c, x)) \
+	BINARY_KERNEL(mul##suffix, mulScalar, isa, type, width, set1, loadu, storeu, MULLO(x, c)) \
+	BINARY_KERNEL(min##suffix, minScalar, isa, type, width, set1, loadu, storeu, MIN(x, c)) \
+	BINARY_KERNEL(max##suffix, maxScalar, isa, type, width, set1, loadu, storeu, MAX(x, c)) \
+	BINARY_KERNEL(fill##suffix, fillScalar, isa, type, width, set1, loadu, storeu, ((void)x, c)) \
+	TARGET(isa) static void abs##suffix(int* v, int count) \
+	{ \
+		int i = 0; \
+		for (; i + width <= count; i += width) \
+			storeu((type*)(v + i), ABS(loadu((const type*)(v + i)))); \
+		absScalar(v + i, count - i); \
+	} \
+	TARGET(isa) static void clamp##suffix(int* v, int count) \
+	{ \
+		type low = set1(0), high = set1(255); \
+		int i = 0; \
+		for (; i + width <= count; i += width) \
+			storeu((type*)(v + i), MIN(MAX(loadu((const type*)(v + i)), low), high)); \
+		clampScalar(v + i, count - i); \
+	}
+
+KERNEL_SET(Sse, "sse4.2", __m128i, 4, _mm_set1_epi32, _mm_loadu_si128, _mm_storeu_si128,
+	_mm_add_epi32, _mm_sub_epi32, _mm_mullo_epi32, _mm_min_epi32, _mm_max_epi32, _mm_abs_epi32)
+KERNEL_SET(Avx2, "avx2", __m256i, 8, _mm256_set1_epi32, _mm256_loadu_si256, _mm256_storeu_si256,
+	_mm256_add_epi32, _mm256_sub_epi32, _mm256_mullo_epi32, _mm256_min_epi32, _mm256_max_epi32, _mm256_abs_epi32)
+
+#define loadu512(p) _mm512_loadu_si512((const void*)(p))
+#define storeu512(p, x) _mm512_storeu_si512((void*)(p), x)
+//the unmasked forms pass an undefined register through the mask, which gcc warns about, zeroing ones with every lane set don't
+#define min512(a, b) _mm512_maskz_min_epi32(0xFFFF, a, b)
+#define max512(a, b) _mm512_maskz_max_epi32(0xFFFF, a, b)
+#define abs512(a) _mm512_maskz_abs_epi32(0xFFFF, a)
+KERNEL_SET(Avx512, "avx512f", __m512i, 16, _mm512_set1_epi32, loadu512, storeu512,
+	_mm512_add_epi32, _mm512_sub_epi32, _mm512_mullo_epi32, min512, max512, abs512)
+
+//32 bit quotients are exact in double precision, truncating the double gives the same result as int division
+//except for the ones int division traps on, those spans go through the scalar loop so they fail the same way
+TARGET("avx2") static void divAvx2(int* v, int count, int k)
+{
+	if (k == 0 || k == -1) {
+		divScalar(v, count, k);
+		return;
+	}
+	__m256d c = _mm256_set1_pd(k);
+	int i = 0;
+	for (; i + 4 <= count; i += 4) {
+		__m256d x = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i*)(v + i)));
+		_mm_storeu_si128((__m128i*)(v + i), _mm256_cvttpd_epi32(_mm256_div_pd(x, c)));
+	}
+	divScalar(v + i, count - i, k);
+}
+
+TARGET("avx512f") static void divAvx512(int* v, int count, int k)
+{
+	if (k == 0 || k == -1) {
+		divScalar(v, count, k);
+		return;
+	}
+	__m512d c = _mm512_set1_pd(k);
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m512d x = _mm512_maskz_cvtepi32_pd(0xFF, _mm256_loadu_si256((const __m256i*)(v + i)));
+		_mm256_storeu_si256((__m256i*)(v + i), _mm512_maskz_cvttpd_epi32(0xFF, _mm512_div_pd(x, c)));
+	}
+	divScalar(v + i, count - i, k);
+}
+
+//vectors with every lane inside the table are gathered, any other vector goes through the scalar loop
+TARGET("avx2") static void lookupAvx2(int* v, int count, const int* table, int offset, int size, int (*fallback)(int, double), double param)
+{
+	__m256i start = _mm256_set1_epi32(offset);
+	__m256i limit = _mm256_set1_epi32(size);
+	__m256i zero = _mm256_setzero_si256();
+	int i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(v + i)), start);
+		__m256i inside = _mm256_andnot_si256(_mm256_cmpgt_epi32(zero, index), _mm256_cmpgt_epi32(limit, index));
+		if (_mm256_movemask_epi8(inside) == -1)
+			_mm256_storeu_si256((__m256i*)(v + i), _mm256_i32gather_epi32(table, index, 4));
+		else lookupScalar(v + i, 8, table, offset, size, fallback, param);
+	}
+	lookupScalar(v + i, count - i, table, offset, size, fallback, param);
+}
+
+TARGET("avx512f") static void lookupAvx512(int* v, int count, const int* table, int offset, int size, int (*fallback)(int, double), double param)
+{
+	__m512i start = _mm512_set1_epi32(offset);
+	__m512i limit = _mm512_set1_epi32(size);
+	int i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m512i index = _mm512_sub_epi32(_mm512_loadu_si512((const void*)(v + i)), start);
+		__mmask16 inside = _mm512_cmplt_epu32_mask(index, limit);
+		if (inside == 0xFFFF)
+			_mm512_storeu_si512((void*)(v + i), _mm512_mask_i32gather_epi32(index, inside, index, table, 4));
+		else lookupScalar(v + i, 16, table, offset, size, fallback, param);
+	}
+	lookupScalar(v + i, count - i, table, offset, size, fallback, param);
+}
+
+static const Kernels sseKernels = { "sse4.2", addSse, inverseSubSse, mulSse, divScalar, minSse, maxSse, fillSse, absSse, clampSse, lookupScalar };
+static const Kernels avx2Kernels = { "avx2", addAvx2, inverseSubAvx2, mulAvx2, divAvx2, minAvx2, maxAvx2, fillAvx2, absAvx2, clampAvx2, lookupAvx2 };
+static const Kernels avx512Kernels = { "avx512f", addAvx512, inverseSubAvx512, mulAvx512, divAvx512, minAvx512, maxAvx512, fillAvx512, absAvx512, clampAvx512, lookupAvx512 };
+
+enum Isa { SSE42 = 1, AVX2 = 2, AVX512 = 4 };
+
+static int detect()
+{
+	int found = 0;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int highest = info[0];
+	__cpuid(info, 1);
+	bool sse42 = (info[2] & 1 << 20) != 0;
+	bool osxsave = (info[2] & 1 << 27) != 0;
+	if (sse42) found |= SSE42;
+	if (!osxsave || highest < 7) return found;
+
+	//the os has to save the wider registers too
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if ((info[1] & 1 << 5) && (xcr0 & 0x6) == 0x6) found |= AVX2;
+	if ((info[1] & 1 << 16) && (xcr0 & 0xE6) == 0xE6) found |= AVX512;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) found |= SSE42;
+	if (__builtin_cpu_supports("avx2")) found |= AVX2;
+	if (__builtin_cpu_supports("avx512f")) found |= AVX512;
+#endif
+	return found;
+}
+
+#endif
+
+std::vector<const Kernels*> Kernels::getSupported()
+{
+	std::vector<const Kernels*> supported(1, &scalarKernels);
+#ifdef KERNELS_X86
+	int found = detect();
+	if (found & SSE42) supported.push_back(&sseKernels);
+	if (found & AVX2) supported.push_back(&avx2Kernels);
+	if (found & AVX512) supported.push_back(&avx512Kernels);
+#endif
+	return supported;
+}
+
+const Kernels & Kernels::get()
+{
+	static const Kernels *best = getSupported().back();
+	return *best;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <vector>
+
+//span kernels for the bytecode interpreter, each works on one channel register in place
+//the widest set the cpu supports is picked on first use
+struct Kernels {
+	const char *name;
+	void (*add)(int* v, int count, int k);
+	void (*inverseSub)(int* v, int count, int k);
+	void (*mul)(int* v, int count, int k);
+	void (*div)(int* v, int count, int k);
+	void (*min)(int* v, int count, int k);
+	void (*max)(int* v, int count, int k);
+	void (*fill)(int* v, int count, int k);
+	void (*abs)(int* v, int count);
+	//saturates to 0..255
+	void (*clamp)(int* v, int count);
+	//v = table[v - offset] when it falls inside the table, fallback(v, param) otherwise
+	void (*lookup)(int* v, int count, const int* table, int offset, int size, int (*fallback)(int, double), double param);
+
+	static const Kernels& get();
+	//every set this cpu can run, scalar first
+	static std::vector<const Kernels*> getSupported();
+};
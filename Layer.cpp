@@ -1,38 +1,253 @@
 #include "Layer.h"
 #include "Operation.h"
+#include "Formatter.h"
+#include "Program.h"
+#include "Image.h"
 #include <iostream>
+#include <algorithm>
 #include <string>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+int Layer::checkpointOperations = 32;
+double Layer::checkpointSeconds = 5;
+bool Layer::lazy = false;
+std::atomic<unsigned long long> Layer::revisions(0);
+
+static bool sameSelections(const std::vector<Selection*>& a, const std::vector<Selection*>& b)
+{
+	if (a.size() != b.size()) return false;
+	for (size_t i = 0; i < a.size(); i++) {
+		const std::vector<Rectangle>& x = a[i]->getRectangles();
+		const std::vector<Rectangle>& y = b[i]->getRectangles();
+		if (x.size() != y.size()) return false;
+		for (size_t j = 0; j < x.size(); j++) {
+			if (x[j].getX() != y[j].getX() || x[j].getY() != y[j].getY() ||
+				x[j].getWidth() != y[j].getWidth() || x[j].getHeight() != y[j].getHeight()) return false;
+		}
+	}
+	return true;
+}
+
+Layer::Layer(const CompositeOperation & adjustment, const std::vector<Selection*>& selections) :
+	pixels(std::make_shared<Pixels>()), shared(false), opacity(100), active(true), visible(true),
+	operationsSinceCheckpoint(0), secondsSinceCheckpoint(0), adjustment(adjustment.clone()), pendingOperations(0), group(false), revision(++revisions)
+{
+	for (Selection *s : selections) adjustmentSelections.push_back(new Selection(*s));
+}
+
+Layer::Layer(const Layer & l) :
+	pixels(l.share()), shared(true), opacity(l.opacity), active(l.active), visible(l.visible), path(l.path),
+	operationsSinceCheckpoint(0), secondsSinceCheckpoint(0), adjustment(l.adjustment ? l.adjustment->clone() : nullptr), pendingOperations(0), group(false), revision(++revisions)
+{
+	for (Selection *s : l.adjustmentSelections) adjustmentSelections.push_back(new Selection(*s));
+}
+
+Layer::Layer(const std::vector<Layer*>& members) :
+	pixels(std::make_shared<Pixels>()), shared(false), opacity(100), active(true), visible(true),
+	operationsSinceCheckpoint(0), secondsSinceCheckpoint(0), adjustment(nullptr), pendingOperations(0), group(true), members(members), revision(++revisions)
+{
+	int width = 0, height = 0;
+	for (Layer *m : members) {
+		width = width < m->getWidth() ? m->getWidth() : width;
+		height = height < m->getHeight() ? m->getHeight() : height;
+	}
+	for (Layer *m : members) m->resize(width, height);
+	pixels->resize(height, std::vector<Pixel>(width, Pixel()));
+}
+
+std::vector<Layer*> Layer::releaseMembers()
+{
+	std::vector<Layer*> released;
+	released.swap(members);
+	cachedMembers.clear();
+	touch();
+	return released;
+}
+
+Layer::~Layer()
+{
+	for (DoneOperation* o : doneOperations) delete o;
+	delete adjustment;
+	for (Selection *s : adjustmentSelections) delete s;
+	for (Layer *m : members) delete m;
+}
+
+void Layer::detach()
+{
+	std::lock_guard<std::mutex> guard(detachLock);
+	if (!shared) return;
+	if (pixels.use_count() > 1)
+		pixels = std::make_shared<Pixels>(*pixels);
+	shared = false;
+}
 
 void Layer::resize(int width, int height)
 {
+	//the canvas size means nothing to an adjustment
+	if (adjustment || (width <= 0 && height <= 0)) return;
+	if (group) {
+		for (Layer *m : members) m->resize(width, height);
+		cachedMembers.clear();
+	}
+	//queued operations without selections must not reach the padding
+	else evaluate();
+	touch();
+	if (shared) detach();
 	if (width > 0) {
-		for (std::vector<Pixel>& rows : pixels) {
+		for (std::vector<Pixel>& rows : *pixels) {
 			rows.resize(width, Pixel());
 		}
 	}
 	if (height > 0) {
-		pixels.resize(height, std::vector<Pixel>(getWidth(), Pixel()));
+		pixels->resize(height, std::vector<Pixel>(getWidth(), Pixel()));
 	}
 }
 
-void Layer::addOperation(Operation * o, const std::vector<Selection*>& selections)
+Layer::Checkpoint Layer::storeCheckpoint(std::vector<unsigned char> data)
 {
-	doneOperations.push_back(new DoneOperation(o, selections, getWidth(), getHeight()));
+	static std::mutex lock;
+	static std::unordered_map<unsigned long long, std::vector<std::weak_ptr<const std::vector<unsigned char>>>> stored;
+
+	unsigned long long hash = 14695981039346656037ULL;
+	for (unsigned char c : data) hash = (hash ^ c) * 1099511628211ULL;
+
+	std::lock_guard<std::mutex> guard(lock);
+	std::vector<std::weak_ptr<const std::vector<unsigned char>>>& bucket = stored[hash];
+	for (auto it = bucket.begin(); it != bucket.end();) {
+		Checkpoint existing = it->lock();
+		if (!existing) {
+			it = bucket.erase(it);
+			continue;
+		}
+		if (*existing == data) return existing;
+		++it;
+	}
+
+	Checkpoint checkpoint = std::make_shared<const std::vector<unsigned char>>(std::move(data));
+	bucket.push_back(checkpoint);
+	return checkpoint;
 }
 
-void Layer::clamp()
+void Layer::apply(Operation * o, const std::vector<Selection*>& selections)
 {
-	int height = getHeight();
-	int width = getWidth();
-	for (int i = 0; i < height; i++) {
-		for (int j = 0; j < width; j++) {
-			(*this)[i][j].clamp();
+	if (lazy) {
+		addOperation(o, selections);
+		pendingOperations++;
+		return;
+	}
+	evaluate();
+
+	auto start = std::chrono::steady_clock::now();
+	o->operateLayer(this, selections, true);
+	touch();
+	secondsSinceCheckpoint += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	addOperation(o, selections);
+
+	if ((checkpointOperations > 0 && operationsSinceCheckpoint >= checkpointOperations) ||
+		(checkpointSeconds > 0 && secondsSinceCheckpoint >= checkpointSeconds))
+		checkpoint();
+}
+
+void Layer::addOperation(Operation * o, const std::vector<Selection*>& selections, const Checkpoint& checkpoint)
+{
+	doneOperations.push_back(new DoneOperation(o, selections, getWidth(), getHeight(), checkpoint));
+	if (checkpoint) {
+		operationsSinceCheckpoint = 0;
+		secondsSinceCheckpoint = 0;
+	}
+	else operationsSinceCheckpoint++;
+}
+
+void Layer::evaluate()
+{
+	if (group) {
+		std::vector<std::pair<const Layer*, unsigned long long>> current;
+		for (Layer *m : members) {
+			if (m->getVisible()) m->evaluate();
+			current.push_back(std::make_pair(m, m->getRevision()));
+		}
+		if (current == cachedMembers) return;
+
+		Layer *composite = Image::flattenLayers(members, Rectangle(0, getHeight() - 1, getWidth(), getHeight()));
+		pixels = composite->share();
+		shared = true;
+		delete composite;
+		cachedMembers.swap(current);
+		touch();
+		return;
+	}
+	if (pendingOperations == 0) return;
+	auto start = std::chrono::steady_clock::now();
+	std::vector<DoneOperation*> pending(doneOperations.end() - pendingOperations, doneOperations.end());
+	pendingOperations = 0;
+
+	//a fill overwrites whatever came before it on the same pixels, as long as nothing in between reads its neighbours
+	std::vector<bool> skip(pending.size(), false);
+	std::vector<const DoneOperation*> fills;
+	bool everything = false;
+	for (size_t i = pending.size(); i-- > 0;) {
+		const DoneOperation *d = pending[i];
+		if (everything || std::any_of(fills.begin(), fills.end(), [d](const DoneOperation *f) { return sameSelections(f->getSelections(), d->getSelections()); })) {
+			skip[i] = true;
+			continue;
 		}
+		Program probe;
+		if (dynamic_cast<const Fill*>(d->getOperation())) {
+			fills.push_back(d);
+			everything = d->getSelections().empty();
+		}
+		else if (!d->getOperation()->lower(probe)) fills.clear();
+	}
+
+	//operations on the same selections share one pass, clamped in between just like applying them one by one
+	for (size_t i = 0; i < pending.size();) {
+		if (skip[i]) {
+			i++;
+			continue;
+		}
+		const std::vector<Selection*>& selections = pending[i]->getSelections();
+		std::vector<const Operation*> group;
+		for (; i < pending.size() && (skip[i] || sameSelections(pending[i]->getSelections(), selections)); i++) {
+			if (!skip[i]) group.push_back(pending[i]->getOperation());
+		}
+
+		Program program;
+		for (size_t j = 0; j < group.size(); j++)
+			program.append(group[j], j + 1 < group.size());
+		program.run(this, selections, true);
 	}
+	touch();
+	secondsSinceCheckpoint += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if ((checkpointOperations > 0 && operationsSinceCheckpoint >= checkpointOperations) ||
+		(checkpointSeconds > 0 && secondsSinceCheckpoint >= checkpointSeconds))
+		checkpoint();
+}
+
+void Layer::checkpoint()
+{
+	evaluate();
+	//without any operations the source image is the checkpoint
+	if (doneOperations.empty() || getWidth() == 0 || getHeight() == 0) return;
+
+	doneOperations.back()->checkpoint = storeCheckpoint(PNGFormatter::encode(*this, Deflate::FAST));
+	operationsSinceCheckpoint = 0;
+	secondsSinceCheckpoint = 0;
 }
 
 std::ostream & operator<<(std::ostream & os, const Layer & l)
 {
+	if (l.group) {
+		os << "Group - " << (l.getActive() ? "Active - " : "Inactive - ") << (l.getVisible() ? "Visible - " : "Invisible - ") << "Opacity " << l.opacity << " [";
+		for (size_t i = 0; i < l.members.size(); i++)
+			os << (i ? "; " : "") << *l.members[i];
+		return os << "]";
+	}
+	if (l.adjustment)
+		return os << "Adjustment " << l.adjustment->getName() << " - " << (l.getVisible() ? "Visible - " : "Invisible - ") << "Opacity " << l.opacity;
 	os << (l.getActive() ? "Active - " : "Inactive - ") << (l.getVisible() ? "Visible - " : "Invisible - ") << "Opacity " << l.opacity << " (";
 	for (Layer::DoneOperation* o : l.doneOperations) {
 		os << o->getOperation()->getName() << ", ";
@@ -40,10 +255,17 @@ std::ostream & operator<<(std::ostream & os, const Layer & l)
 	return os << ")";
 }
 
-Layer::DoneOperation::DoneOperation(Operation * operation, const std::vector<Selection*>& selections, int clampWidth, int clampHeight) : operation(operation->clone()) {
+Layer::DoneOperation::DoneOperation(Operation * operation, const std::vector<Selection*>& selections, int clampWidth, int clampHeight, const Checkpoint& checkpoint) :
+	operation(operation->clone()), checkpoint(checkpoint) {
 	for (Selection* s : selections) {
 		Selection *newSelection = new Selection(*s);
 		newSelection->clamp(clampWidth, clampHeight);
 		this->selections.push_back(newSelection);
 	}
 }
+
+Layer::DoneOperation::~DoneOperation()
+{
+	delete operation;
+	for (Selection* s : selections) delete s;
+}
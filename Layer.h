@@ -1,54 +1,124 @@
 #pragma once
 #include <vector>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <mutex>
 #include "Pixel.h"
 #include "Selection.h"
 
 class Operation;
+class CompositeOperation;
 
 class Layer {
 public:
+	typedef std::vector<std::vector<Pixel>> Pixels;
+	//png encoded pixels, shared between every layer that reached the same state
+	typedef std::shared_ptr<const std::vector<unsigned char>> Checkpoint;
+
 	class DoneOperation {
 	private:
 		Operation *operation;
 		std::vector<Selection*> selections;
+		Checkpoint checkpoint;
 	public:
-		DoneOperation(Operation *operation, const std::vector<Selection*>& selections, int clampWidth, int clampHeight);
-		~DoneOperation() { delete operation; for (Selection* s : selections) delete s; }
+		DoneOperation(Operation *operation, const std::vector<Selection*>& selections, int clampWidth, int clampHeight, const Checkpoint& checkpoint = nullptr);
+		~DoneOperation();
 
 		Operation* getOperation() const { return operation; }
 		const std::vector<Selection*>&  getSelections() const { return selections; }
+		//pixels of the layer right after this operation, if one was taken
+		const Checkpoint& getCheckpoint() const { return checkpoint; }
+
+		friend class Layer;
 	};
 
 private:
-	std::vector<std::vector<Pixel>> pixels;
+	static int checkpointOperations;
+	static double checkpointSeconds;
+	static bool lazy;
+	static std::atomic<unsigned long long> revisions;
+
+	//copy on write, other layers or the image cache may hold the same pixels
+	std::shared_ptr<Pixels> pixels;
+	mutable std::atomic<bool> shared;
+	std::mutex detachLock;
 	std::vector<DoneOperation *> doneOperations;
 	int opacity;
 	bool active, visible;
 	std::string path;
+	int operationsSinceCheckpoint;
+	double secondsSinceCheckpoint;
+	//adjustment layers have no pixels, flattening runs this over everything below them
+	CompositeOperation *adjustment;
+	std::vector<Selection*> adjustmentSelections;
+	//the last this many done operations are in the history but not yet in the pixels
+	size_t pendingOperations;
+	//groups composite their members into the pixels, rebuilt only once a member's revision moves
+	bool group;
+	std::vector<Layer*> members;
+	std::vector<std::pair<const Layer*, unsigned long long>> cachedMembers;
+	//changes whenever something that shows in a composite changes, never repeats across layers
+	unsigned long long revision;
+
+	void touch() { revision = ++revisions; }
 public:
 	Layer(int width, int height, const std::string& path = "") :
-		pixels(height, std::vector <Pixel>(width, Pixel())), opacity(100), active(true), visible(true), path(path) {}
-	~Layer() { for (DoneOperation* o : doneOperations) delete o; }
+		pixels(std::make_shared<Pixels>(height, std::vector <Pixel>(width, Pixel()))), shared(false), opacity(100), active(true), visible(true), path(path),
+		operationsSinceCheckpoint(0), secondsSinceCheckpoint(0), adjustment(nullptr), pendingOperations(0), group(false), revision(++revisions) {}
+	Layer(const std::shared_ptr<Pixels>& pixels, const std::string& path = "") :
+		pixels(pixels), shared(true), opacity(100), active(true), visible(true), path(path),
+		operationsSinceCheckpoint(0), secondsSinceCheckpoint(0), adjustment(nullptr), pendingOperations(0), group(false), revision(++revisions) {}
+	Layer(const CompositeOperation& adjustment, const std::vector<Selection*>& selections);
+	//takes over the members, top first like the image's layers
+	Layer(const std::vector<Layer*>& members);
+	//shares the pixels, the history and anything still pending stay with the original
+	Layer(const Layer& l);
+	Layer& operator=(const Layer&) = delete;
+	~Layer();
 	
 	void resize(int width = -1, int height = -1);
 
 	bool getActive() const { return active; }
 	bool getVisible() const { return visible; }
 	int getOpacity() const { return opacity; }
-	int getHeight() const { return pixels.size(); }
-	int getWidth() const { return pixels[0].size(); }
+	int getHeight() const { return pixels->size(); }
+	int getWidth() const { return pixels->empty() ? 0 : (*pixels)[0].size(); }
 	const std::string& getPath() const { return path; }
 	const std::vector<DoneOperation*>& getDoneOperations() const { return doneOperations; }
+	bool isAdjustment() const { return adjustment != nullptr; }
+	const CompositeOperation* getAdjustment() const { return adjustment; }
+	const std::vector<Selection*>& getAdjustmentSelections() const { return adjustmentSelections; }
+	bool isGroup() const { return group; }
+	const std::vector<Layer*>& getMembers() const { return members; }
+	//hands the members back, leaving an empty group
+	std::vector<Layer*> releaseMembers();
+	unsigned long long getRevision() const { return revision; }
 
 
 	void setActive(bool active) { this->active = active; }
-	void setVisible(bool visible) { this->visible = visible; }
-	void setOpacity(int opacity) { this->opacity = opacity >= 100 ? 100 : (opacity <= 0 ? 0 : opacity); }
+	void setVisible(bool visible) { this->visible = visible; touch(); }
+	void setOpacity(int opacity) { this->opacity = opacity >= 100 ? 100 : (opacity <= 0 ? 0 : opacity); touch(); }
+
+
+	//checkpoint after every operations applied or seconds spent, 0 turns that trigger off
+	static void setCheckpointPolicy(int operations, double seconds) { checkpointOperations = operations; checkpointSeconds = seconds; }
+	static Checkpoint storeCheckpoint(std::vector<unsigned char> data);
+	//lazy layers only queue applied operations, pixels catch up once something reads them
+	static void setLazy(bool lazy) { Layer::lazy = lazy; }
+	static bool getLazy() { return lazy; }
 
+	void apply(Operation *o, const std::vector<Selection *>& selections);
+	void addOperation(Operation *o, const std::vector<Selection *>& selections, const Checkpoint& checkpoint = nullptr);
+	void checkpoint();
+	size_t getPendingOperations() const { return pendingOperations; }
+	//runs whatever is still queued and brings a group's composite up to date, anything about to read the pixels calls this first
+	void evaluate();
 
-	void addOperation(Operation *o, const std::vector<Selection *>& selections);
-	void clamp();
+	std::shared_ptr<Pixels> share() const { shared = true; return pixels; }
+	void detach();
 
-	std::vector<Pixel>& operator[](int i) { return pixels[i]; }
+	std::vector<Pixel>& operator[](int i) { if (shared) detach(); return (*pixels)[i]; }
+	const std::vector<Pixel>& operator[](int i) const { return (*pixels)[i]; }
 	friend std::ostream& operator<<(std::ostream& os, const Layer& l);
 };
\ No newline at end of file
@@ -2,20 +2,62 @@
 #include <string>
 #include "Menu.h"
 #include "Formatter.h"
+#include "StripPipeline.h"
+#include "Batch.h"
+#include "Daemon.h"
+#include "ReplayCache.h"
 #include "Exceptions.h"
 
+static void collectLeaves(Layer* l, std::vector<Layer*>& leaves)
+{
+	if (l->isGroup()) {
+		for (Layer* m : l->getMembers()) collectLeaves(m, leaves);
+	}
+	else if (!l->isAdjustment()) leaves.push_back(l);
+}
 
 int main(int argc, const char* argv[]) {
 	Menu::initialize();
-	if (argc == 3) {
+	if (argc > 1 && std::string(argv[1]) == "--batch")
+		return Batch::run(std::vector<std::string>(argv + 2, argv + argc));
+	if (argc > 1 && std::string(argv[1]) == "--daemon")
+		return Daemon::run(std::vector<std::string>(argv + 2, argv + argc));
+	std::vector<std::string> args(argv + 1, argv + argc);
+	//options go before the image and the recipe, the menu always runs eagerly
+	while (args.size() > 2) {
+		if (args[0] == "--lazy") {
+			//nothing reads the pixels until the export, so operations can wait until then
+			Layer::setLazy(true);
+			args.erase(args.begin());
+		}
+		else if (args.size() > 3 && args[0] == "--replay-cache") {
+			try {
+				ReplayCache::getCache().setDirectory(args[1]);
+			}
+			catch (BadPathException e) {
+				std::cout << e.getMessage();
+				exit(1);
+			}
+			args.erase(args.begin(), args.begin() + 2);
+		}
+		else break;
+	}
+	if (args.size() == 2) {
 		try {
-			Image *i = Image::getImage();
-			i->addLayer(argv[1]);
 			FUNFormatter formatter;
-			CompositeOperation *o = formatter.load(argv[2]);
+			CompositeOperation *o = formatter.loadRunnable(args[1]);
+			//results already in the replay cache are only read back
+			if (!ReplayCache::getCache().getDirectory().empty()) {
+				Batch::process(args[0], args[0], *o);
+				exit(0);
+			}
+			//a plain image never has to be held whole, it goes through a strip at a time
+			if (StripPipeline::run(args[0], args[0], *o)) exit(0);
+			Image *i = Image::getImage();
+			i->addLayer(args[0]);
 			i->addOperation(o);
 			i->operate();
-			i->Export(argv[1]);
+			i->Export(args[0]);
 			exit(0);
 		}
 		catch (BadFormatException e) {
@@ -33,15 +75,20 @@ int main(int argc, const char* argv[]) {
 
 		try {
 			Image *i = Image::getImage();
-			i->loadImage(argv[1]);
+			i->loadImage(args[0]);
 			FUNFormatter formatter;
-			CompositeOperation *o = formatter.load(argv[2]);
+			CompositeOperation *o = formatter.loadRunnable(args[1]);
 			i->addOperation(o);
 			i->operate();
+			//adjustments and groups stay on, they apply to whichever layer is exported
+			std::vector<Layer*> leaves;
 			for (Layer* l : *i) {
+				collectLeaves(l, leaves);
+			}
+			for (Layer* l : leaves) {
 				l->setVisible(false);
 			}
-			for (Layer* l : *i) {
+			for (Layer* l : leaves) {
 				l->setVisible(true);
 				i->Export(l->getPath());
 				l->setVisible(false);
@@ -0,0 +1,74 @@
+#include "MappedFile.h"
+#include "Exceptions.h"
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string & path) : data(nullptr), size(0), file(INVALID_HANDLE_VALUE), mapping(nullptr)
+{
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw BadPathException("File does not exist");
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize)) {
+		CloseHandle(file);
+		throw BadPathException("File can't be read");
+	}
+	size = (size_t)fileSize.QuadPart;
+	//empty files can't be mapped
+	if (size == 0) return;
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping) data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!data) {
+		if (mapping) CloseHandle(mapping);
+		CloseHandle(file);
+		throw BadPathException("File can't be read");
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) UnmapViewOfFile(data);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string & path) : data(nullptr), size(0), file(-1)
+{
+	file = open(path.c_str(), O_RDONLY);
+	if (file < 0) throw BadPathException("File does not exist");
+
+	struct stat info;
+	if (fstat(file, &info) != 0) {
+		close(file);
+		throw BadPathException("File can't be read");
+	}
+	size = (size_t)info.st_size;
+	//empty files can't be mapped
+	if (size == 0) return;
+
+	void *view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (view == MAP_FAILED) {
+		close(file);
+		throw BadPathException("File can't be read");
+	}
+	data = (const unsigned char*)view;
+}
+
+MappedFile::~MappedFile()
+{
+	if (data) munmap((void*)data, size);
+	if (file >= 0) close(file);
+}
+
+#endif
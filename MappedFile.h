@@ -0,0 +1,23 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+//read only view of a whole file, pages are loaded by the os on first access
+class MappedFile {
+private:
+	const unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	void *file, *mapping;
+#else
+	int file;
+#endif
+public:
+	MappedFile(const std::string& path);
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	~MappedFile();
+
+	const unsigned char* getData() const { return data; }
+	size_t getSize() const { return size; }
+};
@@ -9,10 +9,30 @@ bool Menu::initialized = false;
 void Menu::initialize()
 {
 	if (!initialized) {
-		ImageFormatter::addFormat("bmp", new BMPFormatter());
-		ImageFormatter::addFormat("pam", new PAMFormatter());
-		ProjectFormatter::addFormat("dr", new DRFormatter());
-		OperationFormatter::addFormat("fun", new FUNFormatter());
+		BMPFormatter *bmp = new BMPFormatter();
+		PAMFormatter *pam = new PAMFormatter();
+		PNGFormatter *png = new PNGFormatter();
+		PNMFormatter *ppm = new PNMFormatter(PNMFormatter::PPM);
+		PNMFormatter *pgm = new PNMFormatter(PNMFormatter::PGM);
+		DRFormatter *dr = new DRFormatter();
+		DRBFormatter *drb = new DRBFormatter();
+		FUNFormatter *fun = new FUNFormatter();
+		ImageFormatter::addFormat("bmp", bmp);
+		ImageFormatter::addFormat("pam", pam);
+		ImageFormatter::addFormat("png", png);
+		ImageFormatter::addFormat("ppm", ppm);
+		ImageFormatter::addFormat("pgm", pgm);
+		ImageFormatter::addSignature("BM", bmp);
+		ImageFormatter::addSignature("P7", pam);
+		ImageFormatter::addSignature("\x89PNG\r\n\x1a\n", png);
+		ImageFormatter::addSignature("P6", ppm);
+		ImageFormatter::addSignature("P5", pgm);
+		ProjectFormatter::addFormat("dr", dr);
+		ProjectFormatter::addFormat("drb", drb);
+		ProjectFormatter::addSignature("<image", dr);
+		ProjectFormatter::addSignature("\x89" "DRB\r\n\x1a\n", drb);
+		OperationFormatter::addFormat("fun", fun);
+		OperationFormatter::addSignature("<compositeOperation", fun);
 		Operation::addOperation(Add().getName(), new Add());
 		Operation::addOperation(Sub().getName(), new Sub());
 		Operation::addOperation(InverseSub().getName(), new InverseSub());
@@ -79,6 +99,9 @@ void Menu::refreshMenu()
 		std::cout << "16. Save project" << std::endl;
 		std::cout << "17. Export image" << std::endl;
 		std::cout << "18. Exit" << std::endl;
+		std::cout << "19. Add operations as adjustment layer" << std::endl;
+		std::cout << "20. Group layers" << std::endl;
+		std::cout << "21. Ungroup layers" << std::endl;
 	}
 }
 
@@ -116,6 +139,40 @@ void Menu::deleteLayer()
 	message = "Layer deleted";
 }
 
+void Menu::groupLayers()
+{
+	std::string firstStr, lastStr;
+	int first, last;
+
+	std::cout << "Enter number of the first layer: ";
+	std::cin >> firstStr;
+	first = std::stoi(firstStr);
+
+	std::cout << "Enter number of the last layer: ";
+	std::cin >> lastStr;
+	last = std::stoi(lastStr);
+
+	image->groupLayers(first - 1, last - 1);
+
+	unsaved = true;
+	message = "Layers grouped";
+}
+
+void Menu::ungroupLayer()
+{
+	std::string layerNumStr;
+	int layerNum;
+
+	std::cout << "Enter layer number: ";
+	std::cin >> layerNumStr;
+	layerNum = std::stoi(layerNumStr);
+
+	image->ungroupLayer(layerNum - 1);
+
+	unsaved = true;
+	message = "Layers ungrouped";
+}
+
 void Menu::setLayerOpacity()
 {
 	std::string layerNumStr, opacityStr;
@@ -393,6 +450,15 @@ void Menu::inputChoice() {
 			case 18:
 				quit();
 				break;
+			case 19:
+				addAdjustmentLayer();
+				break;
+			case 20:
+				groupLayers();
+				break;
+			case 21:
+				ungroupLayer();
+				break;
 			case 98:
 				(new FUNFormatter())->load("C:\\Users\\adinc\\source\\repos\\POOP_Projekat\\petar.fun");
 				break;
@@ -441,6 +507,15 @@ void Menu::operate()
 	message = "Operations applied";
 }
 
+void Menu::addAdjustmentLayer()
+{
+	image->addAdjustmentLayer();
+	image->clearOperations();
+
+	unsaved = true;
+	message = "Adjustment layer added";
+}
+
 void Menu::saveCompositeOperation()
 {
 	std::string name;
@@ -495,6 +570,15 @@ void Menu::saveProject()
 	std::string path;
 	std::cout << "Enter path to file: ";
 	std::cin >> path;
+	//snapshots are opt in, a plain .dr only holds the history
+	DRFormatter *dr = dynamic_cast<DRFormatter*>(ProjectFormatter::getWriter(path));
+	if (dr) {
+		std::string choiceStr;
+		std::cout << "Enter 0 to replay the history on load, 1 to embed layer snapshots or 2 to write them next to the project: ";
+		std::cin >> choiceStr;
+		int choice = std::stoi(choiceStr);
+		dr->setSnapshot(choice == 1 ? DRFormatter::EMBED : (choice == 2 ? DRFormatter::REFERENCE : DRFormatter::NONE));
+	}
 	image->saveProject(path);
 
 	unsaved = false;
@@ -16,6 +16,8 @@ private:
 	void refreshMenu();
 	void addLayer();
 	void deleteLayer();
+	void groupLayers();
+	void ungroupLayer();
 	void setLayerOpacity();
 	void setLayerActive();
 	void setLayerVisible();
@@ -28,6 +30,7 @@ private:
 	void inputChoice();
 	void clearOperations();
 	void operate();
+	void addAdjustmentLayer();
 	void saveCompositeOperation();
 	void importCompositeOperation();
 	void exportCompositeOperation();
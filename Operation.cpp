@@ -1,14 +1,25 @@
 #include <vector>
 #include <iostream>
 #include <cmath>
+#include <climits>
+#include <algorithm>
 #include "Image.h"
 #include "Operation.h"
+#include "Program.h"
+#include "Spans.h"
 #include "Exceptions.h"
 
 std::map<std::string, Operation*> Operation::basicOperationMap;
 
-void BasicOperation::operateLayer(Layer * l, const std::vector<Selection *>& s) const
+void BasicOperation::operateLayer(Layer * l, const std::vector<Selection *>& s, bool clamp) const
 {
+	//anything that works per pixel runs as a one instruction program over row spans
+	Program program;
+	if (lower(program)) {
+		program.run(l, s, clamp);
+		return;
+	}
+
 	int width = l->getWidth();
 	int height = l->getHeight();
 	Layer *argumentLayer = aware() ? new Layer(*l) : l;
@@ -19,6 +30,18 @@ void BasicOperation::operateLayer(Layer * l, const std::vector<Selection *>& s)
 				(*l)[i][j] = operatePixel(argumentLayer, j, i);
 			}
 	if (aware()) delete argumentLayer;
+
+	//operatePixel may read what this pass already wrote, so clamping waits until it's done
+	if (!clamp) return;
+	RectangleSpans spans(s);
+	for (int i = 0; i < height; i++) {
+		std::vector<Pixel>& pixels = (*l)[i];
+		auto clampSpan = [&pixels](int begin, int end) {
+			for (int j = begin; j < end; j++) pixels[j].clamp();
+		};
+		if (s.empty()) AllPixels().forEach(i, width, clampSpan);
+		else spans.forEach(i, width, clampSpan);
+	}
 }
 
 void CompositeOperation::clear()
@@ -27,6 +50,18 @@ void CompositeOperation::clear()
 		delete o;
 	}
 	operations.clear();
+	clearPlan();
+}
+
+void CompositeOperation::clearPlan()
+{
+	std::lock_guard<std::mutex> guard(planLock);
+	for (Operation *o : plan) {
+		delete o;
+	}
+	plan.clear();
+	delete program;
+	program = nullptr;
 }
 
 void CompositeOperation::copy(const CompositeOperation & o)
@@ -44,14 +79,14 @@ void CompositeOperation::move(CompositeOperation & o)
 	o.operations.clear();
 }
 
-void CompositeOperation::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+void CompositeOperation::writeParamsXML(XMLWriter& writer) const
 {
-	rapidxml::xml_node<> *operationsNode = doc.allocate_node(rapidxml::node_element, "operations");
+	writer.openElement("operations");
 
 	for (Operation* o : operations)
-		o->appendOperationXML(doc, *operationsNode);
+		o->writeOperationXML(writer);
 
-	currentNode.append_node(operationsNode);
+	writer.closeElement();
 }
 
 void CompositeOperation::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -63,6 +98,147 @@ void CompositeOperation::convertXMLtoParams(rapidxml::xml_node<>* node)
 
 		operations.push_back(o);
 	}
+	clearPlan();
+}
+
+void CompositeOperation::addOperation(Operation * o)
+{
+	operations.push_back(o->clone());
+	clearPlan();
+}
+
+static void flattenOperations(const std::vector<Operation*>& operations, std::vector<Operation*>& out)
+{
+	for (Operation *o : operations) {
+		CompositeOperation *composite = dynamic_cast<CompositeOperation*>(o);
+		if (composite) flattenOperations(composite->getOperations(), out);
+		else out.push_back(o);
+	}
+}
+
+//add, sub, inverse sub and invert are all x -> sign * x + offset on every channel
+static bool toAffine(const Operation* o, int& sign, int offset[3])
+{
+	if (dynamic_cast<const Invert*>(o)) {
+		sign = -1;
+		offset[0] = offset[1] = offset[2] = 255;
+		return true;
+	}
+
+	int negate;
+	if (dynamic_cast<const Add*>(o)) sign = 1, negate = 1;
+	else if (dynamic_cast<const Sub*>(o)) sign = 1, negate = -1;
+	else if (dynamic_cast<const InverseSub*>(o)) sign = -1, negate = 1;
+	else return false;
+
+	std::vector<double> params = o->getParams();
+	for (int c = 0; c < 3; c++) offset[c] = negate * (int)params[c];
+	return true;
+}
+
+static Operation* fromAffine(int sign, const int offset[3])
+{
+	if (sign > 0) return new Add(offset[0], offset[1], offset[2]);
+	if (offset[0] == 255 && offset[1] == 255 && offset[2] == 255) return new Invert();
+	return new InverseSub(offset[0], offset[1], offset[2]);
+}
+
+static bool multiply(int a, int b, int& result)
+{
+	long long product = (long long)a * b;
+	if (product > INT_MAX || product < INT_MIN) return false;
+	result = (int)product;
+	return true;
+}
+
+//single operation doing first and then second, null if they don't combine exactly
+static Operation* merge(const Operation* first, const Operation* second)
+{
+	std::vector<double> a = first->getParams(), b = second->getParams();
+	int signA, signB, offsetA[3], offsetB[3], result[3];
+
+	if (toAffine(second, signB, offsetB)) {
+		if (toAffine(first, signA, offsetA)) {
+			for (int c = 0; c < 3; c++) result[c] = signB * offsetA[c] + offsetB[c];
+			return fromAffine(signA * signB, result);
+		}
+		//a fill followed by pointwise arithmetic is still a fill
+		if (dynamic_cast<const Fill*>(first)) {
+			for (int c = 0; c < 3; c++) result[c] = signB * (int)a[c] + offsetB[c];
+			return new Fill(result[0], result[1], result[2], (int)a[3]);
+		}
+		return nullptr;
+	}
+
+	if (dynamic_cast<const Mul*>(first) && dynamic_cast<const Mul*>(second)) {
+		for (int c = 0; c < 3; c++)
+			if (!multiply((int)a[c], (int)b[c], result[c])) return nullptr;
+		return new Mul(result[0], result[1], result[2]);
+	}
+	//(x / a) / b == x / (a * b) with truncating division
+	if (dynamic_cast<const Div*>(first) && dynamic_cast<const Div*>(second)) {
+		for (int c = 0; c < 3; c++)
+			if (a[c] == 0 || b[c] == 0 || !multiply((int)a[c], (int)b[c], result[c])) return nullptr;
+		return new Div(result[0], result[1], result[2]);
+	}
+	if (dynamic_cast<const Min*>(first) && dynamic_cast<const Min*>(second))
+		return new Min(std::min((int)a[0], (int)b[0]), std::min((int)a[1], (int)b[1]), std::min((int)a[2], (int)b[2]));
+	if (dynamic_cast<const Max*>(first) && dynamic_cast<const Max*>(second))
+		return new Max(std::max((int)a[0], (int)b[0]), std::max((int)a[1], (int)b[1]), std::max((int)a[2], (int)b[2]));
+	return nullptr;
+}
+
+static bool isIdentity(const Operation* o)
+{
+	std::vector<double> params = o->getParams();
+	auto all = [&params](double value) {
+		return std::all_of(params.begin(), params.end(), [value](double p) { return p == value; });
+	};
+	if (dynamic_cast<const Add*>(o) || dynamic_cast<const Sub*>(o)) return all(0);
+	if (dynamic_cast<const Mul*>(o) || dynamic_cast<const Div*>(o) || dynamic_cast<const Power*>(o)) return all(1);
+	return false;
+}
+
+std::vector<Operation*> CompositeOperation::optimize(const std::vector<Operation*>& operations)
+{
+	//nested composites run their children in order under the same selections
+	std::vector<Operation*> flat;
+	flattenOperations(operations, flat);
+
+	//a fill overwrites every pixel the operations before it could have touched
+	size_t start = 0;
+	for (size_t i = 0; i < flat.size(); i++)
+		if (dynamic_cast<Fill*>(flat[i])) start = i;
+
+	//children aren't clamped until the whole composite is done, so merging is exact
+	std::vector<Operation*> plan;
+	for (size_t i = start; i < flat.size(); i++) {
+		Operation *merged = plan.empty() ? nullptr : merge(plan.back(), flat[i]);
+		if (merged) {
+			delete plan.back();
+			plan.pop_back();
+		}
+		Operation *o = merged ? merged : flat[i]->clone();
+		if (isIdentity(o)) delete o;
+		else plan.push_back(o);
+	}
+	return plan;
+}
+
+const Program & CompositeOperation::getProgram() const
+{
+	std::lock_guard<std::mutex> guard(planLock);
+	if (!program) {
+		plan = optimize(operations);
+		program = new Program(Program::compile(plan));
+	}
+	return *program;
+}
+
+const std::vector<Operation*>& CompositeOperation::getPlan() const
+{
+	getProgram();
+	return plan;
 }
 
 bool CompositeOperation::aware() const
@@ -72,11 +248,9 @@ bool CompositeOperation::aware() const
 	});
 }
 
-void CompositeOperation::operateLayer(Layer * l, const std::vector<Selection *>& s) const
+void CompositeOperation::operateLayer(Layer * l, const std::vector<Selection *>& s, bool clamp) const
 {
-	for (Operation *o : operations) {
-		o->operateLayer(l, s);
-	}
+	getProgram().run(l, s, clamp);
 }
 
 Pixel Add::operatePixel(Layer * l, int x, int y) const
@@ -86,26 +260,19 @@ Pixel Add::operatePixel(Layer * l, int x, int y) const
 		tempPixel.getB() + paramB, tempPixel.getA());
 }
 
-void Add::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Add::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	//identity parameters compile to nothing
+	if (!paramR && !paramG && !paramB) return true;
+	program.emit(Program::ADD, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Add::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Add::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -135,26 +302,18 @@ Pixel Sub::operatePixel(Layer * l, int x, int y) const
 		tempPixel.getB() - paramB, tempPixel.getA());
 }
 
-void Sub::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Sub::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	if (!paramR && !paramG && !paramB) return true;
+	program.emit(Program::ADD, -paramR, -paramG, -paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Sub::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Sub::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -184,46 +343,70 @@ Pixel Greyscale::operatePixel(Layer * l, int x, int y) const
 	return Pixel(avg,avg,avg,tempPixel.getA());
 }
 
+bool Greyscale::lower(Program & program) const
+{
+	program.emit(Program::GREYSCALE);
+	return true;
+}
+
 Pixel Invert::operatePixel(Layer * l, int x, int y) const
 {
 	Pixel tempPixel = (*l)[y][x];
 	return Pixel(255-tempPixel.getR(),255-tempPixel.getG(),255-tempPixel.getB(),tempPixel.getA());
 }
 
-Pixel Median::operatePixel(Layer * l, int x, int y) const
+bool Invert::lower(Program & program) const
 {
-	std::vector<Pixel> includedPixels;
-	includedPixels.push_back((*l)[y][x]);
-	bool notBottom = y > 0, notTop = y < Image::getImage()->getHeight() - 1;
-	bool notLeft = x > 0, notRight = x < Image::getImage()->getWidth() - 1;
-	if (notBottom) {
-		includedPixels.push_back((*l)[y - 1][x]);
-		if (notLeft)
-			includedPixels.push_back((*l)[y - 1][x - 1]);
-		if (notRight)
-			includedPixels.push_back((*l)[y - 1][x + 1]);
+	program.emit(Program::INVERSE_SUB, 255, 255, 255);
+	return true;
+}
+
+//the median reads pixels it already wrote in this pass, as every in-place operation does
+template<class Spans, class Kernel>
+static void operateSpans(Layer* l, const Spans& spans, bool clamp, Kernel kernel)
+{
+	int width = l->getWidth();
+	int height = l->getHeight();
+	for (int y = 0; y < height; y++) {
+		std::vector<Pixel>& pixels = (*l)[y];
+		spans.forEach(y, width, [&](int begin, int end) {
+			for (int x = begin; x < end; x++) pixels[x] = kernel(*l, x, y);
+		});
 	}
-	if(notLeft)
-		includedPixels.push_back((*l)[y][x - 1]);
-	if (notRight)
-		includedPixels.push_back((*l)[y][x + 1]);
-	if (notTop) {
-		includedPixels.push_back((*l)[y + 1][x]);
-		if (notLeft)
-			includedPixels.push_back((*l)[y + 1][x - 1]);
-		if (notRight)
-			includedPixels.push_back((*l)[y + 1][x + 1]);
+
+	if (!clamp) return;
+	for (int y = 0; y < height; y++) {
+		std::vector<Pixel>& pixels = (*l)[y];
+		spans.forEach(y, width, [&](int begin, int end) {
+			for (int x = begin; x < end; x++) pixels[x].clamp();
+		});
 	}
-	int avgR = 0, avgG = 0, avgB = 0;
-	for (Pixel p : includedPixels) {
-		avgR += p.getR();
-		avgG += p.getG();
-		avgB += p.getB();
+}
+
+void Median::operateLayer(Layer * l, const std::vector<Selection*>& s, bool clamp) const
+{
+	auto kernel = [this](const Layer& l, int x, int y) { return median(l, x, y); };
+	if (s.empty()) operateSpans(l, AllPixels(), clamp, kernel);
+	else operateSpans(l, RectangleSpans(s), clamp, kernel);
+}
+
+Pixel Median::median(const Layer & l, int x, int y) const
+{
+	int left = x > 0 ? x - 1 : x, right = x < l.getWidth() - 1 ? x + 1 : x;
+	int bottom = y > 0 ? y - 1 : y, top = y < l.getHeight() - 1 ? y + 1 : y;
+
+	int sumR = 0, sumG = 0, sumB = 0;
+	for (int j = bottom; j <= top; j++) {
+		const std::vector<Pixel>& row = l[j];
+		for (int i = left; i <= right; i++) {
+			sumR += row[i].getR();
+			sumG += row[i].getG();
+			sumB += row[i].getB();
+		}
 	}
-	avgR /= includedPixels.size();
-	avgG /= includedPixels.size();
-	avgB /= includedPixels.size();
-	return Pixel(avgR,avgG,avgB,includedPixels[0].getA());
+	//divided as size_t like it always was, negative sums keep their old results
+	size_t count = (size_t)(right - left + 1) * (top - bottom + 1);
+	return Pixel((int)((size_t)sumR / count), (int)((size_t)sumG / count), (int)((size_t)sumB / count), l[y][x].getA());
 }
 
 Pixel Mul::operatePixel(Layer * l, int x, int y) const
@@ -233,26 +416,18 @@ Pixel Mul::operatePixel(Layer * l, int x, int y) const
 		tempPixel.getB() * paramB, tempPixel.getA());
 }
 
-void Mul::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Mul::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	if (paramR == 1 && paramG == 1 && paramB == 1) return true;
+	program.emit(Program::MUL, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Mul::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Mul::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -282,26 +457,18 @@ Pixel Div::operatePixel(Layer * l, int x, int y) const
 		tempPixel.getB() / paramB, tempPixel.getA());
 }
 
-void Div::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Div::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	if (paramR == 1 && paramG == 1 && paramB == 1) return true;
+	program.emit(Program::DIV, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Div::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Div::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -331,31 +498,18 @@ Pixel Fill::operatePixel(Layer * l, int x, int y) const
 	return Pixel(paramR, paramG, paramB, paramA);
 }
 
-void Fill::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Fill::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	program.emit(Program::FILL, paramR, paramG, paramB, paramA);
+	return true;
+}
 
-	paramStr = std::to_string(paramA);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Fill::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
+	writer.element("param", std::to_string(paramA));
 }
 
 void Fill::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -390,35 +544,30 @@ Pixel BlackWhite::operatePixel(Layer * l, int x, int y) const
 	return Pixel(avg, avg, avg, tempPixel.getA());
 }
 
+bool BlackWhite::lower(Program & program) const
+{
+	program.emit(Program::BLACKWHITE);
+	return true;
+}
+
 Pixel InverseDiv::operatePixel(Layer * l, int x, int y) const
 {
 	Pixel tempPixel = (*l)[y][x];
-	int newParamR = tempPixel.getR() == 0 ? 255 : paramR / tempPixel.getR();
-	int newParamG = tempPixel.getG() == 0 ? 255 : paramG / tempPixel.getG();
-	int newParamB = tempPixel.getB() == 0 ? 255 : paramB / tempPixel.getB();
-	return Pixel(newParamR, newParamG, newParamB, tempPixel.getA());
+	return Pixel(channel(tempPixel.getR(), paramR), channel(tempPixel.getG(), paramG),
+		channel(tempPixel.getB(), paramB), tempPixel.getA());
 }
 
-void InverseDiv::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool InverseDiv::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	program.emit(Program::INVERSE_DIV, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void InverseDiv::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void InverseDiv::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -448,26 +597,17 @@ Pixel InverseSub::operatePixel(Layer * l, int x, int y) const
 		paramB - tempPixel.getB(), tempPixel.getA());
 }
 
-void InverseSub::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool InverseSub::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	program.emit(Program::INVERSE_SUB, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void InverseSub::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void InverseSub::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -487,63 +627,89 @@ void InverseSub::convertXMLtoParams(rapidxml::xml_node<>* node)
 
 void InverseSub::setParams(std::vector<double> params)
 {
-	paramR = params[0], paramG = params[1], paramG = params[2];
+	paramR = params[0], paramG = params[1], paramB = params[2];
 }
 
-Pixel Power::operatePixel(Layer * l, int x, int y) const
-{
-	Pixel tempPixel = (*l)[y][x];
-	int newParamR = 0, newParamG = 0, newParamB = 0;
-	
-	if (tempPixel.getR() < 0 && (floor(paramR) != ceil(paramR)))
-		newParamR = 0;
-	else if (tempPixel.getR() == 0 && paramR == 0)
-		newParamR = 1;
-	else if (tempPixel.getR() == 0 && paramR < 0)
-		newParamR = 255;
-	else newParamR = pow(tempPixel.getR(), paramR);
+static const double LN2 = 0.6931471805599453;
 
+//natural log of a positive number, log(m) = 2 * atanh((m - 1) / (m + 1)) around m = 1
+static double fastLog(double x)
+{
+	int exponent;
+	double m = frexp(x, &exponent);
+	if (m < 0.7071067811865476) {
+		m *= 2;
+		exponent--;
+	}
+	double t = (m - 1) / (m + 1), t2 = t * t;
+	double series = t * (2 + t2 * (2.0 / 3 + t2 * (2.0 / 5 + t2 * (2.0 / 7 + t2 * (2.0 / 9 + t2 * (2.0 / 11 + t2 * (2.0 / 13)))))));
+	return exponent * LN2 + series;
+}
 
-	if (tempPixel.getG() < 0 && (floor(paramG) != ceil(paramG)))
-		newParamG = 0;
-	else if (tempPixel.getG() == 0 && paramG == 0)
-		newParamG = 1;
-	else if (tempPixel.getG() == 0 && paramG < 0)
-		newParamG = 255;
-	else newParamG = pow(tempPixel.getG(), paramG);
-
+//e^y as 2^k * e^r with |r| <= ln2 / 2
+static double fastExp(double y)
+{
+	if (y > 710) return HUGE_VAL;
+	if (y < -746) return 0;
+	double k = floor(y / LN2 + 0.5);
+	double r = y - k * LN2;
+	double series = 1 + r * (1 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 + r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040 +
+		r * (1.0 / 40320 + r * (1.0 / 362880 + r * (1.0 / 3628800 + r * (1.0 / 39916800 + r * (1.0 / 479001600))))))))))));
+	return ldexp(series, (int)k);
+}
 
-	if (tempPixel.getB() < 0 && (floor(paramB) != ceil(paramB)))
-		newParamB = 0;
-	else if (tempPixel.getB() == 0 && paramB == 0)
-		newParamB = 1;
-	else if (tempPixel.getB() == 0 && paramB < 0)
-		newParamB = 255;
-	else newParamB = pow(tempPixel.getB(), paramB);
+//whole results like pow(16, 0.5) must not truncate to the number below
+static double snap(double value)
+{
+	double nearest = floor(value + 0.5);
+	return fabs(value - nearest) <= 1e-9 * fabs(nearest) ? nearest : value;
+}
 
-	return Pixel(newParamR, newParamG, newParamB, tempPixel.getA());
+int Power::channel(int value, double param)
+{
+	if (value < 0 && (floor(param) != ceil(param)))
+		return 0;
+	else if (value == 0 && param == 0)
+		return 1;
+	else if (value == 0 && param < 0)
+		return 255;
+	else return pow(value, param);
 }
 
-void Power::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+int Power::fastChannel(int value, double param)
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
+	if (value < 0 && (floor(param) != ceil(param)))
+		return 0;
+	else if (value == 0 && param == 0)
+		return 1;
+	else if (value == 0 && param < 0)
+		return 255;
+	else if (value == 0)
+		return 0;
+	//a negative base only gets here with a whole exponent
+	double magnitude = snap(fastExp(param * fastLog(value < 0 ? -(double)value : value)));
+	return value < 0 && fmod(param, 2) != 0 ? -magnitude : magnitude;
+}
 
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+Pixel Power::operatePixel(Layer * l, int x, int y) const
+{
+	Pixel tempPixel = (*l)[y][x];
+	return Pixel(channel(tempPixel.getR(), paramR), channel(tempPixel.getG(), paramG),
+		channel(tempPixel.getB(), paramB), tempPixel.getA());
+}
 
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+bool Power::lower(Program & program) const
+{
+	if (paramR == 1 && paramG == 1 && paramB == 1) return true;
+	program.emit(Program::POWER, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Power::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Power::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -566,52 +732,42 @@ void Power::setParams(std::vector<double> params)
 	paramR = params[0], paramG = params[1], paramB = params[2];
 }
 
-Pixel Log::operatePixel(Layer * l, int x, int y) const
+int Log::channel(int value, double param)
 {
-	Pixel tempPixel = (*l)[y][x];
-	int newParamR = 0, newParamG = 0, newParamB = 0;
-
-	if (tempPixel.getR() == 0)
-		newParamR = 0;
-	else if (tempPixel.getR() < 0)
-		newParamR = tempPixel.getR();
-	else newParamR = log(tempPixel.getR()) / log(paramR);
-
-	if (tempPixel.getG() == 0)
-		newParamG = 0;
-	else if (tempPixel.getG() < 0)
-		newParamG = tempPixel.getG();
-	else newParamG = log(tempPixel.getG()) / log(paramG);
-
-	if (tempPixel.getB() == 0)
-		newParamB = 0;
-	else if (tempPixel.getB() < 0)
-		newParamB = tempPixel.getB();
-	else newParamB = log(tempPixel.getB()) / log(paramB);
-	
-	return Pixel(newParamR, newParamG, newParamB, tempPixel.getA());
+	if (value == 0)
+		return 0;
+	else if (value < 0)
+		return value;
+	else return log(value) / log(param);
 }
 
-void Log::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+int Log::fastChannel(int value, double param)
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
+	if (value == 0)
+		return 0;
+	else if (value < 0)
+		return value;
+	else return snap(fastLog(value) / log(param));
+}
 
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+Pixel Log::operatePixel(Layer * l, int x, int y) const
+{
+	Pixel tempPixel = (*l)[y][x];
+	return Pixel(channel(tempPixel.getR(), paramR), channel(tempPixel.getG(), paramG),
+		channel(tempPixel.getB(), paramB), tempPixel.getA());
+}
 
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+bool Log::lower(Program & program) const
+{
+	program.emit(Program::LOG, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Log::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Log::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -645,26 +801,17 @@ Pixel Min::operatePixel(Layer * l, int x, int y) const
 	return Pixel(newR, newG, newB, tempPixel.getA());
 }
 
-void Min::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Min::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	program.emit(Program::MIN, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Min::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Min::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -696,26 +843,17 @@ Pixel Max::operatePixel(Layer * l, int x, int y) const
 	return Pixel(newR, newG, newB, tempPixel.getA());
 }
 
-void Max::appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Max::lower(Program & program) const
 {
-	std::string paramStr;
-	const char *paramChar;
-	rapidxml::xml_node<> *paramNode;
-
-	paramStr = std::to_string(paramR);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
-
-	paramStr = std::to_string(paramG);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+	program.emit(Program::MAX, paramR, paramG, paramB);
+	return true;
+}
 
-	paramStr = std::to_string(paramB);
-	paramChar = doc.allocate_string(paramStr.c_str());
-	paramNode = doc.allocate_node(rapidxml::node_element, "param", paramChar);
-	currentNode.append_node(paramNode);
+void Max::writeParamsXML(XMLWriter& writer) const
+{
+	writer.element("param", std::to_string(paramR));
+	writer.element("param", std::to_string(paramG));
+	writer.element("param", std::to_string(paramB));
 }
 
 void Max::convertXMLtoParams(rapidxml::xml_node<>* node)
@@ -771,8 +909,9 @@ Operation * Operation::convertXMLtoOperation(rapidxml::xml_node<>* node)
 
 Operation * Operation::getOperation(const std::string& name)
 {
-	if (basicOperationMap.find(name) != basicOperationMap.end())
-		return basicOperationMap[name];
+	auto it = basicOperationMap.find(name);
+	if (it != basicOperationMap.end())
+		return it->second;
 	else return nullptr;
 }
 
@@ -785,15 +924,19 @@ Pixel Abs::operatePixel(Layer * l, int x, int y) const
 	return Pixel(tempR, tempG, tempB, tempPixel.getA());
 }
 
-void Operation::appendOperationXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode)
+bool Abs::lower(Program & program) const
+{
+	program.emit(Program::ABS);
+	return true;
+}
+
+void Operation::writeOperationXML(XMLWriter& writer) const
 {
-	rapidxml::xml_node<> *operationNode = doc.allocate_node(rapidxml::node_element, "operation");
+	writer.openElement("operation");
 
-	char* name = doc.allocate_string(getName().c_str());
-	rapidxml::xml_node<> *nameNode = doc.allocate_node(rapidxml::node_element, "name", name);
-	operationNode->append_node(nameNode);
+	writer.element("name", getName());
 
-	appendParamsXML(doc, *operationNode);
+	writeParamsXML(writer);
 
-	currentNode.append_node(operationNode);
+	writer.closeElement();
 }
@@ -1,9 +1,13 @@
 #pragma once
 #include <vector>
 #include <map>
+#include <mutex>
 #include "Layer.h"
 #include "Selection.h"
 #include "rapidxml.hpp"
+#include "XMLWriter.h"
+
+class Program;
 
 class Operation {
 private:
@@ -16,22 +20,30 @@ public:
 	static Operation* getOperation(const std::string& name);
 	static Operation* convertXMLtoOperation(rapidxml::xml_node<>* node);
 
-	void appendOperationXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode);
-	virtual void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) {}
+	void writeOperationXML(XMLWriter& writer) const;
+	virtual void writeParamsXML(XMLWriter& writer) const {}
 	virtual void convertXMLtoParams(rapidxml::xml_node<>* node) {}
 
 	virtual std::string getName() const = 0;
 	virtual bool aware() const = 0;
-	virtual void operateLayer(Layer* l, const std::vector<Selection *>& s) const = 0;
+	//with clamp set, every pixel written is clamped on the way back into the layer
+	virtual void operateLayer(Layer* l, const std::vector<Selection *>& s, bool clamp = false) const = 0;
 	virtual int numOfParams() const = 0;
 	virtual void setParams(std::vector<double> params) = 0;
+	//params exactly as saved earlier, without the checks setParams makes on user input
+	virtual void restoreParams(const std::vector<double>&) {}
+	virtual std::vector<double> getParams() const { return std::vector<double>(); }
+	//appends the bytecode for this operation, false if it can't be expressed per pixel
+	virtual bool lower(Program& program) const { return false; }
+	//rows above and below a pixel that its result depends on, -1 if there is no bound
+	virtual int reach() const { return -1; }
 	virtual Operation* clone() const = 0;
 	virtual ~Operation() {}
 };
 
 class BasicOperation : public Operation {
 public:
-	void operateLayer(Layer *l, const std::vector<Selection *>& s) const override;
+	void operateLayer(Layer *l, const std::vector<Selection *>& s, bool clamp = false) const override;
 	virtual ~BasicOperation() {}
 };
 
@@ -39,7 +51,13 @@ class CompositeOperation : public Operation {
 private:
 	std::vector<Operation*> operations;
 	std::string name;
+	//what actually runs, built from operations on first use
+	mutable std::vector<Operation*> plan;
+	mutable Program *program = nullptr;
+	mutable std::mutex planLock;
 	void clear();
+	void clearPlan();
+	const Program& getProgram() const;
 	void copy(const CompositeOperation& o);
 	void move(CompositeOperation& o);
 protected:
@@ -47,13 +65,17 @@ protected:
 public:
 	std::string getName() const override { return name; }
 	bool aware() const override;
-	void operateLayer(Layer *l, const std::vector<Selection *>& s) const override;
-	void addOperation(Operation* o) { operations.push_back(o->clone()); }
+	void operateLayer(Layer *l, const std::vector<Selection *>& s, bool clamp = false) const override;
+	void addOperation(Operation* o);
+	const std::vector<Operation*>& getOperations() const { return operations; }
+	const std::vector<Operation*>& getPlan() const;
+	//shorter sequence of basic operations giving the same unclamped result
+	static std::vector<Operation*> optimize(const std::vector<Operation*>& operations);
 	void setParams(std::vector<double> params) override {}
 	int numOfParams() const override { return 0; }
 	CompositeOperation* clone() const override { return new CompositeOperation(*this); }
 
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 
 	CompositeOperation(std::string name) : name(name) {}
@@ -70,14 +92,17 @@ protected:
 public:
 	Add(int paramR = 0, int paramG = 0, int paramB = 0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "+"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Add* clone() const override { return new Add(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Sub : public BasicOperation {
@@ -88,14 +113,17 @@ protected:
 public:
 	Sub(int paramR = 0, int paramG = 0, int paramB = 0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "-"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Sub* clone() const override { return new Sub(*this); }
+	bool lower(Program& program) const override;
 };
 
 class InverseSub : public BasicOperation {
@@ -106,14 +134,17 @@ protected:
 public:
 	InverseSub(int paramR = 0, int paramG = 0, int paramB = 0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "i-"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	InverseSub* clone() const override { return new InverseSub(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Mul : public BasicOperation {
@@ -124,14 +155,17 @@ protected:
 public:
 	Mul(int paramR = 1, int paramG = 1, int paramB = 1) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "*"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Mul* clone() const override { return new Mul(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Power : public BasicOperation {
@@ -140,16 +174,22 @@ private:
 protected:
 	Pixel operatePixel(Layer* l, int x, int y) const override;
 public:
+	static int channel(int value, double param);
+	//same edge cases, approximated to about 1e-12 relative error instead of calling libm
+	static int fastChannel(int value, double param);
 	Power(double paramR = 1.0, double paramG = 1.0, double paramB = 1.0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "pow"; };
 	bool aware() const override { return false; }	
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = params[0], paramG = params[1], paramB = params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Power* clone() const override { return new Power(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Log : public BasicOperation {
@@ -158,16 +198,22 @@ private:
 protected:
 	Pixel operatePixel(Layer* l, int x, int y) const override;
 public:
+	static int channel(int value, double param);
+	//same edge cases, approximated to about 1e-12 relative error instead of calling libm
+	static int fastChannel(int value, double param);
 	Log(double paramR = 10.0, double paramG = 10.0, double paramB = 10.0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "log"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = params[0], paramG = params[1], paramB = params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Log* clone() const override { return new Log(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Div : public BasicOperation {
@@ -178,14 +224,17 @@ protected:
 public:
 	Div(int paramR = 1, int paramG = 1, int paramB = 1) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "/"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Div* clone() const override { return new Div(*this); }
+	bool lower(Program& program) const override;
 };
 
 //baci exception u SetParams() ako je 0
@@ -195,16 +244,20 @@ private:
 protected:
 	Pixel operatePixel(Layer* l, int x, int y) const override;
 public:
+	static int channel(int value, int param) { return value == 0 ? 255 : param / value; }
 	InverseDiv(int paramR = 1, int paramG = 1, int paramB = 1) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "i/"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	InverseDiv* clone() const override { return new InverseDiv(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Min : public BasicOperation {
@@ -215,14 +268,17 @@ protected:
 public:
 	Min(int paramR = 255, int paramG = 255, int paramB = 255) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "min"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Min* clone() const override { return new Min(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Max : public BasicOperation {
@@ -233,14 +289,17 @@ protected:
 public:
 	Max(int paramR = 0, int paramG = 0, int paramB = 0) : paramR(paramR), paramG(paramG), paramB(paramB) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "max"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB }; }
 	int numOfParams() const override { return 3; }
 	Max* clone() const override { return new Max(*this); }
+	bool lower(Program& program) const override;
 };
 
 
@@ -252,14 +311,17 @@ protected:
 public:
 	Fill(int paramR = 0, int paramG = 0, int paramB = 0, int paramA = 0) : paramR(paramR), paramG(paramG), paramB(paramB), paramA(paramA) {}
 	
-	void appendParamsXML(rapidxml::xml_document<>& doc, rapidxml::xml_node<>& currentNode) override;
+	void writeParamsXML(XMLWriter& writer) const override;
 	void convertXMLtoParams(rapidxml::xml_node<>* node) override;
 	
 	std::string getName() const override { return "fill"; };
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override;
+	void restoreParams(const std::vector<double>& params) override { paramR = (int)params[0], paramG = (int)params[1], paramB = (int)params[2], paramA = (int)params[3]; }
+	std::vector<double> getParams() const override { return { (double)paramR, (double)paramG, (double)paramB, (double)paramA }; }
 	int numOfParams() const override { return 4; }
 	Fill* clone() const override { return new Fill(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Greyscale : public BasicOperation {
@@ -273,6 +335,7 @@ public:
 	void setParams(std::vector<double> params) override {}
 	int numOfParams() const override { return 0; }
 	Greyscale* clone() const override { return new Greyscale(*this); }
+	bool lower(Program& program) const override;
 };
 
 class BlackWhite : public BasicOperation {
@@ -286,6 +349,7 @@ public:
 	void setParams(std::vector<double> params) override {}
 	int numOfParams() const override { return 0; }
 	BlackWhite* clone() const override { return new BlackWhite(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Invert: public BasicOperation {
@@ -299,19 +363,25 @@ public:
 	void setParams(std::vector<double> params) override {}
 	int numOfParams() const override { return 0; }
 	Invert* clone() const override { return new Invert(*this); }
+	bool lower(Program& program) const override;
 };
 
 class Median : public BasicOperation {
+private:
+	//called directly from the span loop, so it can be inlined there
+	Pixel median(const Layer& l, int x, int y) const;
 protected:
-	Pixel operatePixel(Layer* l, int x, int y) const override;
+	Pixel operatePixel(Layer* l, int x, int y) const override { return median(*l, x, y); }
 public:
 	Median() {}
-	
+
+	void operateLayer(Layer* l, const std::vector<Selection *>& s, bool clamp = false) const override;
 	std::string getName() const override { return "median"; }
 	bool aware() const override { return false; }
 	void setParams(std::vector<double> params) override {}
 	int numOfParams() const override { return 0; }
 	Median* clone() const override { return new Median(*this); }
+	int reach() const override { return 1; }
 };
 
 class Abs : public BasicOperation {
@@ -325,4 +395,5 @@ public:
 	void setParams(std::vector<double> params) override {}	
 	int numOfParams() const override { return 0; }
 	Abs* clone() const override { return new Abs(*this); }
+	bool lower(Program& program) const override;
 };
\ No newline at end of file
@@ -111,10 +111,10 @@ Layer * PAMFormatter::load(const std::string& path)
 	return l;
 }
 
-void PAMFormatter::save(const std::string& path)
+void PAMFormatter::write(const Layer& image, const std::string& path)
 {
 	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
-	Image *i = Image::getImage();
+	const Layer *i = &image;
 
 	char HDR[25];
 
@@ -186,16 +186,18 @@ void PAMFormatter::save(const std::string& path)
 	HDR[0] = 69, HDR[1] = 78, HDR[2] = 68, HDR[3] = 72, HDR[4] = 68, HDR[5] = 82, HDR[6] = 10;
 	FILE.write(HDR, 7);
 
+	std::vector<char> rowBuffer(i->getWidth() * 4);
+
 	for (int j = i->getHeight() - 1; j >= 0; j--) {
-		for (int k = 0; k < i->getWidth(); k++) {
-			Pixel tempPixel = i->getPixel(k, j);
-			HDR[0] = tempPixel.getR();
-			HDR[1] = tempPixel.getG();
-			HDR[2] = tempPixel.getB();
-			HDR[3] = tempPixel.getA();
-
-			FILE.write(HDR, 4);
+		char *pixelBuffer = rowBuffer.data();
+		for (const Pixel& tempPixel : (*i)[j]) {
+			pixelBuffer[0] = tempPixel.getR();
+			pixelBuffer[1] = tempPixel.getG();
+			pixelBuffer[2] = tempPixel.getB();
+			pixelBuffer[3] = tempPixel.getA();
+			pixelBuffer += 4;
 		}
+		FILE.write(rowBuffer.data(), rowBuffer.size());
 	}
 
 	FILE.close();
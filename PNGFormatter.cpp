@@ -0,0 +1,314 @@
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <climits>
+#include "Image.h"
+#include "Formatter.h"
+#include "ThreadPool.h"
+#include "Exceptions.h"
+
+static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+static const size_t MAX_IDAT_SIZE = 1 << 20;
+
+static int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = p > a ? p - a : a - p;
+	int pb = p > b ? p - b : b - p;
+	int pc = p > c ? p - c : c - p;
+	if (pa <= pb && pa <= pc) return a;
+	if (pb <= pc) return b;
+	return c;
+}
+
+static void filterRow(const unsigned char* row, const unsigned char* prior, size_t stride, size_t bpp, int type, unsigned char* out)
+{
+	for (size_t i = 0; i < stride; i++) {
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = prior ? prior[i] : 0;
+		int c = prior && i >= bpp ? prior[i - bpp] : 0;
+		switch (type) {
+		case 0: out[i] = row[i]; break;
+		case 1: out[i] = row[i] - a; break;
+		case 2: out[i] = row[i] - b; break;
+		case 3: out[i] = row[i] - ((a + b) >> 1); break;
+		case 4: out[i] = row[i] - paeth(a, b, c); break;
+		}
+	}
+}
+
+static void unfilterRow(unsigned char* row, const unsigned char* prior, size_t stride, size_t bpp, int type)
+{
+	for (size_t i = 0; i < stride; i++) {
+		int a = i >= bpp ? row[i - bpp] : 0;
+		int b = prior ? prior[i] : 0;
+		int c = prior && i >= bpp ? prior[i - bpp] : 0;
+		switch (type) {
+		case 0: break;
+		case 1: row[i] += a; break;
+		case 2: row[i] += b; break;
+		case 3: row[i] += (a + b) >> 1; break;
+		case 4: row[i] += paeth(a, b, c); break;
+		default: throw BadFormatException("Unknown PNG filter type");
+		}
+	}
+}
+
+static void appendUint(std::vector<unsigned char>& out, unsigned value)
+{
+	out.push_back(value >> 24 & 0xFF);
+	out.push_back(value >> 16 & 0xFF);
+	out.push_back(value >> 8 & 0xFF);
+	out.push_back(value & 0xFF);
+}
+
+static unsigned readUint(const unsigned char* data)
+{
+	return (unsigned)data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static void appendChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t size, unsigned crc)
+{
+	appendUint(out, size);
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+	appendUint(out, crc);
+}
+
+static unsigned chunkCrc(const char* type, const unsigned char* data, size_t size)
+{
+	return Deflate::crc32(data, size, Deflate::crc32((const unsigned char*)type, 4));
+}
+
+std::vector<unsigned char> PNGFormatter::encode(const Layer & l, Deflate::Level level)
+{
+	int width = l.getWidth();
+	int height = l.getHeight();
+	size_t stride = (size_t)width * 4;
+
+	ThreadPool& pool = ThreadPool::getPool();
+
+	//layer rows go bottom up, png scanlines top down
+	std::vector<unsigned char> raw(stride * height);
+	pool.parallelFor(height, [&](int row) {
+		unsigned char *out = &raw[stride * row];
+		const std::vector<Pixel>& pixels = l[height - 1 - row];
+		for (int x = 0; x < width; x++) {
+			out[4 * x] = pixels[x].getR();
+			out[4 * x + 1] = pixels[x].getG();
+			out[4 * x + 2] = pixels[x].getB();
+			out[4 * x + 3] = pixels[x].getA();
+		}
+	});
+
+	std::vector<unsigned char> filtered((stride + 1) * height);
+	pool.parallelFor(height, [&](int row) {
+		const unsigned char *current = &raw[stride * row];
+		const unsigned char *prior = row > 0 ? current - stride : nullptr;
+		unsigned char *out = &filtered[(stride + 1) * row];
+
+		if (level == Deflate::STORE) {
+			out[0] = 0;
+			filterRow(current, prior, stride, 4, 0, out + 1);
+			return;
+		}
+
+		//pick the filter with the smallest sum of absolute differences
+		std::vector<unsigned char> candidate(stride);
+		unsigned long long bestSum = ~0ULL;
+		for (int type = 0; type < 5; type++) {
+			filterRow(current, prior, stride, 4, type, candidate.data());
+			unsigned long long sum = 0;
+			for (unsigned char c : candidate) sum += c < 128 ? c : 256 - c;
+			if (sum < bestSum) {
+				bestSum = sum;
+				out[0] = type;
+				std::copy(candidate.begin(), candidate.end(), out + 1);
+			}
+		}
+	});
+	raw.clear();
+	raw.shrink_to_fit();
+
+	std::vector<unsigned char> compressed = Deflate::zlibCompress(filtered.data(), filtered.size(), level);
+	filtered.clear();
+	filtered.shrink_to_fit();
+
+	int idatCount = compressed.empty() ? 1 : (compressed.size() + MAX_IDAT_SIZE - 1) / MAX_IDAT_SIZE;
+	std::vector<unsigned> idatCrcs(idatCount);
+	pool.parallelFor(idatCount, [&](int i) {
+		size_t start = i * MAX_IDAT_SIZE;
+		size_t size = compressed.size() - start < MAX_IDAT_SIZE ? compressed.size() - start : MAX_IDAT_SIZE;
+		idatCrcs[i] = chunkCrc("IDAT", compressed.data() + start, size);
+	});
+
+	std::vector<unsigned char> out;
+	out.reserve(compressed.size() + idatCount * 12 + 64);
+	out.insert(out.end(), signature, signature + 8);
+
+	std::vector<unsigned char> header;
+	appendUint(header, width);
+	appendUint(header, height);
+	//8 bit RGBA, no interlacing
+	header.push_back(8);
+	header.push_back(6);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	appendChunk(out, "IHDR", header.data(), header.size(), chunkCrc("IHDR", header.data(), header.size()));
+
+	for (int i = 0; i < idatCount; i++) {
+		size_t start = i * MAX_IDAT_SIZE;
+		size_t size = compressed.size() - start < MAX_IDAT_SIZE ? compressed.size() - start : MAX_IDAT_SIZE;
+		appendChunk(out, "IDAT", compressed.data() + start, size, idatCrcs[i]);
+	}
+
+	appendChunk(out, "IEND", nullptr, 0, chunkCrc("IEND", nullptr, 0));
+	return out;
+}
+
+Layer * PNGFormatter::decode(const unsigned char * data, size_t size, const std::string & path)
+{
+	if (size < 8 || !std::equal(signature, signature + 8, data))
+		throw BadFormatException("Not a PNG file");
+
+	unsigned imageWidth = 0, imageHeight = 0;
+	int bitDepth = 0, colorType = -1;
+	std::vector<unsigned char> palette, transparency, idat;
+
+	size_t pos = 8;
+	while (true) {
+		if (size - pos < 12) throw BadFormatException("PNG file is truncated");
+		unsigned length = readUint(data + pos);
+		const char *type = (const char*)data + pos + 4;
+		const unsigned char *chunk = data + pos + 8;
+		if (size - pos - 12 < length) throw BadFormatException("PNG file is truncated");
+		if (readUint(chunk + length) != chunkCrc(type, chunk, length))
+			throw BadFormatException("PNG chunk is corrupted");
+
+		std::string typeStr(type, 4);
+		if (typeStr == "IHDR") {
+			if (length < 13) throw BadFormatException("PNG header is corrupted");
+			imageWidth = readUint(chunk);
+			imageHeight = readUint(chunk + 4);
+			bitDepth = chunk[8];
+			colorType = chunk[9];
+			if (chunk[12] != 0) throw BadFormatException("Interlaced PNG files are not supported");
+		}
+		else if (typeStr == "PLTE") {
+			palette.assign(chunk, chunk + length);
+		}
+		else if (typeStr == "tRNS") {
+			transparency.assign(chunk, chunk + length);
+		}
+		else if (typeStr == "IDAT") {
+			idat.insert(idat.end(), chunk, chunk + length);
+		}
+		else if (typeStr == "IEND") {
+			break;
+		}
+		pos += length + 12;
+	}
+
+	int channels;
+	switch (colorType) {
+	case 0: channels = 1; break;
+	case 2: channels = 3; break;
+	case 3: channels = 1; break;
+	case 4: channels = 2; break;
+	case 6: channels = 4; break;
+	default: throw BadFormatException("Unknown PNG color type");
+	}
+	bool validDepth = bitDepth == 8 || bitDepth == 16 ||
+		((colorType == 0 || colorType == 3) && (bitDepth == 1 || bitDepth == 2 || bitDepth == 4));
+	if (!validDepth || (colorType == 3 && bitDepth == 16))
+		throw BadFormatException("Unsupported PNG bit depth");
+	if (imageWidth == 0 || imageHeight == 0)
+		throw BadFormatException("PNG image is empty");
+
+	size_t bitsPerPixel = channels * bitDepth;
+	size_t bpp = bitsPerPixel < 8 ? 1 : bitsPerPixel / 8;
+	//deflate expands data at most about 1032 times, larger dimensions can't be backed by the image data
+	unsigned long long rowBytes = ((unsigned long long)imageWidth * bitsPerPixel + 7) / 8 + 1;
+	unsigned long long maxBytes = ((unsigned long long)idat.size() + 1) * 1032;
+	if (imageWidth > INT_MAX || imageHeight > INT_MAX || rowBytes > maxBytes / imageHeight)
+		throw BadFormatException("PNG image size doesn't match its data");
+	size_t stride = (size_t)rowBytes - 1;
+
+	std::vector<unsigned char> scanlines = Deflate::zlibDecompress(idat.data(), idat.size(), (stride + 1) * imageHeight, (stride + 1) * imageHeight);
+	if (scanlines.size() < (stride + 1) * imageHeight) throw BadFormatException("PNG image data is truncated");
+	idat.clear();
+	idat.shrink_to_fit();
+
+	for (unsigned row = 0; row < imageHeight; row++) {
+		unsigned char *current = &scanlines[(stride + 1) * row];
+		unfilterRow(current + 1, row > 0 ? current - stride : nullptr, stride, bpp, current[0]);
+	}
+
+	//a bad palette index throws halfway through
+	std::unique_ptr<Layer> l(new Layer(imageWidth, imageHeight, path));
+	int maxSample = (1 << bitDepth) - 1;
+
+	ThreadPool::getPool().parallelFor(imageHeight, [&](int row) {
+		const unsigned char *current = &scanlines[(stride + 1) * row + 1];
+		std::vector<Pixel>& pixels = (*l)[imageHeight - 1 - row];
+
+		auto sample = [&](unsigned x, int channel) -> int {
+			if (bitDepth == 8) return current[x * channels + channel];
+			if (bitDepth == 16) return current[(x * channels + channel) * 2];
+			size_t bit = (size_t)x * bitDepth;
+			return current[bit / 8] >> (8 - bitDepth - bit % 8) & maxSample;
+		};
+
+		for (unsigned x = 0; x < imageWidth; x++) {
+			switch (colorType) {
+			case 0: {
+				int grey = bitDepth < 8 ? sample(x, 0) * 255 / maxSample : sample(x, 0);
+				pixels[x] = Pixel(grey, grey, grey, 255);
+				break;
+			}
+			case 2:
+				pixels[x] = Pixel(sample(x, 0), sample(x, 1), sample(x, 2), 255);
+				break;
+			case 3: {
+				size_t index = sample(x, 0);
+				if (3 * index + 2 >= palette.size()) throw BadFormatException("PNG palette index out of range");
+				int alpha = index < transparency.size() ? transparency[index] : 255;
+				pixels[x] = Pixel(palette[3 * index], palette[3 * index + 1], palette[3 * index + 2], alpha);
+				break;
+			}
+			case 4:
+				pixels[x] = Pixel(sample(x, 0), sample(x, 0), sample(x, 0), sample(x, 1));
+				break;
+			case 6:
+				pixels[x] = Pixel(sample(x, 0), sample(x, 1), sample(x, 2), sample(x, 3));
+				break;
+			}
+		}
+	});
+
+	return l.release();
+}
+
+Layer * PNGFormatter::load(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+	if (!FILE.is_open()) throw BadPathException("File does not exist");
+
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+	FILE.close();
+
+	return decode(data.data(), data.size(), path);
+}
+
+void PNGFormatter::write(const Layer& image, const std::string& path)
+{
+	if (image.getWidth() == 0 || image.getHeight() == 0) throw BadInputException("Image is empty");
+
+	std::vector<unsigned char> data = encode(image, level);
+
+	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
+	if (!FILE.is_open()) throw BadPathException("File can't be opened for writing");
+	FILE.write((const char*)data.data(), data.size());
+	FILE.close();
+}
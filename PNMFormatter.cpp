@@ -0,0 +1,210 @@
+#include <fstream>
+#include <string>
+#include <cctype>
+#include "Image.h"
+#include "Formatter.h"
+#include "ThreadPool.h"
+#include "Exceptions.h"
+
+static int readHeaderNumber(std::istream& FILE)
+{
+	int c = FILE.get();
+	while (c == '#' || std::isspace(c)) {
+		if (c == '#')
+			while (c != '\n' && c != EOF) c = FILE.get();
+		c = FILE.get();
+	}
+	if (!std::isdigit(c)) throw BadFormatException("Invalid PNM header");
+
+	//nothing in a header needs more than this, larger values would overflow the size computations
+	const int MAX_NUMBER = 1 << 24;
+	int number = 0;
+	while (std::isdigit(c)) {
+		number = number * 10 + c - '0';
+		if (number > MAX_NUMBER) throw BadFormatException("PNM header value is too large");
+		c = FILE.get();
+	}
+	//exactly one whitespace character separates the header from the raster
+	if (!std::isspace(c)) throw BadFormatException("Invalid PNM header");
+	return number;
+}
+
+struct PNMHeader {
+	int channels, width, height, maxval, sampleSize;
+	size_t rowSize;
+};
+
+static PNMHeader readHeader(std::istream& FILE)
+{
+	char magic[2];
+	FILE.read(magic, 2);
+	if (!FILE || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6'))
+		throw BadFormatException("Only binary PGM and PPM files are supported");
+
+	PNMHeader h;
+	h.channels = magic[1] == '5' ? 1 : 3;
+	h.width = readHeaderNumber(FILE);
+	h.height = readHeaderNumber(FILE);
+	h.maxval = readHeaderNumber(FILE);
+	if (h.width <= 0 || h.height <= 0) throw BadFormatException("Invalid PNM header");
+	if (h.maxval <= 0 || h.maxval > 65535) throw BadFormatException("Invalid PNM maximum value");
+
+	h.sampleSize = h.maxval > 255 ? 2 : 1;
+	h.rowSize = (size_t)h.width * h.channels * h.sampleSize;
+	return h;
+}
+
+static void decodeRow(const PNMHeader& h, const unsigned char* in, std::vector<Pixel>& pixels)
+{
+	int samples[3];
+	for (int x = 0; x < h.width; x++) {
+		for (int c = 0; c < h.channels; c++) {
+			int value = h.sampleSize == 1 ? in[0] : in[0] << 8 | in[1];
+			in += h.sampleSize;
+			samples[c] = h.maxval == 255 ? value : (value * 255 + h.maxval / 2) / h.maxval;
+		}
+		if (h.channels == 1)
+			pixels[x] = Pixel(samples[0], samples[0], samples[0], 255);
+		else
+			pixels[x] = Pixel(samples[0], samples[1], samples[2], 255);
+	}
+}
+
+static void encodeRow(PNMFormatter::Type type, const std::vector<Pixel>& pixels, unsigned char* out)
+{
+	for (const Pixel& tempPixel : pixels) {
+		if (type == PNMFormatter::PGM) {
+			*out++ = (tempPixel.getR() + tempPixel.getG() + tempPixel.getB()) / 3;
+		}
+		else {
+			*out++ = tempPixel.getR();
+			*out++ = tempPixel.getG();
+			*out++ = tempPixel.getB();
+		}
+	}
+}
+
+static std::string writeHeader(PNMFormatter::Type type, int width, int height)
+{
+	return (type == PNMFormatter::PGM ? "P5\n" : "P6\n") + std::to_string(width) + " " + std::to_string(height) + "\n255\n";
+}
+
+//the raster goes top down, strips are found by offset instead
+class PNMStripReader : public StripReader {
+private:
+	std::ifstream FILE;
+	PNMHeader header;
+	std::streamoff raster;
+	std::vector<unsigned char> buffer;
+public:
+	PNMStripReader(const std::string& path) : FILE(path, std::ifstream::binary | std::ifstream::in) {
+		if (!FILE.is_open()) throw BadPathException("File does not exist");
+		header = readHeader(FILE);
+		raster = FILE.tellg();
+	}
+
+	int getWidth() const override { return header.width; }
+	int getHeight() const override { return header.height; }
+	void read(int first, std::vector<std::vector<Pixel>>& rows) override {
+		size_t count = rows.size();
+		buffer.resize(header.rowSize * count);
+		FILE.seekg(raster + (std::streamoff)(header.height - first - count) * header.rowSize);
+		FILE.read((char*)buffer.data(), buffer.size());
+		if (FILE.gcount() != (std::streamsize)buffer.size()) throw BadFormatException("PNM file is truncated");
+		for (size_t i = 0; i < count; i++) {
+			rows[i].resize(header.width);
+			decodeRow(header, &buffer[header.rowSize * (count - 1 - i)], rows[i]);
+		}
+	}
+};
+
+class PNMStripWriter : public StripWriter {
+private:
+	std::ofstream FILE;
+	PNMFormatter::Type type;
+	int height;
+	size_t rowSize;
+	std::streamoff raster;
+	std::vector<unsigned char> buffer;
+public:
+	PNMStripWriter(const std::string& path, PNMFormatter::Type type, int width, int height) :
+		FILE(path, std::ofstream::binary | std::ofstream::out), type(type), height(height), rowSize((size_t)width * (type == PNMFormatter::PGM ? 1 : 3)) {
+		if (!FILE.is_open()) throw BadPathException("File can't be opened for writing");
+		std::string header = writeHeader(type, width, height);
+		FILE.write(header.c_str(), header.size());
+		raster = FILE.tellp();
+		//the file gets its full size up front so strips can land anywhere in it
+		if (rowSize * height > 0) {
+			FILE.seekp(raster + (std::streamoff)(rowSize * height - 1));
+			FILE.put(0);
+		}
+	}
+
+	void write(int first, const std::vector<std::vector<Pixel>>& rows) override {
+		size_t count = rows.size();
+		buffer.resize(rowSize * count);
+		for (size_t i = 0; i < count; i++)
+			encodeRow(type, rows[i], &buffer[rowSize * (count - 1 - i)]);
+		FILE.seekp(raster + (std::streamoff)(height - first - count) * rowSize);
+		FILE.write((const char*)buffer.data(), buffer.size());
+	}
+	void close() override {
+		FILE.close();
+		if (FILE.fail()) throw BadPathException("File can't be written");
+	}
+};
+
+Layer * PNMFormatter::load(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+	if (!FILE.is_open()) throw BadPathException("File does not exist");
+
+	PNMHeader header = readHeader(FILE);
+
+	std::vector<unsigned char> raster(header.rowSize * header.height);
+	FILE.read((char*)raster.data(), raster.size());
+	if (FILE.gcount() != (std::streamsize)raster.size()) throw BadFormatException("PNM file is truncated");
+	FILE.close();
+
+	Layer *l = new Layer(header.width, header.height, path);
+
+	ThreadPool::getPool().parallelFor(header.height, [&](int row) {
+		decodeRow(header, &raster[header.rowSize * row], (*l)[header.height - 1 - row]);
+	});
+
+	return l;
+}
+
+void PNMFormatter::write(const Layer& image, const std::string& path)
+{
+	std::ofstream FILE(path, std::ofstream::binary | std::ofstream::out);
+	if (!FILE.is_open()) throw BadPathException("File can't be opened for writing");
+	const Layer *i = &image;
+
+	int width = i->getWidth();
+	int height = i->getHeight();
+	int channels = type == PGM ? 1 : 3;
+
+	std::string header = writeHeader(type, width, height);
+	FILE.write(header.c_str(), header.size());
+
+	size_t rowSize = (size_t)width * channels;
+	std::vector<unsigned char> raster(rowSize * height);
+
+	ThreadPool::getPool().parallelFor(height, [&](int row) {
+		encodeRow(type, (*i)[height - 1 - row], &raster[rowSize * row]);
+	});
+
+	FILE.write((const char*)raster.data(), raster.size());
+	FILE.close();
+}
+
+StripReader * PNMFormatter::openStrips(const std::string & path)
+{
+	return new PNMStripReader(path);
+}
+
+StripWriter * PNMFormatter::createStrips(const std::string & path, int width, int height)
+{
+	return new PNMStripWriter(path, type, width, height);
+}
@@ -0,0 +1,179 @@
+#include "Program.h"
+#include "Operation.h"
+#include "Kernels.h"
+#include "Spans.h"
+#include "ThreadPool.h"
+
+Program::Accuracy Program::accuracy = Program::EXACT;
+
+Program Program::compile(const std::vector<Operation*>& operations)
+{
+	Program program;
+	for (const Operation *o : operations)
+		program.append(o, false);
+	return program;
+}
+
+void Program::append(const Operation * o, bool clamp)
+{
+	if (!o->lower(*this)) blocks.push_back(Block{ std::vector<Instruction>(), o, clamp });
+	else if (clamp) emit(CLAMP);
+}
+
+void Program::emit(Opcode opcode, int r, int g, int b, int a)
+{
+	if (blocks.empty() || blocks.back().fallback)
+		blocks.push_back(Block{ std::vector<Instruction>(), nullptr, false });
+	blocks.back().code.push_back(Instruction{ opcode, { r, g, b, a }, { 0, 0, 0 } });
+}
+
+void Program::emit(Opcode opcode, double r, double g, double b)
+{
+	emit(opcode);
+	Instruction& i = blocks.back().code.back();
+	i.d[0] = r;
+	i.d[1] = g;
+	i.d[2] = b;
+
+	if (opcode != POWER && opcode != LOG) return;
+	//tables come from the exact per channel code, so looking up is never less accurate
+	for (int c = 0; c < 3; c++) {
+		i.k[c] = tables.size();
+		std::vector<int> table(TABLE_SIZE);
+		for (int j = 0; j < TABLE_SIZE; j++)
+			table[j] = opcode == POWER ? Power::channel(TABLE_MIN + j, i.d[c]) : Log::channel(TABLE_MIN + j, i.d[c]);
+		tables.push_back(std::move(table));
+	}
+}
+
+void Program::execute(const Instruction & i, int * r, int * g, int * b, int * a, int count) const
+{
+	const int *k = i.k;
+	const double *d = i.d;
+	const Kernels& kernels = Kernels::get();
+	switch (i.opcode) {
+	case ADD:
+		kernels.add(r, count, k[0]);
+		kernels.add(g, count, k[1]);
+		kernels.add(b, count, k[2]);
+		break;
+	case INVERSE_SUB:
+		kernels.inverseSub(r, count, k[0]);
+		kernels.inverseSub(g, count, k[1]);
+		kernels.inverseSub(b, count, k[2]);
+		break;
+	case MUL:
+		kernels.mul(r, count, k[0]);
+		kernels.mul(g, count, k[1]);
+		kernels.mul(b, count, k[2]);
+		break;
+	case DIV:
+		kernels.div(r, count, k[0]);
+		kernels.div(g, count, k[1]);
+		kernels.div(b, count, k[2]);
+		break;
+	case INVERSE_DIV:
+		for (int x = 0; x < count; x++) {
+			r[x] = InverseDiv::channel(r[x], k[0]);
+			g[x] = InverseDiv::channel(g[x], k[1]);
+			b[x] = InverseDiv::channel(b[x], k[2]);
+		}
+		break;
+	case POWER: {
+		int (*channel)(int, double) = accuracy == FAST ? Power::fastChannel : Power::channel;
+		kernels.lookup(r, count, tables[k[0]].data(), TABLE_MIN, TABLE_SIZE, channel, d[0]);
+		kernels.lookup(g, count, tables[k[1]].data(), TABLE_MIN, TABLE_SIZE, channel, d[1]);
+		kernels.lookup(b, count, tables[k[2]].data(), TABLE_MIN, TABLE_SIZE, channel, d[2]);
+		break;
+	}
+	case LOG: {
+		int (*channel)(int, double) = accuracy == FAST ? Log::fastChannel : Log::channel;
+		kernels.lookup(r, count, tables[k[0]].data(), TABLE_MIN, TABLE_SIZE, channel, d[0]);
+		kernels.lookup(g, count, tables[k[1]].data(), TABLE_MIN, TABLE_SIZE, channel, d[1]);
+		kernels.lookup(b, count, tables[k[2]].data(), TABLE_MIN, TABLE_SIZE, channel, d[2]);
+		break;
+	}
+	case MIN:
+		kernels.min(r, count, k[0]);
+		kernels.min(g, count, k[1]);
+		kernels.min(b, count, k[2]);
+		break;
+	case MAX:
+		kernels.max(r, count, k[0]);
+		kernels.max(g, count, k[1]);
+		kernels.max(b, count, k[2]);
+		break;
+	case FILL:
+		kernels.fill(r, count, k[0]);
+		kernels.fill(g, count, k[1]);
+		kernels.fill(b, count, k[2]);
+		kernels.fill(a, count, k[3]);
+		break;
+	case GREYSCALE:
+		for (int x = 0; x < count; x++) r[x] = g[x] = b[x] = (r[x] + g[x] + b[x]) / 3;
+		break;
+	case BLACKWHITE:
+		for (int x = 0; x < count; x++) r[x] = g[x] = b[x] = (r[x] + g[x] + b[x]) / 3 < 127 ? 0 : 255;
+		break;
+	case ABS:
+		kernels.abs(r, count);
+		kernels.abs(g, count);
+		kernels.abs(b, count);
+		break;
+	case CLAMP:
+		kernels.clamp(r, count);
+		kernels.clamp(g, count);
+		kernels.clamp(b, count);
+		break;
+	}
+}
+
+template<class Spans>
+void Program::runCode(const std::vector<Instruction>& code, Layer * l, const Spans& spans, bool clamp) const
+{
+	int width = l->getWidth();
+	int height = l->getHeight();
+	if (width == 0 || height == 0) return;
+	//detach shared pixels once here instead of racing on it from every row
+	(*l)[0];
+
+	ThreadPool::getPool().parallelFor(height, [&](int y) {
+		std::vector<Pixel>& pixels = (*l)[y];
+		std::vector<int> registers(4 * (size_t)width);
+		int *r = registers.data(), *g = r + width, *b = g + width, *a = b + width;
+
+		//each run of selected pixels is loaded into the registers once for the whole code
+		spans.forEach(y, width, [&](int start, int end) {
+			int count = end - start;
+			for (int i = 0; i < count; i++) {
+				const Pixel& p = pixels[start + i];
+				r[i] = p.getR();
+				g[i] = p.getG();
+				b[i] = p.getB();
+				a[i] = p.getA();
+			}
+			for (const Instruction& i : code)
+				execute(i, r, g, b, a, count);
+			if (clamp) {
+				const Kernels& kernels = Kernels::get();
+				kernels.clamp(r, count);
+				kernels.clamp(g, count);
+				kernels.clamp(b, count);
+			}
+			for (int i = 0; i < count; i++)
+				pixels[start + i] = Pixel(r[i], g[i], b[i], a[i]);
+		});
+	});
+}
+
+void Program::run(Layer * l, const std::vector<Selection*>& s, bool clamp) const
+{
+	//every block writes the same selected pixels, so clamping the last one's output covers them all
+	for (size_t i = 0; i < blocks.size(); i++) {
+		const Block& block = blocks[i];
+		bool last = clamp && i + 1 == blocks.size();
+		if (block.fallback) block.fallback->operateLayer(l, s, block.clamp || last);
+		else if (s.empty()) runCode(block.code, l, AllPixels(), last);
+		else runCode(block.code, l, RectangleSpans(s), last);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <vector>
+#include "Layer.h"
+
+class Operation;
+
+//composite plan lowered to bytecode, every instruction runs over a whole span of a row
+//there are four registers, one per channel, each holding the span being processed
+class Program {
+public:
+	enum Opcode { ADD, INVERSE_SUB, MUL, DIV, INVERSE_DIV, POWER, LOG, MIN, MAX, FILL, GREYSCALE, BLACKWHITE, ABS, CLAMP };
+	//exact matches libm, fast approximates pow and log for values outside the tables
+	enum Accuracy { EXACT, FAST };
+
+	//pow and log are precomputed for every value in this range
+	static const int TABLE_MIN = -256;
+	static const int TABLE_SIZE = 1280;
+
+	struct Instruction {
+		Opcode opcode;
+		int k[4];
+		double d[3];
+	};
+private:
+	//operations that can't be lowered run on their own between straight runs of code
+	struct Block {
+		std::vector<Instruction> code;
+		const Operation *fallback;
+		bool clamp;
+	};
+	std::vector<Block> blocks;
+	//pow and log instructions refer to their tables by index, one per channel
+	std::vector<std::vector<int>> tables;
+	static Accuracy accuracy;
+
+	void execute(const Instruction& i, int* r, int* g, int* b, int* a, int count) const;
+	template<class Spans>
+	void runCode(const std::vector<Instruction>& code, Layer* l, const Spans& spans, bool clamp) const;
+public:
+	static Accuracy getAccuracy() { return accuracy; }
+	static void setAccuracy(Accuracy accuracy) { Program::accuracy = accuracy; }
+
+	static Program compile(const std::vector<Operation*>& operations);
+
+	//clamping after the operation matches applying it to a layer on its own
+	void append(const Operation* o, bool clamp);
+	void emit(Opcode opcode, int r = 0, int g = 0, int b = 0, int a = 0);
+	void emit(Opcode opcode, double r, double g, double b);
+
+	size_t getBlockCount() const { return blocks.size(); }
+	//clamping happens as the last block writes its spans back
+	void run(Layer* l, const std::vector<Selection*>& s, bool clamp = false) const;
+};
@@ -0,0 +1,203 @@
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <thread>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
+#include "ReplayCache.h"
+#include "Image.h"
+#include "Formatter.h"
+#include "Operation.h"
+#include "Program.h"
+#include "Exceptions.h"
+
+static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+static const unsigned long long FNV_PRIME = 1099511628211ULL;
+
+static unsigned long long hashBytes(unsigned long long hash, const void* data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * FNV_PRIME;
+	return hash;
+}
+
+static unsigned long long hashInt(unsigned long long hash, long long value)
+{
+	return hashBytes(hash, &value, sizeof(value));
+}
+
+static unsigned long long hashString(unsigned long long hash, const std::string& value)
+{
+	hash = hashInt(hash, value.size());
+	return hashBytes(hash, value.data(), value.size());
+}
+
+ReplayCache & ReplayCache::getCache()
+{
+	static ReplayCache cache;
+	return cache;
+}
+
+std::string ReplayCache::getDirectory()
+{
+	std::lock_guard<std::mutex> guard(lock);
+	return directory;
+}
+
+void ReplayCache::setDirectory(const std::string & directory)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	this->directory = directory;
+	if (directory.empty()) return;
+
+	char last = directory.back();
+	if (last != '/' && last != '\\') this->directory += '/';
+#ifdef _WIN32
+	_mkdir(directory.c_str());
+#else
+	mkdir(directory.c_str(), 0777);
+#endif
+	struct stat info;
+	if (stat(directory.c_str(), &info) != 0 || !(info.st_mode & S_IFDIR)) {
+		this->directory.clear();
+		throw BadPathException("Replay cache directory can't be created");
+	}
+}
+
+unsigned long long ReplayCache::hashSource(const std::string & path, int width, int height)
+{
+	//layers without a source start out blank, only their size matters
+	unsigned long long hash = FNV_OFFSET;
+	if (path.empty()) {
+		hash = hashInt(hash, width);
+		return hashInt(hash, height);
+	}
+
+	std::ifstream FILE(path, std::ifstream::binary | std::ifstream::in);
+	if (!FILE.is_open()) return 0;
+	hash = hashString(hash, "source");
+	char buffer[1 << 16];
+	while (FILE) {
+		FILE.read(buffer, sizeof(buffer));
+		hash = hashBytes(hash, buffer, FILE.gcount());
+	}
+	return hash;
+}
+
+unsigned long long ReplayCache::hashOperation(unsigned long long key, const Operation * o, const std::vector<Selection*>& selections)
+{
+	//params are hashed as raw doubles so values that print the same still differ
+	//fast pow and log round differently, their results never stand in for exact ones
+	key = hashInt(key, Program::getAccuracy());
+	key = hashString(key, o->getName());
+	const CompositeOperation *composite = dynamic_cast<const CompositeOperation*>(o);
+	if (composite) {
+		key = hashInt(key, composite->getOperations().size());
+		for (const Operation *child : composite->getOperations())
+			key = hashOperation(key, child, std::vector<Selection*>());
+	}
+	else {
+		std::vector<double> params = o->getParams();
+		key = hashInt(key, params.size());
+		key = hashBytes(key, params.data(), params.size() * sizeof(double));
+	}
+
+	key = hashInt(key, selections.size());
+	for (Selection *s : selections) {
+		std::vector<Rectangle> rects(s->begin(), s->end());
+		key = hashInt(key, rects.size());
+		for (const Rectangle& r : rects) {
+			key = hashInt(key, r.getX());
+			key = hashInt(key, r.getY());
+			key = hashInt(key, r.getWidth());
+			key = hashInt(key, r.getHeight());
+		}
+	}
+	return key;
+}
+
+std::string ReplayCache::getFile(unsigned long long key) const
+{
+	char name[17];
+	std::snprintf(name, sizeof(name), "%016llx", key);
+	return directory + name + ".png";
+}
+
+Layer * ReplayCache::lookup(unsigned long long key, const std::string & path) const
+{
+	std::ifstream FILE(getFile(key), std::ifstream::binary | std::ifstream::in);
+	if (!FILE.is_open()) return nullptr;
+
+	std::vector<unsigned char> data((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+	FILE.close();
+	//a damaged entry is just a miss
+	try {
+		return PNGFormatter::decode(data.data(), data.size(), path);
+	}
+	catch (Exception&) {
+		return nullptr;
+	}
+}
+
+void ReplayCache::store(unsigned long long key, const Layer & l) const
+{
+	if (l.getWidth() == 0 || l.getHeight() == 0) return;
+	std::vector<unsigned char> data = PNGFormatter::encode(l, Deflate::FAST);
+
+	//written under a temporary name so readers never see half a file
+	std::string file = getFile(key);
+	std::string temporary = file + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+	std::ofstream FILE(temporary, std::ofstream::binary | std::ofstream::out);
+	if (!FILE.is_open()) return;
+	FILE.write((const char*)data.data(), data.size());
+	FILE.close();
+	if (std::rename(temporary.c_str(), file.c_str()) != 0) std::remove(temporary.c_str());
+}
+
+Layer * ReplayCache::replay(const std::string & path, int width, int height, const std::vector<Operation*>& operations, const std::vector<std::vector<Selection*>>& selections)
+{
+	std::string directory = getDirectory();
+	unsigned long long source = directory.empty() ? 0 : hashSource(path, width, height);
+
+	//without a cache, or without a readable source, replay everything
+	if (source == 0) {
+		Layer *l = path != "" ? Image::importLayer(path) : new Layer(width, height);
+		if (l) {
+			for (size_t i = 0; i < operations.size(); i++)
+				l->apply(operations[i], selections[i]);
+		}
+		return l;
+	}
+
+	std::vector<unsigned long long> keys(1, source);
+	for (size_t i = 0; i < operations.size(); i++)
+		keys.push_back(hashOperation(keys.back(), operations[i], selections[i]));
+
+	//longest prefix that is already on disk
+	Layer *l = nullptr;
+	size_t done = keys.size();
+	while (!l && done > 0) {
+		done--;
+		l = lookup(keys[done], path);
+	}
+
+	if (!l) {
+		done = 0;
+		l = path != "" ? Image::importLayer(path) : new Layer(width, height);
+		if (!l) return nullptr;
+	}
+
+	for (size_t i = 0; i < done; i++)
+		l->addOperation(operations[i], selections[i]);
+	for (size_t i = done; i < operations.size(); i++) {
+		l->apply(operations[i], selections[i]);
+		if (i + 1 == operations.size() || (i + 1) % interval == 0) {
+			l->evaluate();
+			store(keys[i + 1], *l);
+		}
+	}
+	return l;
+}
@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <mutex>
+#include "Layer.h"
+
+class Operation;
+
+//layer pixels on disk keyed by the source file contents and the operations applied to it,
+//so histories sharing a prefix only replay the part that differs
+class ReplayCache {
+private:
+	std::string directory;
+	int interval;
+	std::mutex lock;
+
+	ReplayCache() : interval(8) {}
+
+	std::string getFile(unsigned long long key) const;
+	Layer* lookup(unsigned long long key, const std::string& path) const;
+	void store(unsigned long long key, const Layer& l) const;
+public:
+	static ReplayCache& getCache();
+
+	//an empty directory turns the cache off
+	std::string getDirectory();
+	void setDirectory(const std::string& directory);
+	//besides the final state, every interval-th prefix is stored as well
+	int getInterval() const { return interval; }
+	void setInterval(int interval) { this->interval = interval > 0 ? interval : 1; }
+
+	static unsigned long long hashSource(const std::string& path, int width, int height);
+	static unsigned long long hashOperation(unsigned long long key, const Operation* o, const std::vector<Selection*>& selections);
+
+	//rebuilds a layer from its source and history, null if the source can't be read
+	Layer* replay(const std::string& path, int width, int height, const std::vector<Operation*>& operations, const std::vector<std::vector<Selection*>>& selections);
+};
@@ -23,6 +23,7 @@ public:
 			r.clamp(width, height);
 		}
 	}
+	const std::vector<Rectangle>& getRectangles() const { return rectangles; }
 	auto begin() { return rectangles.begin(); }
 	auto end() { return rectangles.end(); }
 
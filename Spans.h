@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "Selection.h"
+
+//runs of selected pixels in a row, handed to f(begin, end) left to right
+//loops are instantiated once per kind, so the common cases don't test every pixel
+
+//no selections means the whole row
+class AllPixels {
+public:
+	template<class F>
+	void forEach(int, int width, F f) const {
+		if (width > 0) f(0, width);
+	}
+};
+
+//selections are unions of rectangles, so a row's runs follow from the rectangle edges
+class RectangleSpans {
+private:
+	std::vector<Rectangle> rectangles;
+public:
+	RectangleSpans(const std::vector<Selection*>& selections) {
+		for (Selection *s : selections)
+			for (const Rectangle& r : *s)
+				if (r.getWidth() > 0 && r.getHeight() > 0) rectangles.push_back(r);
+		std::sort(rectangles.begin(), rectangles.end(), [](const Rectangle& a, const Rectangle& b) { return a.getX() < b.getX(); });
+	}
+
+	template<class F>
+	void forEach(int y, int width, F f) const {
+		int begin = 0, end = 0;
+		for (const Rectangle& r : rectangles) {
+			if (y > r.getY() || y <= r.getY() - r.getHeight()) continue;
+			int left = std::max(r.getX(), 0), right = std::min(r.getX() + r.getWidth(), width);
+			if (left >= right) continue;
+			//sorted by x, so a gap means the current run is complete
+			if (left > end) {
+				if (begin < end) f(begin, end);
+				begin = left;
+			}
+			end = std::max(end, right);
+		}
+		if (begin < end) f(begin, end);
+	}
+};
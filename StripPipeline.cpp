@@ -0,0 +1,181 @@
+#include <cstdio>
+#include <thread>
+#include <memory>
+#include <exception>
+#include "StripPipeline.h"
+#include "BoundedQueue.h"
+#include "Formatter.h"
+#include "Image.h"
+#include "Operation.h"
+#include "Program.h"
+#include "Exceptions.h"
+
+int StripPipeline::stripRows = 64;
+
+namespace {
+
+	//basic operations that lower run as one program, anything else on its own
+	struct Stage {
+		Program program;
+		const Operation *fallback;
+		int reach;
+		//rows below this already went through the stage
+		int done;
+	};
+
+	struct Strip {
+		int first;
+		std::vector<std::vector<Pixel>> rows;
+	};
+
+}
+
+bool StripPipeline::run(const std::string & input, const std::string & output, const CompositeOperation & o)
+{
+	ImageFormatter *readerFormat = ImageFormatter::getReader(input);
+	ImageFormatter *writerFormat = ImageFormatter::getWriter(output);
+	if (!readerFormat || !writerFormat) return false;
+
+	std::vector<Stage> stages;
+	std::vector<Operation*> straight;
+	auto flush = [&]() {
+		if (straight.empty()) return;
+		stages.push_back(Stage{ Program::compile(straight), nullptr, 0, 0 });
+		straight.clear();
+	};
+	for (Operation *op : o.getPlan()) {
+		Program probe;
+		if (op->lower(probe)) {
+			straight.push_back(op);
+			continue;
+		}
+		if (op->reach() < 0) return false;
+		flush();
+		stages.push_back(Stage{ Program(), op, op->reach(), 0 });
+	}
+	flush();
+
+	std::unique_ptr<StripReader> reader(readerFormat->openStrips(input));
+	if (!reader) return false;
+	int width = reader->getWidth();
+	int height = reader->getHeight();
+
+	//the input may be the output, the result replaces it only once it is complete
+	std::string temporary = output + ".tmp";
+	std::unique_ptr<StripWriter> writer(writerFormat->createStrips(temporary, width, height));
+	if (!writer) return false;
+
+	BoundedQueue<Strip> decoded(2), encoded(2);
+	std::exception_ptr readError, writeError;
+	int rows = stripRows;
+
+	std::thread readThread([&]() {
+		try {
+			for (int first = 0; first < height; first += rows) {
+				Strip s{ first, std::vector<std::vector<Pixel>>(first + rows < height ? rows : height - first) };
+				reader->read(first, s.rows);
+				if (!decoded.push(std::move(s))) break;
+			}
+		}
+		catch (...) {
+			readError = std::current_exception();
+		}
+		decoded.close();
+	});
+	std::thread writeThread([&]() {
+		try {
+			Strip s;
+			while (encoded.pop(s))
+				writer->write(s.first, s.rows);
+			writer->close();
+		}
+		catch (...) {
+			writeError = std::current_exception();
+			encoded.close();
+		}
+	});
+
+	std::exception_ptr computeError;
+	try {
+		//rows [base, available) of the image, the pixels are handed back and forth without copies
+		Layer window(std::make_shared<Layer::Pixels>());
+		int base = 0, available = 0, emitted = 0;
+		Strip s;
+		while (decoded.pop(s)) {
+			{
+				std::shared_ptr<Layer::Pixels> pixels = window.share();
+				for (std::vector<Pixel>& row : s.rows) pixels->push_back(std::move(row));
+			}
+			available += s.rows.size();
+
+			//a stage only gets rows whose neighbours are final for it and no longer needed by the one before it
+			int ready = available;
+			int previousReach = 0;
+			for (Stage& stage : stages) {
+				int limit = ready;
+				if (ready < height) {
+					limit -= stage.reach > previousReach ? stage.reach : previousReach;
+				}
+				if (limit > stage.done) {
+					std::vector<Rectangle> rects(1, Rectangle(0, limit - 1 - base, width, limit - stage.done));
+					Selection selection(rects);
+					std::vector<Selection*> selections(1, &selection);
+					if (stage.fallback) stage.fallback->operateLayer(&window, selections);
+					else stage.program.run(&window, selections);
+					stage.done = limit;
+				}
+				ready = stage.done;
+				previousReach = stage.reach;
+			}
+
+			//finished rows are clamped and composited alone, the same as exporting the whole layer
+			if (ready > emitted) {
+				std::shared_ptr<Layer::Pixels> strip = std::make_shared<Layer::Pixels>(ready - emitted);
+				for (int y = emitted; y < ready; y++) {
+					std::vector<Pixel>& row = (*strip)[y - emitted];
+					row = static_cast<const Layer&>(window)[y - base];
+					for (Pixel& p : row) p.clamp();
+				}
+				Layer stripLayer(strip);
+				std::vector<Layer*> layers(1, &stripLayer);
+				Layer *flattened = Image::flattenLayers(layers, Rectangle(0, ready - emitted - 1, width, ready - emitted));
+				Strip out{ emitted, std::move(*flattened->share()) };
+				delete flattened;
+				emitted = ready;
+				if (!encoded.push(std::move(out))) break;
+			}
+
+			int keep = emitted;
+			for (const Stage& stage : stages) {
+				if (stage.done - stage.reach < keep) keep = stage.done - stage.reach;
+			}
+			if (keep > base) {
+				std::shared_ptr<Layer::Pixels> pixels = window.share();
+				pixels->erase(pixels->begin(), pixels->begin() + (keep - base));
+				base = keep;
+			}
+		}
+	}
+	catch (...) {
+		computeError = std::current_exception();
+	}
+	decoded.close();
+	encoded.close();
+	readThread.join();
+	writeThread.join();
+	writer.reset();
+
+	std::exception_ptr error = readError ? readError : (computeError ? computeError : writeError);
+	if (error) {
+		std::remove(temporary.c_str());
+		std::rethrow_exception(error);
+	}
+#ifdef _WIN32
+	std::remove(output.c_str());
+#endif
+	if (std::rename(temporary.c_str(), output.c_str()) != 0) {
+		std::remove(temporary.c_str());
+		throw BadPathException("File can't be opened for writing");
+	}
+	return true;
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+
+class CompositeOperation;
+
+//runs an operation over an image a strip of rows at a time, decoding, operating and encoding overlap
+//memory stays around a few strips however large the image is
+class StripPipeline {
+private:
+	static int stripRows;
+public:
+	static int getStripRows() { return stripRows; }
+	static void setStripRows(int rows) { stripRows = rows > 0 ? rows : 1; }
+
+	//false without touching anything if the formats or the operation can't be streamed
+	static bool run(const std::string& input, const std::string& output, const CompositeOperation& o);
+};
@@ -0,0 +1,119 @@
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cstdio>
+#include "Test.h"
+#include "../Batch.h"
+#include "../Formatter.h"
+#include "../Image.h"
+#include "../Operation.h"
+
+static const char *RECIPE = "batch_test.fun";
+
+static void writeSample(const std::string& path)
+{
+	Layer l(4, 3);
+	for (int y = 0; y < 3; y++)
+		for (int x = 0; x < 4; x++)
+			l[y][x] = Pixel(x * 60, y * 80, 100, 255);
+	ImageFormatter::getWriter(path)->write(l, path);
+}
+
+static void writeRecipe()
+{
+	Add add(10, 20, 30);
+	CompositeOperation o("batch");
+	o.addOperation(&add);
+	FUNFormatter().save(&o, RECIPE);
+}
+
+static void removeRecipe()
+{
+	std::remove(RECIPE);
+	std::remove(FUNFormatter::getCompiledPath(RECIPE).c_str());
+}
+
+static bool exists(const std::string& path)
+{
+	return std::ifstream(path).is_open();
+}
+
+//the run's exit status, with the report lines it printed
+static int runBatch(const std::vector<std::string>& args, std::string& report)
+{
+	std::ostringstream out, err;
+	std::streambuf *previousOut = std::cout.rdbuf(out.rdbuf()), *previousErr = std::cerr.rdbuf(err.rdbuf());
+	int status = Batch::run(args);
+	std::cout.rdbuf(previousOut);
+	std::cerr.rdbuf(previousErr);
+	report = out.str();
+	return status;
+}
+
+TEST(batchOutputPathKeepsNameInDirectory)
+{
+	CHECK(Batch::outputPath("in/photo.bmp", "out", "") == "out/photo.bmp");
+	CHECK(Batch::outputPath("in/photo.bmp", "out/", "png") == "out/photo.png");
+	CHECK(Batch::outputPath("in\\photo.bmp", "out\\", "ppm") == "out\\photo.ppm");
+	CHECK(Batch::outputPath("photo", "out", "pgm") == "out/photo.pgm");
+	CHECK(Batch::outputPath("a.b/photo", "out", "") == "out/photo");
+}
+
+TEST(batchExitsWithZeroWhenEveryFileGoesThrough)
+{
+	writeRecipe();
+	writeSample("batch_ok.bmp");
+	std::string report;
+	CHECK(runBatch({ "--format", "ppm", RECIPE, ".", "batch_ok.bmp" }, report) == 0);
+	CHECK(report.compare(0, 3, "ok\t") == 0);
+	CHECK(exists("batch_ok.ppm"));
+	std::remove("batch_ok.bmp");
+	std::remove("batch_ok.ppm");
+	removeRecipe();
+}
+
+TEST(batchRejectsOutputReplacingTheInput)
+{
+	writeRecipe();
+	writeSample("batch_same.bmp");
+	std::ifstream FILE("batch_same.bmp", std::ifstream::binary);
+	std::string before((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+	FILE.close();
+	std::string report;
+	CHECK(runBatch({ RECIPE, ".", "batch_same.bmp" }, report) == 1);
+	CHECK(report == "error\tbatch_same.bmp\tOutput would replace the input\n");
+	FILE.open("batch_same.bmp", std::ifstream::binary);
+	CHECK(std::string((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>()) == before);
+	FILE.close();
+	std::remove("batch_same.bmp");
+	removeRecipe();
+}
+
+TEST(batchRejectsSecondInputWithTheSameOutput)
+{
+	writeRecipe();
+	writeSample("batch_twice.bmp");
+	writeSample("batch_twice.ppm");
+	std::string report;
+	CHECK(runBatch({ "--format", "pgm", RECIPE, ".", "batch_twice.bmp", "./batch_twice.ppm" }, report) == 1);
+	//the first input keeps the name however the second spells it
+	CHECK(report.find("ok\tbatch_twice.bmp\t") != std::string::npos);
+	CHECK(report.find("error\t./batch_twice.ppm\tSame output as an earlier input\n") != std::string::npos);
+	std::remove("batch_twice.bmp");
+	std::remove("batch_twice.ppm");
+	std::remove("batch_twice.pgm");
+	removeRecipe();
+}
+
+TEST(batchExitsWithTwoWhenNothingCanStart)
+{
+	writeRecipe();
+	std::string report;
+	CHECK(runBatch({ "--colour", "red", RECIPE, ".", "x.bmp" }, report) == 2);
+	CHECK(runBatch({ "--workers", "many", RECIPE, ".", "x.bmp" }, report) == 2);
+	CHECK(runBatch({ RECIPE }, report) == 2);
+	CHECK(runBatch({ "batch_missing.fun", ".", "x.bmp" }, report) == 2);
+	CHECK(runBatch({ RECIPE, "batch_missing/nested", "x.bmp" }, report) == 2);
+	CHECK(report.empty());
+	removeRecipe();
+}
@@ -0,0 +1,130 @@
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include "Test.h"
+#include "../Formatter.h"
+#include "../Image.h"
+#include "../Exceptions.h"
+
+static const char *PATH = "drb_test.drb";
+
+static void writeFile(const std::vector<unsigned char>& bytes)
+{
+	std::ofstream FILE(PATH, std::ofstream::binary);
+	FILE.write((const char*)bytes.data(), bytes.size());
+}
+
+static std::vector<unsigned char> readFile()
+{
+	std::ifstream FILE(PATH, std::ifstream::binary);
+	return std::vector<unsigned char>((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+}
+
+static void u32(std::vector<unsigned char>& bytes, unsigned value)
+{
+	for (int i = 0; i < 32; i += 8) bytes.push_back(value >> i & 0xFF);
+}
+
+static void u64(std::vector<unsigned char>& bytes, unsigned long long value)
+{
+	u32(bytes, (unsigned)value);
+	u32(bytes, (unsigned)(value >> 32));
+}
+
+static std::vector<unsigned char> header(int width, int height, unsigned chunks)
+{
+	std::vector<unsigned char> bytes = { 0x89, 'D', 'R', 'B', '\r', '\n', 0x1a, '\n' };
+	u32(bytes, 1);
+	u32(bytes, width);
+	u32(bytes, height);
+	u32(bytes, chunks);
+	return bytes;
+}
+
+//layer table entry for a group whose members are in chunk group
+static void groupEntry(std::vector<unsigned char>& bytes, int group)
+{
+	u32(bytes, group);
+	u32(bytes, (unsigned)-1);
+	bytes.insert(bytes.end(), { 1, 1, 100, 2 });
+}
+
+TEST(drbRoundTripsAndRejectsTruncatedFiles)
+{
+	Image *image = Image::getImage();
+	Layer *l = new Layer(5, 4);
+	(*l)[1][2] = Pixel(10, 20, 30, 255);
+	image->addLayer(l);
+	DRBFormatter().save(PATH);
+	Image::deleteImage();
+
+	Layer *loaded = DRBFormatter::loadLayer(PATH, 0);
+	CHECK(loaded->getWidth() == 5 && loaded->getHeight() == 4);
+	CHECK((*loaded)[1][2].getB() == 30);
+	delete loaded;
+
+	std::vector<unsigned char> whole = readFile();
+	for (size_t size : { (size_t)0, (size_t)12, (size_t)30, whole.size() / 2, whole.size() - 1 }) {
+		writeFile(std::vector<unsigned char>(whole.begin(), whole.begin() + size));
+		CHECK_THROWS(delete DRBFormatter::loadLayer(PATH, 0), BadFormatException);
+	}
+	std::remove(PATH);
+}
+
+TEST(drbRejectsImpossibleHeaders)
+{
+	std::vector<unsigned char> bytes = header(10, 10, 0xFFFFFFFF);
+	writeFile(bytes);
+	CHECK_THROWS(DRBFormatter::getLayerCount(PATH), BadFormatException);
+
+	writeFile(header(-1, 10, 0));
+	CHECK_THROWS(DRBFormatter::getLayerCount(PATH), BadFormatException);
+	std::remove(PATH);
+}
+
+TEST(drbRejectsGroupsContainingThemselves)
+{
+	//LTAB holds one group in chunk 1, whose only member is chunk 1 again
+	std::vector<unsigned char> bytes = header(2, 2, 2);
+	size_t offset = bytes.size() + 2 * 20;
+	bytes.insert(bytes.end(), { 'L', 'T', 'A', 'B' });
+	u64(bytes, offset);
+	u64(bytes, 16);
+	bytes.insert(bytes.end(), { 'G', 'R', 'U', 'P' });
+	u64(bytes, offset + 16);
+	u64(bytes, 16);
+	u32(bytes, 1);
+	groupEntry(bytes, 1);
+	u32(bytes, 1);
+	groupEntry(bytes, 1);
+	writeFile(bytes);
+	CHECK(DRBFormatter::getLayerCount(PATH) == 1);
+	CHECK_THROWS(delete DRBFormatter::loadLayer(PATH, 0), BadFormatException);
+	std::remove(PATH);
+}
+
+TEST(drbRejectsGroupsNestedTooDeep)
+{
+	//every group holds the next one, far past any real project
+	const int groups = 200;
+	std::vector<unsigned char> bytes = header(2, 2, groups + 1);
+	size_t offset = bytes.size() + (groups + 1) * 20;
+	bytes.insert(bytes.end(), { 'L', 'T', 'A', 'B' });
+	u64(bytes, offset);
+	u64(bytes, 16);
+	for (int i = 0; i < groups; i++) {
+		bytes.insert(bytes.end(), { 'G', 'R', 'U', 'P' });
+		u64(bytes, offset + 16 * (i + 1));
+		u64(bytes, i + 1 < groups ? 16 : 4);
+	}
+	u32(bytes, 1);
+	groupEntry(bytes, 1);
+	for (int i = 1; i < groups; i++) {
+		u32(bytes, 1);
+		groupEntry(bytes, i + 1);
+	}
+	u32(bytes, 0);
+	writeFile(bytes);
+	CHECK_THROWS(delete DRBFormatter::loadLayer(PATH, 0), BadFormatException);
+	std::remove(PATH);
+}
@@ -0,0 +1,255 @@
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <map>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
+#include "Test.h"
+#include "../Daemon.h"
+#include "../Batch.h"
+#include "../Formatter.h"
+#include "../Image.h"
+#include "../Operation.h"
+
+static const std::string ROOT = "daemon_test";
+
+static void makeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0777);
+#endif
+}
+
+//false if it isn't there or isn't empty
+static bool removeDirectory(const std::string& path)
+{
+#ifdef _WIN32
+	return _rmdir(path.c_str()) == 0;
+#else
+	return rmdir(path.c_str()) == 0;
+#endif
+}
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary);
+	return std::string((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+}
+
+static void writeSample(const std::string& path)
+{
+	Layer l(7, 5);
+	for (int y = 0; y < 5; y++)
+		for (int x = 0; x < 7; x++)
+			l[y][x] = Pixel(x * 30, y * 50, (x * y * 11) % 256, 255);
+	ImageFormatter::getWriter(path)->write(l, path);
+}
+
+static CompositeOperation* recipe(int amount)
+{
+	Add add(amount, 2 * amount, 3 * amount);
+	Median median;
+	CompositeOperation *o = new CompositeOperation("daemon");
+	o->addOperation(&add);
+	o->addOperation(&median);
+	return o;
+}
+
+static void writeRecipe(int amount)
+{
+	CompositeOperation *o = recipe(amount);
+	std::string path = ROOT + "/recipes/r.fun";
+	FUNFormatter().save(o, path);
+	delete o;
+}
+
+//what the recipe gives for the input, written straight by the formatter
+static std::string expected(const std::string& input, int amount, const std::string& format)
+{
+	CompositeOperation *o = recipe(amount);
+	Layer *l = ImageFormatter::getReader(input)->load(input);
+	o->operateLayer(l, {}, true);
+	std::string path = ROOT + "/expected." + format;
+	ImageFormatter::getWriter(path)->write(*l, path);
+	delete l;
+	delete o;
+	std::string result = readFile(path);
+	std::remove(path.c_str());
+	return result;
+}
+
+//recipes, work and inputs directories, with a sample inside the inputs and one next to them
+static void setUp()
+{
+	makeDirectory(ROOT);
+	makeDirectory(ROOT + "/recipes");
+	makeDirectory(ROOT + "/work");
+	makeDirectory(ROOT + "/inputs");
+	makeDirectory(ROOT + "/inputs2");
+	writeRecipe(10);
+	writeSample(ROOT + "/inputs/in.bmp");
+	writeSample(ROOT + "/inputs2/in.bmp");
+	writeSample(ROOT + "/outside.bmp");
+#ifndef _WIN32
+	symlink("../outside.bmp", (ROOT + "/inputs/link.bmp").c_str());
+#endif
+}
+
+static void tearDown()
+{
+	for (const char *file : { "/recipes/r.fun", "/inputs/in.bmp", "/inputs/link.bmp", "/inputs2/in.bmp", "/outside.bmp" })
+		std::remove((ROOT + file).c_str());
+	std::remove(FUNFormatter::getCompiledPath(ROOT + "/recipes/r.fun").c_str());
+	for (const char *directory : { "/recipes", "/work", "/inputs", "/inputs2", "" })
+		removeDirectory(ROOT + directory);
+}
+
+static Daemon* makeDaemon()
+{
+	return new Daemon(ROOT + "/recipes", ROOT + "/work", Batch::canonicalPath(ROOT + "/inputs"));
+}
+
+//"ok" followed by the result, or the error message, for every id answered
+static std::map<std::string, std::string> serve(Daemon& daemon, const std::string& jobs)
+{
+	std::istringstream in(jobs);
+	std::ostringstream out;
+	daemon.serve(in, out, "", 2, 4);
+
+	std::map<std::string, std::string> replies;
+	std::istringstream reader(out.str());
+	std::string line;
+	while (std::getline(reader, line)) {
+		std::istringstream header(line);
+		std::string id, status;
+		header >> id >> status;
+		if (status == "ok") {
+			size_t length;
+			header >> length;
+			std::string result(length, '\0');
+			reader.read(&result[0], length);
+			replies[id] = "ok" + result;
+		}
+		else {
+			std::string message;
+			std::getline(header >> std::ws, message);
+			replies[id] = message;
+		}
+	}
+	return replies;
+}
+
+//no temporary file outlives its job
+static bool workIsEmpty()
+{
+	bool empty = removeDirectory(ROOT + "/work");
+	makeDirectory(ROOT + "/work");
+	return empty;
+}
+
+TEST(daemonAnswersPathAndBytesJobs)
+{
+	setUp();
+	Daemon *daemon = makeDaemon();
+	std::string image = readFile(ROOT + "/inputs/in.bmp");
+	std::map<std::string, std::string> replies = serve(*daemon,
+		"1 r bmp path " + ROOT + "/inputs/in.bmp\n"
+		"2 r ppm bytes " + std::to_string(image.size()) + "\n" + image +
+		"3 r pam path " + ROOT + "/inputs/missing.bmp\n"
+		"\n"
+		"4 r png bytes 5\r\nnope!");
+	CHECK(replies.size() == 4);
+	CHECK(replies["1"] == "ok" + expected(ROOT + "/inputs/in.bmp", 10, "bmp"));
+	CHECK(replies["2"] == "ok" + expected(ROOT + "/inputs/in.bmp", 10, "ppm"));
+	CHECK(replies["3"] == "Input doesn't exist");
+	CHECK(replies["4"].compare(0, 2, "ok") != 0);
+	CHECK(workIsEmpty());
+	delete daemon;
+	tearDown();
+}
+
+TEST(daemonRejectsBadHeaders)
+{
+	setUp();
+	Daemon *daemon = makeDaemon();
+	std::map<std::string, std::string> replies = serve(*daemon,
+		"garbage\n"
+		"1 r bmp copy " + ROOT + "/inputs/in.bmp\n"
+		"2 r bmp path\n"
+		"3 ../r bmp path " + ROOT + "/inputs/in.bmp\n"
+		"4 missing bmp path " + ROOT + "/inputs/in.bmp\n"
+		"5 r nope path " + ROOT + "/inputs/in.bmp\n"
+		"6 r bmp bytes many\n"
+		"7 r bmp path " + ROOT + "/inputs/in.bmp\n");
+	CHECK(replies["garbage"] == "Invalid job");
+	CHECK(replies["1"] == "Invalid job");
+	CHECK(replies["2"] == "Missing input");
+	CHECK(replies["3"] == "Invalid recipe name");
+	CHECK(replies["4"] == "Recipe doesn't exist");
+	CHECK(replies["5"] == "Format doesn't exist");
+	//after a bad length nothing more can be read from the stream
+	CHECK(replies["6"] == "Invalid inline image");
+	CHECK(replies.find("7") == replies.end());
+	delete daemon;
+	tearDown();
+}
+
+TEST(daemonRejectsOversizeOrShortInlineImage)
+{
+	setUp();
+	Daemon *daemon = makeDaemon();
+	std::map<std::string, std::string> replies = serve(*daemon,
+		"1 r bmp bytes 2000000000\n"
+		"2 r bmp path " + ROOT + "/inputs/in.bmp\n");
+	CHECK(replies.size() == 1 && replies["1"] == "Invalid inline image");
+
+	replies = serve(*daemon, "1 r bmp bytes 100\nshort");
+	CHECK(replies.size() == 1 && replies["1"] == "Invalid inline image");
+	CHECK(workIsEmpty());
+	delete daemon;
+	tearDown();
+}
+
+TEST(daemonKeepsPathJobsInsideInputs)
+{
+	setUp();
+	Daemon *daemon = makeDaemon();
+	std::map<std::string, std::string> replies = serve(*daemon,
+		"1 r bmp path " + ROOT + "/outside.bmp\n"
+		"2 r bmp path " + ROOT + "/inputs/../outside.bmp\n"
+		"3 r bmp path " + ROOT + "/inputs2/in.bmp\n"
+		"4 r bmp path " + ROOT + "/inputs/link.bmp\n"
+		"5 r bmp path " + ROOT + "/inputs/./in.bmp\n");
+	CHECK(replies["1"] == "Input is outside the input directory");
+	CHECK(replies["2"] == "Input is outside the input directory");
+	//a sibling sharing the directory's name as a prefix is still outside
+	CHECK(replies["3"] == "Input is outside the input directory");
+#ifndef _WIN32
+	CHECK(replies["4"] == "Input is outside the input directory");
+#endif
+	CHECK(replies["5"] == "ok" + expected(ROOT + "/inputs/in.bmp", 10, "bmp"));
+	delete daemon;
+	tearDown();
+}
+
+TEST(daemonReloadsChangedRecipe)
+{
+	setUp();
+	Daemon *daemon = makeDaemon();
+	std::string job = "1 r bmp path " + ROOT + "/inputs/in.bmp\n";
+	CHECK(serve(*daemon, job)["1"] == "ok" + expected(ROOT + "/inputs/in.bmp", 10, "bmp"));
+	//same size and most likely the same second as the first version
+	writeRecipe(20);
+	CHECK(serve(*daemon, job)["1"] == "ok" + expected(ROOT + "/inputs/in.bmp", 20, "bmp"));
+	CHECK(serve(*daemon, job)["1"] == "ok" + expected(ROOT + "/inputs/in.bmp", 20, "bmp"));
+	delete daemon;
+	tearDown();
+}
@@ -0,0 +1,110 @@
+#include <random>
+#include "Test.h"
+#include "../Deflate.h"
+#include "../Formatter.h"
+#include "../Layer.h"
+#include "../Exceptions.h"
+
+static std::vector<unsigned char> randomBytes(size_t size, int range, unsigned seed)
+{
+	std::mt19937 random(seed);
+	std::vector<unsigned char> data(size);
+	for (unsigned char& c : data) c = random() % range;
+	return data;
+}
+
+static void checkRoundTrip(const std::vector<unsigned char>& data)
+{
+	for (Deflate::Level level : { Deflate::STORE, Deflate::FAST }) {
+		std::vector<unsigned char> compressed = Deflate::zlibCompress(data.data(), data.size(), level);
+		CHECK(Deflate::zlibDecompress(compressed.data(), compressed.size()) == data);
+	}
+}
+
+TEST(deflateRoundTripsEmptyInput)
+{
+	checkRoundTrip(std::vector<unsigned char>());
+}
+
+TEST(deflateRoundTripsRandomInput)
+{
+	checkRoundTrip(randomBytes(1000, 256, 1));
+}
+
+TEST(deflateRoundTripsRepetitiveInputAcrossPieces)
+{
+	//several parallel pieces, matches reaching back into the previous one
+	checkRoundTrip(randomBytes(600 * 1024, 4, 2));
+}
+
+TEST(deflateCompressesRepetitiveInput)
+{
+	std::vector<unsigned char> data(100000, 7);
+	CHECK(Deflate::zlibCompress(data.data(), data.size(), Deflate::FAST).size() < data.size() / 10);
+}
+
+TEST(inflateRejectsOutputPastLimit)
+{
+	std::vector<unsigned char> data(5000, 1);
+	std::vector<unsigned char> compressed = Deflate::zlibCompress(data.data(), data.size(), Deflate::FAST);
+	CHECK(Deflate::zlibDecompress(compressed.data(), compressed.size(), 0, data.size()).size() == data.size());
+	CHECK_THROWS(Deflate::zlibDecompress(compressed.data(), compressed.size(), 0, data.size() - 1), BadFormatException);
+}
+
+TEST(inflateRejectsCorruptedChecksum)
+{
+	std::vector<unsigned char> data = randomBytes(1000, 16, 3);
+	std::vector<unsigned char> compressed = Deflate::zlibCompress(data.data(), data.size(), Deflate::FAST);
+	compressed.back() ^= 1;
+	CHECK_THROWS(Deflate::zlibDecompress(compressed.data(), compressed.size()), BadFormatException);
+}
+
+TEST(pngRoundTripsPixels)
+{
+	std::mt19937 random(4);
+	Layer l(37, 23);
+	for (int y = 0; y < l.getHeight(); y++)
+		for (Pixel& p : l[y]) p = Pixel(random() % 256, random() % 256, random() % 256, random() % 256);
+
+	for (Deflate::Level level : { Deflate::STORE, Deflate::FAST }) {
+		std::vector<unsigned char> png = PNGFormatter::encode(l, level);
+		Layer *decoded = PNGFormatter::decode(png.data(), png.size());
+		bool same = decoded->getWidth() == l.getWidth() && decoded->getHeight() == l.getHeight();
+		for (int y = 0; same && y < l.getHeight(); y++)
+			for (int x = 0; x < l.getWidth(); x++) {
+				const Pixel &a = l[y][x], &b = (*decoded)[y][x];
+				same = same && a.getR() == b.getR() && a.getG() == b.getG() && a.getB() == b.getB() && a.getA() == b.getA();
+			}
+		delete decoded;
+		CHECK(same);
+	}
+}
+
+//a valid png with its header patched, the chunk crc is fixed up to match
+static std::vector<unsigned char> withHeader(unsigned width, unsigned height, int colorType)
+{
+	Layer l(2, 2);
+	std::vector<unsigned char> png = PNGFormatter::encode(l, Deflate::FAST);
+	unsigned char *header = &png[16];
+	for (int i = 0; i < 4; i++) {
+		header[i] = width >> (24 - 8 * i) & 0xFF;
+		header[4 + i] = height >> (24 - 8 * i) & 0xFF;
+	}
+	header[9] = colorType;
+	unsigned crc = Deflate::crc32(&png[12], 17);
+	for (int i = 0; i < 4; i++) png[29 + i] = crc >> (24 - 8 * i) & 0xFF;
+	return png;
+}
+
+TEST(pngRejectsDimensionsItsDataCantHold)
+{
+	std::vector<unsigned char> png = withHeader(0x7FFFFFFF, 0x7FFFFFFF, 6);
+	CHECK_THROWS(delete PNGFormatter::decode(png.data(), png.size()), BadFormatException);
+}
+
+TEST(pngRejectsMissingPalette)
+{
+	//palette image without a palette, every index is out of range
+	std::vector<unsigned char> png = withHeader(8, 2, 3);
+	CHECK_THROWS(delete PNGFormatter::decode(png.data(), png.size()), BadFormatException);
+}
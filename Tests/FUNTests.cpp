@@ -0,0 +1,94 @@
+#include <cstdio>
+#include "Test.h"
+#include "../Formatter.h"
+#include "../Operation.h"
+#include "../MappedFile.h"
+
+static const char *PATH = "fun_test.fun";
+
+static void removeRecipe()
+{
+	std::remove(PATH);
+	std::remove(FUNFormatter::getCompiledPath(PATH).c_str());
+}
+
+static CompositeOperation* nestedRecipe(double base, int alpha)
+{
+	//composites keep copies of what they're given
+	Log log(base, base, base);
+	Fill fill(1, 2, 3, alpha);
+	CompositeOperation inner("inner");
+	inner.addOperation(&log);
+	inner.addOperation(&fill);
+	CompositeOperation *outer = new CompositeOperation("outer");
+	outer->addOperation(&inner);
+	return outer;
+}
+
+TEST(funLoadKeepsNestedComposites)
+{
+	CompositeOperation *o = nestedRecipe(2, 255);
+	FUNFormatter().save(o, PATH);
+	delete o;
+	o = FUNFormatter().load(PATH);
+	CHECK(o->getName() == "outer");
+	CHECK(o->getOperations().size() == 1 && o->getOperations()[0]->getName() == "inner");
+	delete o;
+	removeRecipe();
+}
+
+TEST(funRunnableKeepsParamsSetParamsWouldReject)
+{
+	CompositeOperation *o = nestedRecipe(1, 300);
+	FUNFormatter().save(o, PATH);
+	delete o;
+	//once when compiling, once from the compiled file
+	for (int i = 0; i < 2; i++) {
+		o = FUNFormatter().loadRunnable(PATH);
+		const std::vector<Operation*>& operations = o->getOperations();
+		CHECK(operations.size() == 2);
+		CHECK(operations[0]->getParams() == std::vector<double>({ 1, 1, 1 }));
+		CHECK(operations[1]->getParams() == std::vector<double>({ 1, 2, 3, 300 }));
+		delete o;
+	}
+	removeRecipe();
+}
+
+TEST(funRunnableFollowsSourceContents)
+{
+	CompositeOperation *o = nestedRecipe(2, 10);
+	FUNFormatter().save(o, PATH);
+	delete o;
+	delete FUNFormatter().loadRunnable(PATH);
+	//same length, so only the contents tell the compiled copy is stale
+	o = nestedRecipe(3, 20);
+	FUNFormatter().save(o, PATH);
+	delete o;
+	o = FUNFormatter().loadRunnable(PATH);
+	CHECK(o->getOperations().size() == 2);
+	CHECK(o->getOperations()[0]->getParams() == std::vector<double>({ 3, 3, 3 }));
+	CHECK(o->getOperations()[1]->getParams() == std::vector<double>({ 1, 2, 3, 20 }));
+	delete o;
+	removeRecipe();
+}
+
+TEST(funRunnableKeepsCompiledCopyOfTouchedSource)
+{
+	CompositeOperation *o = nestedRecipe(2, 10);
+	FUNFormatter().save(o, PATH);
+	delete FUNFormatter().loadRunnable(PATH);
+	//same contents under a new time, the hash decides and the copy takes the new stamp
+	FUNFormatter().save(o, PATH);
+	delete o;
+	o = FUNFormatter().loadRunnable(PATH);
+	CHECK(o->getOperations().size() == 2);
+	delete o;
+
+	FileStamp stamp;
+	CHECK(FileStamp::get(PATH, stamp));
+	{
+		MappedFile compiled(FUNFormatter::getCompiledPath(PATH));
+		CHECK(FUNFormatter::readSource(compiled.getData(), compiled.getSize()).stamp == stamp);
+	}
+	removeRecipe();
+}
@@ -0,0 +1,125 @@
+#include <fstream>
+#include <cstdio>
+#include "Test.h"
+#include "../Image.h"
+#include "../Selection.h"
+#include "../Formatter.h"
+#include "../Exceptions.h"
+#include "../ImageCache.h"
+
+static Layer* patternLayer(int width, int height)
+{
+	Layer *l = new Layer(width, height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			(*l)[y][x] = Pixel((x * 53 + y * 29) % 256, (x * x + y * 7) % 256, (x * y * 13) % 256, 100 + (x + y) % 156);
+	return l;
+}
+
+//flattening only a crop gives exactly that part of the whole flattened image
+static bool cropsMatch(Image* image)
+{
+	Layer *whole = image->flatten();
+	int width = image->getWidth(), height = image->getHeight();
+	const Rectangle crops[] = { Rectangle(0, height - 1, width, height), Rectangle(3, 10, 5, 4), Rectangle(0, 4, 2, 5),
+		Rectangle(width - 4, height - 1, 4, 3), Rectangle(7, 7, 1, 1), Rectangle(-2, height + 2, 6, height + 5) };
+	bool same = true;
+	for (const Rectangle& crop : crops) {
+		Layer *part = image->flatten(crop);
+		int left = crop.getX() > 0 ? crop.getX() : 0;
+		int bottom = crop.getY() - crop.getHeight() + 1 > 0 ? crop.getY() - crop.getHeight() + 1 : 0;
+		for (int y = 0; y < part->getHeight(); y++)
+			for (int x = 0; x < part->getWidth(); x++) {
+				Pixel p = (*part)[y][x], q = (*whole)[bottom + y][left + x];
+				if (p.getR() != q.getR() || p.getG() != q.getG() || p.getB() != q.getB() || p.getA() != q.getA()) same = false;
+			}
+		delete part;
+	}
+	delete whole;
+	return same;
+}
+
+TEST(croppedFlattenMatchesWholeWithPointwiseAdjustment)
+{
+	Image *image = Image::getImage();
+	image->addLayer(patternLayer(16, 12));
+	Add add(40, -20, 7);
+	CompositeOperation o("pointwise");
+	o.addOperation(&add);
+	image->addAdjustmentLayer(o);
+	CHECK(cropsMatch(image));
+	Image::deleteImage();
+}
+
+TEST(croppedFlattenMatchesWholeWithMedianAdjustments)
+{
+	Image *image = Image::getImage();
+	image->addLayer(patternLayer(16, 12));
+	Median median;
+	Mul mul(2, 1, 3);
+	CompositeOperation o("neighbours");
+	o.addOperation(&median);
+	o.addOperation(&mul);
+	o.addOperation(&median);
+	image->addAdjustmentLayer(o);
+	image->addLayer(patternLayer(16, 12));
+	image->setLayerOpacity(0, 60);
+	std::vector<Rectangle> rects = { Rectangle(2, 9, 9, 6) };
+	image->addSelection(rects, "part");
+	image->addAdjustmentLayer(o);
+	CHECK(cropsMatch(image));
+	Image::deleteImage();
+}
+
+static bool samePixels(const Layer& a, const Layer& b)
+{
+	if (a.getWidth() != b.getWidth() || a.getHeight() != b.getHeight()) return false;
+	for (int y = 0; y < a.getHeight(); y++)
+		for (int x = 0; x < a.getWidth(); x++) {
+			Pixel p = a[y][x], q = b[y][x];
+			if (p.getR() != q.getR() || p.getG() != q.getG() || p.getB() != q.getB() || p.getA() != q.getA()) return false;
+		}
+	return true;
+}
+
+TEST(exportWritesEveryTargetOnce)
+{
+	Image *image = Image::getImage();
+	image->addLayer(patternLayer(16, 12));
+	//the same file named three ways goes to one writer
+	image->Export({ "export_a.bmp", "./export_a.bmp", "export_b.pam", "export_a.bmp" }, Rectangle(2, 9, 10, 6));
+	Layer *expected = image->flatten(Rectangle(2, 9, 10, 6));
+	for (const char *path : { "export_a.bmp", "export_b.pam" }) {
+		Layer *written = ImageFormatter::getReader(path)->load(path);
+		CHECK(samePixels(*written, *expected));
+		delete written;
+		std::remove(path);
+	}
+	delete expected;
+
+	//a bad target is reported before anything is written
+	CHECK_THROWS(image->Export(std::vector<std::string>{ "export_c.bmp", "export_c.nope" }), BadFormatException);
+	CHECK(!std::ifstream("export_c.bmp").is_open());
+	Image::deleteImage();
+}
+
+TEST(imageCacheNoticesSameSizeRewrite)
+{
+	const char *path = "cache_rewrite.bmp";
+	ImageFormatter *formatter = ImageFormatter::getReader(path);
+	Layer *first = patternLayer(8, 6);
+	formatter->write(*first, path);
+	delete ImageCache::getCache().load(path, formatter);
+
+	//same size and very likely the same second, only the finer time tells them apart
+	Layer *second = new Layer(*first);
+	(*second)[2][3] = Pixel(1, 2, 3, 255);
+	formatter->write(*second, path);
+	Layer *loaded = ImageCache::getCache().load(path, formatter);
+	CHECK(samePixels(*loaded, *second));
+	delete loaded;
+	delete first;
+	delete second;
+	ImageCache::getCache().clear();
+	std::remove(path);
+}
@@ -0,0 +1,60 @@
+#include <vector>
+#include "Test.h"
+#include "../Kernels.h"
+
+static const int COUNTS[] = { 0, 1, 3, 4, 7, 8, 15, 16, 17, 33, 100 };
+static const int CONSTANTS[] = { -1000, -7, -1, 1, 2, 3, 255, 1000 };
+
+//channel values around and outside 0..255, small enough that no kernel overflows
+static std::vector<int> sampleValues(int count)
+{
+	std::vector<int> values(count);
+	for (int i = 0; i < count; i++) values[i] = (i * 7919) % 200001 - 100000 + (i % 3 ? 0 : 128);
+	return values;
+}
+
+//runs kernel on both sets and tells whether every lane, vector or tail, came out the same
+template<class Run>
+static bool sameAsScalar(const Kernels& kernels, int count, Run run)
+{
+	const Kernels& scalar = *Kernels::getSupported()[0];
+	std::vector<int> expected = sampleValues(count), actual = expected;
+	run(scalar, expected.data());
+	run(kernels, actual.data());
+	return expected == actual;
+}
+
+static int fallback(int value, double param) { return value * 2 + (int)param; }
+
+TEST(kernelsMatchScalar)
+{
+	for (const Kernels *kernels : Kernels::getSupported())
+		for (int count : COUNTS) {
+			for (int k : CONSTANTS) {
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.add(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.inverseSub(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.mul(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.div(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.min(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.max(v, count, k); }));
+				CHECK(sameAsScalar(*kernels, count, [k, count](const Kernels& s, int* v) { s.fill(v, count, k); }));
+			}
+			CHECK(sameAsScalar(*kernels, count, [count](const Kernels& s, int* v) { s.abs(v, count); }));
+			CHECK(sameAsScalar(*kernels, count, [count](const Kernels& s, int* v) { s.clamp(v, count); }));
+		}
+}
+
+TEST(kernelsLookupMatchesScalar)
+{
+	std::vector<int> table(300);
+	for (int i = 0; i < 300; i++) table[i] = i * i % 251;
+	for (const Kernels *kernels : Kernels::getSupported())
+		for (int count : COUNTS) {
+			auto lookup = [&table, count](const Kernels& s, int* v) {
+				//squeezed into the table except every fifth value, so some vectors are all inside and some aren't
+				for (int i = 0; i < count; i++) if (i % 5 || i < 16) v[i] = (v[i] % 250 + 250) % 250;
+				s.lookup(v, count, table.data(), -20, (int)table.size(), fallback, 3.0);
+			};
+			CHECK(sameAsScalar(*kernels, count, lookup));
+		}
+}
@@ -0,0 +1,80 @@
+#include <memory>
+#include "Test.h"
+#include "../Layer.h"
+#include "../Operation.h"
+#include "../Selection.h"
+
+static Layer* sampleLayer()
+{
+	Layer *l = new Layer(12, 10);
+	for (int y = 0; y < 10; y++)
+		for (int x = 0; x < 12; x++)
+			(*l)[y][x] = Pixel((x * 29 + y * 13) % 256, (x * y * 5) % 256, (x * 71 + 40) % 256, 80 + x * 10);
+	return l;
+}
+
+static Selection rectangle(int x, int y, int width, int height)
+{
+	std::vector<Rectangle> rects(1, Rectangle(x, y, width, height));
+	return Selection(rects);
+}
+
+struct Step {
+	Operation *operation;
+	std::vector<Selection*> selections;
+};
+
+//the same steps applied lazily and then evaluated, and applied one by one
+static bool lazyMatchesEager(const std::vector<Step>& steps)
+{
+	std::unique_ptr<Layer> lazy(sampleLayer()), eager(sampleLayer());
+	Layer::setLazy(true);
+	for (const Step& s : steps) lazy->apply(s.operation, s.selections);
+	Layer::setLazy(false);
+	for (const Step& s : steps) eager->apply(s.operation, s.selections);
+
+	bool deferred = lazy->getPendingOperations() == steps.size();
+	lazy->evaluate();
+	const Layer &a = *lazy, &b = *eager;
+	for (int y = 0; y < a.getHeight(); y++)
+		for (int x = 0; x < a.getWidth(); x++) {
+			const Pixel &p = a[y][x], &q = b[y][x];
+			if (p.getR() != q.getR() || p.getG() != q.getG() || p.getB() != q.getB() || p.getA() != q.getA()) return false;
+		}
+	return deferred;
+}
+
+TEST(lazySkipsOperationsBeforeAFill)
+{
+	Add add(200, 10, -30);
+	Mul mul(3, 2, 0);
+	Fill fill(10, 250, 40, 128);
+	Sub sub(20, -20, 5);
+	Selection left = rectangle(0, 9, 6, 10), middle = rectangle(3, 6, 6, 4);
+	CHECK(lazyMatchesEager({ { &add, {} }, { &mul, {} }, { &fill, {} }, { &sub, {} } }));
+	CHECK(lazyMatchesEager({ { &add, { &left } }, { &mul, { &middle } }, { &fill, { &left } }, { &sub, { &left } } }));
+	//a fill on part of the image leaves the rest of an earlier operation standing
+	CHECK(lazyMatchesEager({ { &add, {} }, { &fill, { &middle } }, { &mul, {} } }));
+}
+
+TEST(lazyKeepsFillsReadByAwareOperations)
+{
+	Fill first(255, 0, 0, 255), second(0, 0, 255, 255);
+	Median median;
+	Add add(5, 5, 5);
+	Selection middle = rectangle(3, 6, 6, 4);
+	//the median reads the first fill around the edges of the selection before the second fill covers it
+	CHECK(lazyMatchesEager({ { &first, { &middle } }, { &median, {} }, { &second, { &middle } } }));
+	CHECK(lazyMatchesEager({ { &first, { &middle } }, { &add, { &middle } }, { &median, {} }, { &second, { &middle } }, { &add, {} } }));
+}
+
+TEST(lazyGroupsSameSelectionsAndClampsBetween)
+{
+	Add up(200, 200, 200);
+	Sub down(150, 150, 150);
+	Mul mul(2, 3, 4);
+	Selection left = rectangle(0, 9, 6, 10), same = rectangle(0, 9, 6, 10), right = rectangle(6, 9, 6, 10);
+	//clamping after up is what makes down leave different values
+	CHECK(lazyMatchesEager({ { &up, {} }, { &down, {} }, { &mul, {} } }));
+	CHECK(lazyMatchesEager({ { &up, { &left } }, { &down, { &same } }, { &mul, { &right } }, { &up, { &left } }, { &down, { &left } } }));
+}
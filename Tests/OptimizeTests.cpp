@@ -0,0 +1,82 @@
+#include "Test.h"
+#include "../Operation.h"
+#include "../Layer.h"
+
+//every channel value and sign the merges have to get right, alpha varies so fills can be told apart
+static Layer* sampleLayer()
+{
+	Layer *l = new Layer(64, 4);
+	for (int y = 0; y < 4; y++)
+		for (int x = 0; x < 64; x++)
+			(*l)[y][x] = Pixel(x * 4 + y - 20, 255 - x * 4, (x * 37 + y * 11) % 300 - 40, x + y);
+	return l;
+}
+
+static void runAll(Layer* l, const std::vector<Operation*>& operations)
+{
+	for (Operation *o : operations) o->operateLayer(l, {});
+}
+
+static bool sameLayers(Layer* a, Layer* b)
+{
+	for (int y = 0; y < a->getHeight(); y++)
+		for (int x = 0; x < a->getWidth(); x++) {
+			Pixel p = (*a)[y][x], q = (*b)[y][x];
+			if (p.getR() != q.getR() || p.getG() != q.getG() || p.getB() != q.getB() || p.getA() != q.getA()) return false;
+		}
+	return true;
+}
+
+//the optimized plan gives the unoptimized result and has the expected length
+static void checkPlan(const std::vector<Operation*>& operations, size_t expectedSize)
+{
+	std::vector<Operation*> plan = CompositeOperation::optimize(operations);
+	Layer *expected = sampleLayer(), *actual = sampleLayer();
+	runAll(expected, operations);
+	runAll(actual, plan);
+	CHECK(plan.size() == expectedSize);
+	CHECK(sameLayers(expected, actual));
+	delete expected;
+	delete actual;
+	for (Operation *o : plan) delete o;
+	for (Operation *o : operations) delete o;
+}
+
+TEST(optimizeMergesAffineOperations)
+{
+	checkPlan({ new Add(5, -3, 7), new Sub(2, 2, -9), new InverseSub(100, 50, 0), new Invert() }, 1);
+	checkPlan({ new Add(1, 2, 3), new Sub(1, 2, 3) }, 0);
+}
+
+TEST(optimizeFoldsAffineOperationsIntoFill)
+{
+	checkPlan({ new Fill(10, 20, 30, 77), new Add(5, 5, 5), new InverseSub(255, 0, 100), new Sub(1, -2, 3) }, 1);
+	checkPlan({ new Fill(10, 20, 30, 77), new Invert() }, 1);
+}
+
+TEST(optimizeMergesMulDivMinMax)
+{
+	checkPlan({ new Mul(2, 3, -1), new Mul(4, -2, 5) }, 1);
+	checkPlan({ new Div(2, 3, -4), new Div(3, -2, 5) }, 1);
+	checkPlan({ new Min(100, 30, 255), new Min(50, 200, -10) }, 1);
+	checkPlan({ new Max(100, 30, 255), new Max(50, 200, -10) }, 1);
+	//an overflowing product stays two steps
+	checkPlan({ new Mul(1 << 20, 1, 1), new Mul(1 << 20, 1, 1) }, 2);
+	//merging stops at an operation in between
+	checkPlan({ new Mul(2, 2, 2), new Add(1, 1, 1), new Mul(3, 3, 3) }, 3);
+}
+
+TEST(optimizeDropsOperationsBeforeLastFill)
+{
+	checkPlan({ new Mul(3, 3, 3), new Fill(1, 2, 3, 4), new Abs(), new Fill(9, 8, 7, 6), new Min(5, 5, 5) }, 2);
+}
+
+TEST(optimizeFlattensNestedComposites)
+{
+	Add add(3, 3, 3);
+	Mul mul(2, 2, 2);
+	CompositeOperation *inner = new CompositeOperation("inner");
+	inner->addOperation(&add);
+	inner->addOperation(&mul);
+	checkPlan({ new Add(1, 1, 1), inner, new Mul(5, 5, 5) }, 2);
+}
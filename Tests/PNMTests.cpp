@@ -0,0 +1,38 @@
+#include <fstream>
+#include <cstdio>
+#include "Test.h"
+#include "../Formatter.h"
+#include "../Layer.h"
+#include "../Exceptions.h"
+
+static Layer* loadHeader(const std::string& header)
+{
+	const char *path = "pnm_test.ppm";
+	{
+		std::ofstream FILE(path, std::ofstream::binary);
+		FILE << header << std::string(12, '\0');
+	}
+	PNMFormatter formatter(PNMFormatter::PPM);
+	try {
+		Layer *l = formatter.load(path);
+		std::remove(path);
+		return l;
+	}
+	catch (...) {
+		std::remove(path);
+		throw;
+	}
+}
+
+TEST(pnmLoadsSmallHeader)
+{
+	Layer *l = loadHeader("P6\n2 2\n255\n");
+	CHECK(l->getWidth() == 2 && l->getHeight() == 2);
+	delete l;
+}
+
+TEST(pnmRejectsHeaderNumbersThatOverflow)
+{
+	CHECK_THROWS(delete loadHeader("P6\n99999999999999999999 1\n255\n"), BadFormatException);
+	CHECK_THROWS(delete loadHeader("P6\n1 4294967297\n255\n"), BadFormatException);
+}
@@ -0,0 +1,103 @@
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include "Test.h"
+#include "../StripPipeline.h"
+#include "../Formatter.h"
+#include "../Image.h"
+#include "../Operation.h"
+#include "../Exceptions.h"
+
+static std::string readFile(const std::string& path)
+{
+	std::ifstream FILE(path, std::ifstream::binary);
+	return std::string((std::istreambuf_iterator<char>(FILE)), std::istreambuf_iterator<char>());
+}
+
+static bool exists(const std::string& path)
+{
+	return std::ifstream(path).is_open();
+}
+
+static void writeSample(const std::string& path, int width, int height)
+{
+	Layer l(width, height);
+	for (int y = 0; y < height; y++)
+		for (int x = 0; x < width; x++)
+			l[y][x] = Pixel((x * 41 + y * 17) % 256, (x * y + 3 * y) % 256, (x * x * 7 + y) % 256, 255);
+	ImageFormatter::getWriter(path)->write(l, path);
+}
+
+//medians between pointwise runs, so stages lag behind each other by different reaches
+static CompositeOperation* sampleRecipe()
+{
+	Add add(30, -10, 5);
+	Median median;
+	Mul mul(3, 2, 1);
+	Sub sub(100, 0, 60);
+	Invert invert;
+	CompositeOperation *o = new CompositeOperation("strips");
+	for (Operation *step : std::vector<Operation*>{ &add, &median, &mul, &median, &median, &sub, &invert, &median })
+		o->addOperation(step);
+	return o;
+}
+
+//what the whole image path writes for the same input
+static std::string wholeResult(const std::string& input, const CompositeOperation& o)
+{
+	ImageFormatter *formatter = ImageFormatter::getReader(input);
+	Layer *l = formatter->load(input);
+	o.operateLayer(l, {}, true);
+	std::vector<Layer*> layers(1, l);
+	Layer *flattened = Image::flattenLayers(layers, Rectangle(0, l->getHeight() - 1, l->getWidth(), l->getHeight()));
+	std::string path = "strip_whole." + FormatTable<ImageFormatter>::getExtension(input);
+	formatter->write(*flattened, path);
+	delete flattened;
+	delete l;
+	std::string result = readFile(path);
+	std::remove(path.c_str());
+	return result;
+}
+
+TEST(stripPipelineMatchesWholeImage)
+{
+	CompositeOperation *o = sampleRecipe();
+	int previousRows = StripPipeline::getStripRows();
+	for (const char *extension : { "bmp", "ppm" }) {
+		std::string input = std::string("strip_in.") + extension, output = std::string("strip_out.") + extension;
+		writeSample(input, 13, 37);
+		std::string expected = wholeResult(input, *o);
+		for (int rows : { 1, 2, 3, 64 }) {
+			StripPipeline::setStripRows(rows);
+			CHECK(StripPipeline::run(input, output, *o));
+			CHECK(readFile(output) == expected);
+			CHECK(!exists(output + ".tmp"));
+			std::remove(output.c_str());
+		}
+		std::remove(input.c_str());
+	}
+	StripPipeline::setStripRows(previousRows);
+	delete o;
+}
+
+TEST(stripPipelineKeepsTheOriginalWhenReadingFails)
+{
+	CompositeOperation *o = sampleRecipe();
+	int previousRows = StripPipeline::getStripRows();
+	StripPipeline::setStripRows(2);
+	const std::string path = "strip_truncated.bmp";
+	writeSample(path, 13, 37);
+	std::string whole = readFile(path);
+	std::string truncated = whole.substr(0, whole.size() - whole.size() / 3);
+	{
+		std::ofstream FILE(path, std::ofstream::binary);
+		FILE << truncated;
+	}
+	//the output replaces the input, so a half written result would lose the original
+	CHECK_THROWS(StripPipeline::run(path, path, *o), BadFormatException);
+	CHECK(readFile(path) == truncated);
+	CHECK(!exists(path + ".tmp"));
+	std::remove(path.c_str());
+	StripPipeline::setStripRows(previousRows);
+	delete o;
+}
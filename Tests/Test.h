@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+
+//tests register themselves before main runs, Tests.cpp runs every one and counts the failures
+class Test {
+private:
+	typedef void(*Body)();
+	struct Entry {
+		const char *name;
+		Body body;
+	};
+	static std::vector<Entry>& getTests();
+public:
+	struct Failure {
+		std::string message;
+	};
+
+	Test(const char* name, Body body) { getTests().push_back(Entry{ name, body }); }
+	static void fail(const char* file, int line, const char* condition);
+	//number of failed tests
+	static int runAll();
+};
+
+#define TEST(name) static void name(); static Test name##Test(#name, name); static void name()
+#define CHECK(condition) do { if (!(condition)) Test::fail(__FILE__, __LINE__, #condition); } while (0)
+#define CHECK_THROWS(statement, exception) do { bool thrown = false; try { statement; } catch (exception&) { thrown = true; } \
+	if (!thrown) Test::fail(__FILE__, __LINE__, #statement " throws " #exception); } while (0)
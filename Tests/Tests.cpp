@@ -0,0 +1,40 @@
+#include <iostream>
+#include "Test.h"
+#include "../Menu.h"
+
+std::vector<Test::Entry>& Test::getTests()
+{
+	static std::vector<Entry> tests;
+	return tests;
+}
+
+void Test::fail(const char * file, int line, const char * condition)
+{
+	throw Failure{ std::string(file) + ":" + std::to_string(line) + ": " + condition };
+}
+
+int Test::runAll()
+{
+	int failed = 0;
+	for (const Entry& test : getTests()) {
+		try {
+			test.body();
+			std::cout << "ok\t" << test.name << std::endl;
+		}
+		catch (Failure& f) {
+			std::cout << "FAIL\t" << test.name << "\t" << f.message << std::endl;
+			failed++;
+		}
+		catch (...) {
+			std::cout << "FAIL\t" << test.name << "\tunexpected exception" << std::endl;
+			failed++;
+		}
+	}
+	std::cout << getTests().size() - failed << " passed, " << failed << " failed" << std::endl;
+	return failed;
+}
+
+int main() {
+	Menu::initialize();
+	return Test::runAll() ? 1 : 0;
+}
@@ -0,0 +1,101 @@
+#include <atomic>
+#include <memory>
+#include <exception>
+#include "ThreadPool.h"
+
+ThreadPool & ThreadPool::getPool()
+{
+	static ThreadPool pool(std::thread::hardware_concurrency());
+	return pool;
+}
+
+ThreadPool::ThreadPool(unsigned threads) : stopping(false)
+{
+	if (threads == 0) threads = 1;
+	for (unsigned i = 0; i < threads; i++) {
+		workers.push_back(std::thread(&ThreadPool::work, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	condition.notify_all();
+	for (std::thread& t : workers) {
+		t.join();
+	}
+}
+
+void ThreadPool::work()
+{
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return;
+			task = std::move(tasks.front());
+			tasks.pop();
+		}
+		task();
+	}
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push(std::move(task));
+	}
+	condition.notify_one();
+}
+
+void ThreadPool::parallelFor(int count, const std::function<void(int)>& body)
+{
+	if (count <= 0) return;
+
+	struct State {
+		std::function<void(int)> body;
+		int count;
+		std::atomic<int> next, done;
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::exception_ptr error;
+	};
+
+	std::shared_ptr<State> state = std::make_shared<State>();
+	state->body = body;
+	state->count = count;
+	state->next = 0;
+	state->done = 0;
+
+	auto run = [state]() {
+		int i;
+		while ((i = state->next++) < state->count) {
+			try {
+				state->body(i);
+			}
+			catch (...) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				if (!state->error) state->error = std::current_exception();
+			}
+			if (++state->done == state->count) {
+				std::lock_guard<std::mutex> lock(state->mutex);
+				state->condition.notify_all();
+			}
+		}
+	};
+
+	int helpers = count - 1 < (int)getSize() ? count - 1 : getSize();
+	for (int i = 0; i < helpers; i++) {
+		submit(run);
+	}
+	run();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->condition.wait(lock, [&state]() { return state->done == state->count; });
+	if (state->error) std::rethrow_exception(state->error);
+}
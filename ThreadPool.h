@@ -0,0 +1,29 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+class ThreadPool {
+private:
+	std::vector<std::thread> workers;
+	std::queue<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping;
+
+	void work();
+public:
+	static ThreadPool& getPool();
+
+	ThreadPool(unsigned threads);
+	~ThreadPool();
+
+	unsigned getSize() const { return workers.size(); }
+
+	void submit(std::function<void()> task);
+	//the calling thread takes part in the loop, so nested calls from inside a task can't deadlock
+	void parallelFor(int count, const std::function<void(int)>& body);
+};
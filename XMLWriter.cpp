@@ -0,0 +1,83 @@
+#include "XMLWriter.h"
+
+void XMLWriter::openPending()
+{
+	//an element without children is printed as <name/>, so its start tag waits for the first child
+	if (!pending) return;
+	indent(elements.size() - 1);
+	buffer += '<';
+	buffer += elements.back();
+	buffer += ">\n";
+	pending = false;
+}
+
+void XMLWriter::escape(const std::string & value)
+{
+	for (char c : value) {
+		switch (c) {
+		case '<': buffer += "&lt;"; break;
+		case '>': buffer += "&gt;"; break;
+		case '\'': buffer += "&apos;"; break;
+		case '"': buffer += "&quot;"; break;
+		case '&': buffer += "&amp;"; break;
+		default: buffer += c;
+		}
+	}
+}
+
+void XMLWriter::openElement(const std::string & name)
+{
+	openPending();
+	elements.push_back(name);
+	pending = true;
+}
+
+void XMLWriter::closeElement()
+{
+	if (pending) {
+		indent(elements.size() - 1);
+		buffer += '<';
+		buffer += elements.back();
+		buffer += "/>\n";
+		pending = false;
+	}
+	else {
+		indent(elements.size() - 1);
+		buffer += "</";
+		buffer += elements.back();
+		buffer += ">\n";
+	}
+	elements.pop_back();
+	flushIfFull();
+}
+
+void XMLWriter::element(const std::string & name, const std::string & value)
+{
+	openPending();
+	indent(elements.size());
+	buffer += '<';
+	buffer += name;
+	if (value.empty()) {
+		buffer += "/>\n";
+	}
+	else {
+		buffer += '>';
+		escape(value);
+		buffer += "</";
+		buffer += name;
+		buffer += ">\n";
+	}
+	flushIfFull();
+}
+
+void XMLWriter::endDocument()
+{
+	buffer += '\n';
+	flush();
+}
+
+void XMLWriter::flush()
+{
+	out.write(buffer.data(), buffer.size());
+	buffer.clear();
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <ostream>
+#include <string>
+#include <vector>
+
+//writes elements as they are visited, laid out the same way rapidxml prints a document
+class XMLWriter {
+private:
+	static const size_t BUFFER_SIZE = 1 << 16;
+
+	std::ostream& out;
+	std::string buffer;
+	std::vector<std::string> elements;
+	bool pending;
+
+	void indent(size_t depth) { buffer.append(depth, '\t'); }
+	void openPending();
+	void escape(const std::string& value);
+	void flushIfFull() { if (buffer.size() >= BUFFER_SIZE) flush(); }
+public:
+	XMLWriter(std::ostream& out) : out(out), pending(false) { buffer.reserve(BUFFER_SIZE); }
+	XMLWriter(const XMLWriter&) = delete;
+	XMLWriter& operator=(const XMLWriter&) = delete;
+	~XMLWriter() { flush(); }
+
+	void openElement(const std::string& name);
+	void closeElement();
+	void element(const std::string& name, const std::string& value);
+	void element(const std::string& name, int value) { element(name, std::to_string(value)); }
+	void endDocument();
+	void flush();
+};